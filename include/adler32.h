@@ -5,6 +5,8 @@
 #include <stddef.h>
 
 #define ADLER32_CHECKSUM_INIT 0x0001
+#define ADLER32_MODULUS 0xfff1
+#define ADLER32_BLOCK_MAX 5552 // Bytes that can be summed before the 32-bit sums may overflow
 
 union adler32_t
 {
@@ -23,4 +25,37 @@ static __inline__ void adler32_update(union adler32_t *adler, uint8_t byte)
    adler->vars[1] = (adler->vars[1] + adler->vars[0]) % 0xfff1;
 }
 
+static __inline__ void adler32_update_block(union adler32_t *adler, const uint8_t *data, size_t size)
+{
+   uint32_t a = adler->vars[0];
+   uint32_t b = adler->vars[1];
+   while (size > 0)
+   {
+      size_t block = size < ADLER32_BLOCK_MAX ? size : ADLER32_BLOCK_MAX;
+      size -= block;
+      while (block--)
+      {
+         a += *data++;
+         b += a;
+      }
+      a %= ADLER32_MODULUS;
+      b %= ADLER32_MODULUS;
+   }
+   adler->vars[0] = (uint16_t)a;
+   adler->vars[1] = (uint16_t)b;
+}
+
+// Checksum of two consecutive byte ranges from the checksum of each, size is the length of the second range
+static __inline__ uint32_t adler32_combine(uint32_t first, uint32_t second, size_t size)
+{
+   uint32_t remainder = (uint32_t)(size % ADLER32_MODULUS);
+   uint32_t a = first & 0xffff;
+   uint32_t b = (uint32_t)(((uint64_t)remainder * a) % ADLER32_MODULUS);
+   a += (second & 0xffff) + ADLER32_MODULUS - 1;
+   b += (first >> 16) + (second >> 16) + ADLER32_MODULUS - remainder;
+   a %= ADLER32_MODULUS;
+   b %= ADLER32_MODULUS;
+   return (b << 16) | a;
+}
+
 #endif // _ADLER32_
\ No newline at end of file
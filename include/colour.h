@@ -0,0 +1,29 @@
+#ifndef _COLOUR_
+#define _COLOUR_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gamma.h"
+#include "png_utils.h"
+
+#define CHROMA_SHIFT 12 // Q12 fixed point coefficients
+#define CHROMA_ROUND (1 << (CHROMA_SHIFT - 1))
+#define CHROMA_LIMIT (1 << 20) // Coefficients are clamped so 8-bit sums fit in 32 bits
+
+// Image primaries straight to sRGB, the cHRM RGB to XYZ matrix pre-multiplied by XYZ to sRGB
+struct chroma_matrix_t
+{
+   int32_t data[3][3];
+   bool narrow; // Every coefficient fits in 16 bits, required by the SIMD path
+   bool identity; // Leaves every 8-bit sample unchanged, the primaries are already sRGB
+};
+
+// Fails when a coefficient is not finite
+int chroma_matrix_set(struct chroma_matrix_t *matrix, const struct matrix_3x3_t *rgb_to_srgb);
+// Fails when the chromaticities give a degenerate matrix
+int chroma_matrix_build(struct chroma_matrix_t *matrix, const struct matrix_3x3_t *rgb_to_xyz);
+// Converts the RGB samples of one row to sRGB, saturates, then applies gamma when a table is given, alpha is left as it is
+void chroma_correct_row(const struct chroma_matrix_t *matrix, const struct gamma_table_t *gamma, uint8_t *row, uint32_t width, uint8_t channels, uint8_t bit_depth);
+
+#endif
@@ -8,6 +8,15 @@
 #define PNG_INTERLACE_NONE 0
 #define PNG_INTERLACE_ADAM7 1
 #define FILTER_BYTE_SIZE 1
+#define FILTER_TYPE_MAX 4
+
+#define FILTER_ERROR_NONE 0
+#define FILTER_ERROR_INVALID_TYPE 1
+#define FILTER_ERROR_EXCESS_DATA 2
+
+#define FILTER_SAMPLES_EXPANDED 0
+#define FILTER_SAMPLES_INDICES 1 // Palette indices, one byte each
+#define FILTER_SAMPLES_PACKED 2 // Samples at the image's bit depth, packed as in its scanlines
 
 struct sub_image_t
 {
@@ -42,7 +51,7 @@ struct output_settings_t
     {
         struct rgb_t *buffer;
         uint8_t *alpha;
-        uint8_t size;
+        uint16_t size;
     } palette;
     struct
     {
@@ -53,10 +62,24 @@ struct output_settings_t
         uint8_t index;
     } pixel;
     uint32_t image_width;
+    uint32_t image_height;
+    uint32_t row_stride; // Output bytes per row, 0 for tightly packed rows
+    uint8_t bottom_up;
+    uint8_t row_buffer; // Every row is written to the start of the output, for row_complete to move elsewhere
+    uint8_t samples; // FILTER_SAMPLES_*, pixel.size is 1 for anything but expanded samples
     uint8_t filter_type;
+    uint8_t filter_error;
+    // Called by filter() with each completed row of a non-interlaced image
+    void (*row_complete)(const void *arg, const struct output_settings_t *settings, uint8_t *row);
+    const void *row_arg;
 };
 
 void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_settings);
+void validate_filter(uint8_t byte, struct data_buffer_t *output_image, void *output_settings);
+int filter_complete(const struct output_settings_t *settings);
+// Positions settings and output at a scanline of a sub-image, the scanline buffers must be zeroed
+// Only valid for the first scanline of a sub-image or one whose filter type does not read the previous scanline
+void filter_start_scanline(struct output_settings_t *settings, uint8_t image_index, uint32_t row_index, struct data_buffer_t *output_image);
 
 void set_interlacing(const struct png_header_t *png_header, const uint32_t bits_per_pixel, struct sub_image_t *sub_images);
 
@@ -0,0 +1,11 @@
+#ifndef _FLATTEN_
+#define _FLATTEN_
+
+#include <stdint.h>
+
+// Blends one row of GA or RGBA pixels onto background and writes them to output without alpha
+// channels is the colour channel count, 1 or 3, background holds that many samples at bit_depth
+// output may be row itself, or must not overlap it
+void flatten_row(const uint8_t *row, uint8_t *output, uint32_t width, uint8_t channels, uint8_t bit_depth, const uint16_t *background);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _FORMAT_
+#define _FORMAT_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png.h"
+
+// Conversion from decoded rows to an output format
+struct format_settings_t
+{
+   enum png_output_format_t format;
+   bool premultiply;
+   float scale[4]; // Planar float formats, per channel of the decoded rows
+   float bias[4];
+   size_t plane_size; // Bytes between the planes of planar formats
+   enum png_yuv_matrix_t matrix;
+   size_t chroma_plane_size; // Bytes from the U plane of YUV formats to the V plane
+   uint8_t channel; // PNG_FORMAT_CHANNEL8, 0 to 3 for red, green, blue and alpha
+};
+
+static __inline__ uint8_t format_channels(enum pixel_format_t mode)
+{
+   return mode > RGBA ? 4 : (uint8_t)mode;
+}
+
+static __inline__ bool format_planar(enum png_output_format_t format)
+{
+   return format == PNG_FORMAT_PLANAR_F32 || format == PNG_FORMAT_PLANAR_F16;
+}
+
+static __inline__ bool format_yuv(enum png_output_format_t format)
+{
+   return format == PNG_FORMAT_I444 || format == PNG_FORMAT_I420 || format == PNG_FORMAT_NV12;
+}
+
+// Samples are written by the unfilter as the image stores them
+static __inline__ bool format_native(enum png_output_format_t format)
+{
+   return format == PNG_FORMAT_INDEX8 || format == PNG_FORMAT_PACKED;
+}
+
+// One 8-bit sample per pixel taken from the decoded channels
+static __inline__ bool format_projection(enum png_output_format_t format)
+{
+   return format == PNG_FORMAT_ALPHA8 || format == PNG_FORMAT_LUMA8 || format == PNG_FORMAT_CHANNEL8;
+}
+
+// Planes of an output image, its rows hold pixel_size bytes per pixel, YUV formats count only the Y plane
+static __inline__ uint8_t format_planes(enum png_output_format_t format, enum pixel_format_t mode)
+{
+   return format_planar(format) ? format_channels(mode) : 1;
+}
+
+static __inline__ uint8_t format_pixel_size(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth)
+{
+   return (uint8_t)((format_planar(format) || format_yuv(format) || format_native(format) ? 1 : format_channels(mode)) * (bit_depth >> 3));
+}
+
+// Bytes in a row of width pixels of the first plane
+static __inline__ uint64_t format_row_size(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, uint32_t width)
+{
+   if (format == PNG_FORMAT_PACKED)
+   {
+      return ((uint64_t)width * bit_depth + 0x07) >> 3;
+   }
+   return (uint64_t)width * format_pixel_size(format, mode, bit_depth);
+}
+
+// Bytes of the U and V planes following a Y plane of height rows of stride bytes, 0 for other formats
+size_t format_chroma_size(enum png_output_format_t format, uint32_t stride, uint32_t height, uint32_t *chroma_stride);
+
+// Mode and bit depth of rows in format, decoded from rows of mode at bit_depth
+// Native formats take the image's own bit depth and are always G
+void format_output(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, enum pixel_format_t *output_mode, uint8_t *output_bit_depth);
+// False when rows need no conversion at all
+bool format_converts(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, bool premultiply);
+// Converts one row of G, GA, RGB or RGBA pixels, output may not overlap row
+// Planar formats write to the same row of each plane, starting with the plane output is in
+void format_row(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings);
+// Converts one row to YUV, or two for subsampled formats where second is NULL on the last row of an odd height
+// chroma is the row of the U plane, or of the UV plane for NV12
+void format_yuv_rows(const uint8_t *first, const uint8_t *second, uint8_t *first_luma, uint8_t *second_luma, uint8_t *chroma, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings);
+// Converts one row to a projection format, only the channels the projection needs are read
+void format_projection_row(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings);
+
+#endif
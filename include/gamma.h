@@ -0,0 +1,30 @@
+#ifndef _GAMMA_
+#define _GAMMA_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GAMMA_CACHE_SIZE 16
+#define GAMMA_SCALE 100000 // gAMA chunks store gamma x 100000
+#define GAMMA_SRGB 45455 // Approximates the sRGB transfer function, the encoding tables target
+#define GAMMA_THRESHOLD 1000 // Gammas within 1% of each other are treated as equal, a sample moves by at most one step
+
+// Re-encodes each sample value for an sRGB display, value ^ (GAMMA_SRGB / gamma) normalised to the sample range
+struct gamma_table_t
+{
+   uint32_t gamma; // As stored in the gAMA chunk
+   uint8_t table_8[256];
+   uint16_t *table_16; // 65536 entries, only decoder owned tables have one
+};
+
+static __inline__ bool gamma_close(uint32_t gamma, uint32_t target)
+{
+   return (uint64_t)(gamma > target ? gamma - target : target - gamma) * GAMMA_SCALE < (uint64_t)target * GAMMA_THRESHOLD;
+}
+
+// 8-bit tables shared by every decoder in the process and never freed, NULL when the cache is full
+const struct gamma_table_t *gamma_table_find(uint32_t gamma);
+// Fills a table outside the cache, table_16 must hold 65536 entries when bit_depth is 16
+void gamma_table_build(struct gamma_table_t *table, uint32_t gamma, uint8_t bit_depth);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _ICC_
+#define _ICC_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "colour.h"
+
+#define ICC_CACHE_SIZE 8
+#define ICC_PROFILE_MAX 0x400000 // Decompressed iCCP bytes
+#define ICC_ENCODE_8_SHIFT 2     // Linear samples are 16-bit, the 8-bit encoding table is indexed by their top 14 bits
+#define ICC_ENCODE_8_SIZE (0x10000 >> ICC_ENCODE_8_SHIFT)
+#define ICC_TABLES_16_SIZE (4 * 0x10000 * sizeof(uint16_t)) // Three decoding tables and the encoding table
+
+// Matrix/TRC profile compiled to shaping tables around a fixed-point matrix, output is sRGB
+struct icc_transform_t
+{
+   uint8_t key[16]; // MD5 of the decompressed profile
+   uint8_t channels; // 1 for GRAY profiles, 3 for RGB
+   bool identity; // Leaves every 8-bit sample unchanged, an sRGB profile
+   bool usable; // False for profiles without a matrix/TRC form, cached so they are not parsed again
+   struct chroma_matrix_t matrix; // Linear profile RGB to linear sRGB
+   uint16_t linear_8[3][256]; // Encoded 8-bit samples to linear
+   uint8_t encode_8[ICC_ENCODE_8_SIZE]; // Linear to sRGB encoded
+   uint16_t *tables_16; // ICC_TABLES_16_SIZE bytes, only decoder owned transforms have them
+};
+
+// Transforms without 16-bit tables are shared by every decoder in the process and never freed
+// Returns -1 for profiles without a usable matrix/TRC form, transform is fallback once the cache is full
+int icc_transform_find(const uint8_t *profile, size_t size, struct icc_transform_t *fallback, const struct icc_transform_t **transform);
+// tables_16 must hold ICC_TABLES_16_SIZE bytes
+int icc_tables_16_build(struct icc_transform_t *transform, const uint8_t *profile, size_t size);
+// Converts the colour samples of one row in place, alpha is left as it is
+void icc_transform_row(const struct icc_transform_t *transform, uint8_t *row, uint32_t width, uint8_t channels, uint8_t bit_depth);
+
+#endif
@@ -25,7 +25,7 @@ union md5_t
 #define SHIFT_MASK 0x00000003
 #define INPUT_MASK 0x0000000f
 
-const uint32_t T[64] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+static const uint32_t T[64] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
                         0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
                         0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
                         0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
@@ -48,13 +48,14 @@ const uint32_t T[64] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
 #error Endianess not defined
 #endif
 
-const int shift_A[4] = {7, 12, 17, 22};
-const int shift_B[4] = {5, 9, 14, 20};
-const int shift_C[4] = {4, 11, 16, 23};
-const int shift_D[4] = {6, 10, 15, 21};
+static const int shift_A[4] = {7, 12, 17, 22};
+static const int shift_B[4] = {5, 9, 14, 20};
+static const int shift_C[4] = {4, 11, 16, 23};
+static const int shift_D[4] = {6, 10, 15, 21};
 
 
-union md5_t md5_hash(const uint8_t *data, const size_t bitcount)
+// Data is bitcount bits long
+static __inline__ union md5_t md5_hash(const uint8_t *data, const size_t bitcount)
 {
     size_t data_index = 0;
     uint64_t padding = bitcount % BITS_PER_BLOCK;
@@ -67,7 +68,7 @@ union md5_t md5_hash(const uint8_t *data, const size_t bitcount)
 
     size_t bytes = bitcount >> 3;
     uint32_t N = ((bitcount + padding) >> 3) + sizeof(uint64_t);
-    for (int b = 0; b < N; b += BYTES_PER_BLOCK)
+    for (uint32_t b = 0; b < N; b += BYTES_PER_BLOCK)
     {
         uint32_t word_buffer[UINT32_PER_BLOCK];
         int buffer_index = 0;
@@ -90,7 +91,7 @@ union md5_t md5_hash(const uint8_t *data, const size_t bitcount)
                 {
                     --buffer_index;
                 }
-                buff_ptr[buffer_index] &= 0xff << 8 - bits;
+                buff_ptr[buffer_index] &= 0xff << (8 - bits);
                 buff_ptr[buffer_index] |= 0x80 >> bits;
                 ++buffer_index;
                 ++data_index;
@@ -152,46 +153,46 @@ union md5_t md5_hash(const uint8_t *data, const size_t bitcount)
         C += c0;
         D += d0;
     }
-    union md5_t out = {A, B, C, D};
+    union md5_t out = {{A, B, C, D}};
     return out;
 }
 
-void md5_test_suite()
+static __inline__ void md5_test_suite(void)
 {
     // Test cases
     const char *a = "";
     printf("%s\n", a);
-    union md5_t r = md5_hash(a, 0*8);
+    union md5_t r = md5_hash((const uint8_t *)a, 0*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\td41d8cd9 8f00b204 e9800998 ecf8427e expected\n");
     const char *b = "a";
     printf("%s\n", b);
-    r = md5_hash(b, 1*8);
+    r = md5_hash((const uint8_t *)b, 1*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\t0cc175b9 c0f1b6a8 31c399e2 69772661 expected\n");
     const char *c = "abc";
     printf("%s\n", c);
-    r = md5_hash(c, 3*8);
+    r = md5_hash((const uint8_t *)c, 3*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\t90015098 3cd24fb0 d6963f7d 28e17f72 expected\n");
     const char *d = "message digest";
     printf("%s\n", d);
-    r = md5_hash(d, 14*8);
+    r = md5_hash((const uint8_t *)d, 14*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\tf96b697d 7cb7938d 525a2f31 aaf161d0 expected\n");
     const char *e = "abcdefghijklmnopqrstuvwxyz";
     printf("%s\n", e);
-    r = md5_hash(e, 26*8);
+    r = md5_hash((const uint8_t *)e, 26*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\tc3fcd3d7 6192e400 7dfb496c ca67e13b expected\n");
     const char *f = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
     printf("%s\n", f);
-    r = md5_hash(f, 62*8);
+    r = md5_hash((const uint8_t *)f, 62*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\td174ab98 d277d9f5 a5611c2c 9f419d9f expected\n");
     const char *g = "12345678901234567890123456789012345678901234567890123456789012345678901234567890";
     printf("%s\n", g);
-    r = md5_hash(g, 80*8);
+    r = md5_hash((const uint8_t *)g, 80*8);
     printf("\t%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x\n", r.out[0], r.out[1], r.out[2], r.out[3], r.out[4], r.out[5], r.out[6], r.out[7], r.out[8], r.out[9], r.out[10], r.out[11], r.out[12], r.out[13], r.out[14], r.out[15]);
     printf("\t57edf4a2 2be3c955 ac49da2e 2107b67a expected\n");
 }
@@ -10,7 +10,49 @@ enum pixel_format_t
     G=1,
     GA,
     RGB,
-    RGBA
+    RGBA,
+    BGRA,
+    RGBX, // Fourth byte is padding, set to 255
+    BGRX
+};
+
+// Applied to each row as it is decoded, 8-bit formats round 16-bit samples
+enum png_output_format_t
+{
+    PNG_FORMAT_SOURCE = 0,  // Channels and bit depth of the image, 16-bit samples are big endian
+    PNG_FORMAT_SOURCE_8,    // Channels of the image with 8-bit samples
+    PNG_FORMAT_NATIVE_16,   // As PNG_FORMAT_SOURCE with 16-bit samples in host byte order
+    PNG_FORMAT_RGBA8,
+    PNG_FORMAT_BGRA8,
+    PNG_FORMAT_RGBX8,
+    PNG_FORMAT_BGRX8,
+    PNG_FORMAT_PLANAR_F32,  // One plane per channel of host order floats, scaled per channel
+    PNG_FORMAT_PLANAR_F16,  // As PNG_FORMAT_PLANAR_F32 with IEEE half precision samples
+    PNG_FORMAT_I444,        // 8-bit limited range Y, U and V planes, alpha is dropped
+    PNG_FORMAT_I420,        // As PNG_FORMAT_I444 with U and V averaged over 2x2 pixels
+    PNG_FORMAT_NV12,        // As PNG_FORMAT_I420 with U and V interleaved in one plane
+    PNG_FORMAT_INDEX8,      // Palette indices of indexed images, one byte each, others decode as PNG_FORMAT_SOURCE
+    PNG_FORMAT_PACKED,      // Rows packed at the bit depth of indexed or low bit depth greyscale images, others as PNG_FORMAT_SOURCE
+    PNG_FORMAT_ALPHA8,      // Alpha samples only, 255 for images without alpha
+    PNG_FORMAT_LUMA8,       // Full range luma only, weighted as the yuv_matrix option gives
+    PNG_FORMAT_CHANNEL8     // Samples of the channel option only, grey images give grey for red, green and blue
+};
+
+enum png_yuv_matrix_t
+{
+    PNG_YUV_BT601 = 0,
+    PNG_YUV_BT709
+};
+
+struct png_decoder_t;
+
+// Replaces malloc, realloc and free for a decode, user is passed through to each call
+struct png_allocator_t
+{
+    void *(*alloc)(size_t size, void *user);
+    void *(*realloc)(void *ptr, size_t size, void *user);
+    void (*free)(void *ptr, void *user);
+    void *user;
 };
 
 struct image_t
@@ -19,12 +61,159 @@ struct image_t
     uint32_t size;
     uint32_t width;
     uint32_t height;
+    uint32_t stride; // Bytes from the start of one row to the next
+    uint8_t bit_depth;
+    enum pixel_format_t mode;
+    struct png_decoder_t *decoder; // Context that close_png returns data to, NULL if data is freed
+    const struct png_allocator_t *allocator; // Frees data when decoder is NULL, NULL for the C library, must outlive the image
+    uint8_t external; // Data is a caller buffer, close_png leaves it alone
+    enum png_output_format_t format;
+    uint8_t premultiplied; // Colour samples are multiplied by alpha
+    size_t plane_size; // Bytes from one plane of a planar format to the next, for YUV formats from Y to the chroma planes
+    uint32_t chroma_stride; // YUV formats, rows of the chroma planes, I420 V follows U after (height + 1) / 2 of them
+    uint16_t palette_size; // Entries of palette for indexed images decoded to indices, 0 otherwise
+    uint8_t palette[256][4]; // RGBA, colour corrected, alpha is 255 for entries without tRNS
+};
+
+#define PNG_LAYOUT_TOP_DOWN 0x00
+#define PNG_LAYOUT_BOTTOM_UP 0x01
+
+// Requested output layout, the remaining fields are filled in by png_plan_layout
+struct png_layout_t
+{
+    uint32_t row_stride;    // 0 for tightly packed rows
+    uint32_t row_alignment; // Power of two the stride is rounded up to, 0 or 1 for none
+    uint8_t flags;
+    enum png_output_format_t format; // Must match the decoder's format option
+    uint32_t stride;
+    size_t size; // Bytes the caller buffer must hold
+    uint32_t width;
+    uint32_t height;
     uint8_t bit_depth;
     enum pixel_format_t mode;
 };
 
+#define PNG_PROBE_DEFAULT 0x00
+#define PNG_PROBE_SKIP_IDAT_CRC 0x01
+
+// Chunk names are stored in file byte order, e.g. "IDAT" reads as 0x54414449 on little endian hosts
+struct png_chunk_info_t
+{
+    uint32_t name;
+    uint32_t length;
+    long offset; // File offset of the chunk length field
+};
+
+struct png_info_t
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t colour_type;
+    uint8_t interlace_method;
+    uint64_t idat_size;
+    uint32_t chunk_count;
+    struct png_chunk_info_t *chunks;
+};
+
+// Each tier includes the checks of the tiers below it, none of them allocate an output image
+enum png_validation_tier_t
+{
+    PNG_VALIDATE_STRUCTURE = 1, // Chunk order, lengths and CRCs
+    PNG_VALIDATE_INFLATE,       // Full inflate and Adler-32 check, decompressed data is discarded
+    PNG_VALIDATE_UNFILTER       // Filter type bytes and scanline counts
+};
+
+int png_probe(const char *filename, struct png_info_t *info, uint8_t flags);
+void close_probe(struct png_info_t *info);
+int png_validate(const char *filename, enum png_validation_tier_t tier);
+
+// A decoder keeps its working buffers between images, one decoder must not be used by two threads at once
+// Passing NULL as the allocator uses the C library, a non NULL allocator is copied
+// Threaded decodes may call it from pool workers, but never from two threads at once
+struct png_decoder_t *png_decoder_create(const struct png_allocator_t *allocator);
+// Images it decoded stay valid, the decoder is freed once the last of them is closed
+void png_decoder_destroy(struct png_decoder_t *decoder);
+int png_decoder_load(struct png_decoder_t *decoder, const char *filename, struct image_t *output);
+int png_decoder_load_memory(struct png_decoder_t *decoder, const uint8_t *data, size_t size, struct image_t *output);
+
+#define PNG_DECODE_DEFAULT 0x00
+#define PNG_DECODE_PIPELINE 0x01 // Inflate, unfilter and colour correction of one image run on separate threads
+#define PNG_DECODE_PARALLEL_PASSES 0x02 // Adam7 passes are unfiltered on separate threads once the image is inflated
+#define PNG_DECODE_PARALLEL_ROWS 0x04 // Rows of non-interlaced images are unfiltered in parallel from each None or Sub row
+#define PNG_DECODE_PARALLEL_INFLATE 0x08 // Experimental, the whole zlib stream is inflated speculatively in regions at IEND
+#define PNG_DECODE_SEGMENTS 0x10 // Non-interlaced images with iDOT or rsIX restart points are inflated one segment per thread
+#define PNG_DECODE_ASYNC_CRC 0x20 // CRCs of large IDAT chunks are computed in slices on pool workers while the chunk inflates
+#define PNG_DECODE_ROW_BANDS 0x40 // Post-processing of large images runs in row bands on pool workers, as in every threaded mode
+#define PNG_DECODE_FLATTEN_ALPHA 0x80 // Alpha is blended onto the bKGD colour, or background without one, and dropped from the output
+#define PNG_DECODE_FORCE_BACKGROUND 0x100 // Flattens onto background even when there is a bKGD chunk
+#define PNG_DECODE_PREMULTIPLY 0x200 // Colour samples are multiplied by alpha, which RGBX formats then drop
+
+struct png_decoder_options_t
+{
+    uint32_t flags;
+    uint32_t thread_count; // Workers for the threaded stages, 0 for one per processor
+    uint64_t split_threshold; // Pixel count from which post-processing is split into row bands, 0 for 4 MP
+    uint16_t background[3]; // 16-bit RGB in the image's colour space, greyscale images use its luma
+    enum png_output_format_t format;
+    float scale[4]; // Planar float formats write sample * scale + bias per channel, a scale of 0 maps the largest sample to 1
+    float bias[4];
+    enum png_yuv_matrix_t yuv_matrix; // Also weights PNG_FORMAT_LUMA8
+    uint8_t channel; // PNG_FORMAT_CHANNEL8 source, 0 to 2 for red, green and blue, 3 for alpha
+};
+
+// Threaded modes start a pool owned by the decoder, it is stopped by png_decoder_destroy or new options
+// Returns -1 without changing the decoder for an unknown format, YUV matrix or channel
+int png_decoder_set_options(struct png_decoder_t *decoder, const struct png_decoder_options_t *options);
+
+// Plan from a png_probe result, then decode into a buffer of at least layout.size bytes
+int png_plan_layout(const struct png_info_t *info, struct png_layout_t *layout);
+int png_decoder_load_into(struct png_decoder_t *decoder, const char *filename, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output);
+int load_png_into(const char *filename, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output);
+
 int load_png(const char *filename, struct image_t *output);
+int load_png_with_allocator(const char *filename, struct image_t *output, const struct png_allocator_t *allocator);
 void close_png(struct image_t *image);
 void debug_image(const struct image_t *image);
 
+// Items are read from data when it is not NULL, otherwise from filename
+// Higher priority items start first, ties go to the earliest deadline, a deadline of 0 sorts last
+struct png_batch_item_t
+{
+    const char *filename;
+    const uint8_t *data;
+    size_t size;
+    int32_t priority;
+    uint64_t deadline; // Caller defined time units, only used for ordering
+};
+
+struct png_batch_options_t
+{
+    uint32_t thread_count;    // 0 for one worker per processor
+    uint64_t split_threshold; // Pixel count from which post-processing is split into row bands, 0 for 4 MP
+    uint32_t interleave;      // Images a worker takes at once and inflates in lockstep, up to 4, 0 or 1 for one at a time
+    const struct png_allocator_t *allocator; // Shared by all workers so must be thread safe, NULL for the C library
+};
+
+struct png_batch_result_t
+{
+    struct image_t image; // Released with close_png, the allocator must outlive it
+    int status;
+};
+
+// Decodes on a work-stealing pool with one decoder per worker, returns -1 if any item failed, an empty batch starts no pool
+int png_decode_batch(const struct png_batch_item_t *items, uint32_t count, const struct png_batch_options_t *options, struct png_batch_result_t *results);
+
+// Bump allocator, memory is only reclaimed by png_arena_reset or when freeing the most recent allocation
+#define PNG_ARENA_DEFAULT 0x00
+#define PNG_ARENA_HUGE_PAGES 0x01 // Linux only, ignored elsewhere
+
+struct png_arena_t;
+
+struct png_arena_t *png_arena_create(size_t size, uint8_t flags);
+void png_arena_destroy(struct png_arena_t *arena);
+void png_arena_reset(struct png_arena_t *arena);
+size_t png_arena_used(const struct png_arena_t *arena);
+struct png_allocator_t png_arena_allocator(struct png_arena_t *arena);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef _SIMD_
+#define _SIMD_
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// PNG samples are big endian
+static inline __m128i swap_epi16(__m128i v)
+{
+   return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// 32-bit lanes of 0 to 65535 packed to 16 bits, SSE2 has no unsigned 32-bit pack so they are biased into signed range and back
+static inline __m128i packus_epi32(__m128i low, __m128i high)
+{
+   const __m128i bias = _mm_set1_epi32(0x8000);
+   return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(low, bias), _mm_sub_epi32(high, bias)), _mm_set1_epi16(-0x8000));
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _THREAD_POOL_
+#define _THREAD_POOL_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Worker is the index of the thread running the task, in the range [0, thread_pool_size)
+typedef void (*thread_task_fn)(void *arg, uint32_t worker);
+
+// Counts the unfinished tasks submitted against it, must outlive all of them
+struct task_group_t
+{
+   atomic_size_t pending;
+};
+
+struct thread_pool_t;
+
+static inline void task_group_init(struct task_group_t *group)
+{
+   atomic_init(&group->pending, 0);
+}
+
+// Zero workers creates one per online processor
+struct thread_pool_t *thread_pool_create(uint32_t worker_count);
+// Queued tasks that have not started are dropped, wait on their groups first
+void thread_pool_destroy(struct thread_pool_t *pool);
+uint32_t thread_pool_size(const struct thread_pool_t *pool);
+
+// Shared queue, higher priority first, then earliest deadline, a deadline of 0 sorts last
+int thread_pool_submit(struct thread_pool_t *pool, struct task_group_t *group, thread_task_fn run, void *arg, int32_t priority, uint64_t deadline);
+// Pushes onto the calling worker's own deque where idle workers can steal it, from other threads it is submitted
+int thread_pool_spawn(struct thread_pool_t *pool, struct task_group_t *group, thread_task_fn run, void *arg);
+// Workers of the pool run spawned tasks while waiting so nested waits cannot deadlock
+void thread_pool_wait(struct thread_pool_t *pool, struct task_group_t *group);
+
+#endif
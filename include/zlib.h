@@ -11,6 +11,30 @@
 #define CODE_LENGTH_MAX 19
 #define HLIT_MAX 286
 #define HDIST_MAX 32
+#define ZLIB_REGION_SIZE_DEFAULT 0x40000 // Compressed bytes per speculatively inflated region
+#define ZLIB_STREAM_PADDING 16           // Readable bytes required past the end of an in-memory stream
+#define ZLIB_LANES_MAX 4
+
+struct thread_pool_t;
+
+// Restart point of a segmented stream, segments after the first start on a byte aligned block boundary
+struct zlib_segment_t
+{
+   size_t offset;        // Stream bytes before the segment, 0 for the first
+   size_t output_offset; // Inflated bytes before the segment
+   uint32_t adler32;     // Of the segment's own inflated bytes
+   uint8_t has_adler32;
+};
+
+// A whole in-memory stream inflated alongside others by decompress_zlib_interleaved
+struct zlib_lane_t
+{
+   const uint8_t *data; // Followed by ZLIB_STREAM_PADDING readable bytes
+   size_t size;
+   uint8_t *output;
+   size_t output_size;
+   int status; // 0 when output holds exactly output_size bytes with a matching Adler-32
+};
 
 typedef void (*zlib_callback)(uint8_t byte, struct data_buffer_t *output, void *output_settings);
 
@@ -84,7 +108,7 @@ struct zlib_t
       READING_ADLER32_CHECKSUM
    } state;
 
-   struct ring_buffer_t LZ77_buffer;
+   struct ring_buffer_t LZ77_buffer; // data must hold ZLIB_BUFFER_MAX_SIZE bytes, only the window size from the header is used
 
    struct block_header_t block_header;
    struct dynamic_block_t dynamic_block;
@@ -93,6 +117,17 @@ struct zlib_t
    uint16_t bytes_read;
 };
 
+struct png_allocator_t;
+
 int decompress_zlib(struct zlib_t *zlib, struct stream_ptr_t *bitstream, struct data_buffer_t *output, zlib_callback cb, void *output_settings);
+// Experimental, inflates regions of a whole in-memory stream on the pool from guessed block boundaries
+// Returns 0 when output holds exactly output_size bytes with a matching Adler-32, -1 when the stream should be inflated serially
+// Region buffers come from allocator, NULL for the C library, workers call it one at a time
+int decompress_zlib_parallel(struct thread_pool_t *pool, const struct png_allocator_t *allocator, const uint8_t *data, size_t size, size_t region_size, uint8_t *output, size_t output_size);
+// Inflates each segment on its own thread straight into its part of output, with the same results as decompress_zlib_parallel
+int decompress_zlib_segments(struct thread_pool_t *pool, const struct png_allocator_t *allocator, const uint8_t *data, size_t size, const struct zlib_segment_t *segments, size_t segment_count, uint8_t *output, size_t output_size);
+// Inflates up to ZLIB_LANES_MAX streams on the calling thread, decoding a symbol from each in turn so their
+// table lookups and bit reads overlap, a lane that fails should be inflated again with decompress_zlib
+void decompress_zlib_interleaved(struct zlib_lane_t *lanes, size_t lane_count);
 
 #endif
\ No newline at end of file
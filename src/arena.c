@@ -0,0 +1,173 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#endif
+
+#include "png.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_HUGE_PAGE_SIZE 0x200000
+
+struct png_arena_t
+{
+   uint8_t *base;
+   size_t size;
+   size_t used;
+   size_t last; // Offset of the most recent allocation, the only one that can grow or shrink in place
+   uint8_t mapped;
+};
+
+static inline size_t align_size(size_t size, size_t alignment)
+{
+   return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Each allocation is preceded by its size so realloc knows how much to copy
+static void *arena_alloc(size_t size, void *user)
+{
+   struct png_arena_t *arena = (struct png_arena_t *)user;
+   size_t offset = align_size(arena->used, ARENA_ALIGNMENT);
+   size_t total = ARENA_ALIGNMENT + size;
+   if (total < size || total > arena->size || offset > arena->size - total)
+   {
+      log_error("Arena exhausted, %zu of %zu bytes used, %zu requested", arena->used, arena->size, size);
+      return NULL;
+   }
+   *(size_t *)(arena->base + offset) = size;
+   arena->last = offset;
+   arena->used = offset + total;
+   return arena->base + offset + ARENA_ALIGNMENT;
+}
+
+static void *arena_realloc(void *ptr, size_t new_size, void *user)
+{
+   struct png_arena_t *arena = (struct png_arena_t *)user;
+   if (ptr == NULL)
+   {
+      return arena_alloc(new_size, user);
+   }
+
+   uint8_t *header = (uint8_t *)ptr - ARENA_ALIGNMENT;
+   if (header == arena->base + arena->last && new_size <= arena->size - arena->last - ARENA_ALIGNMENT)
+   {
+      *(size_t *)header = new_size;
+      arena->used = arena->last + ARENA_ALIGNMENT + new_size;
+      return ptr;
+   }
+
+   size_t old_size = *(size_t *)header;
+   void *new_ptr = arena_alloc(new_size, user);
+   if (new_ptr != NULL)
+   {
+      memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+   }
+   return new_ptr;
+}
+
+static void arena_free(void *ptr, void *user)
+{
+   struct png_arena_t *arena = (struct png_arena_t *)user;
+   if (ptr != NULL && (uint8_t *)ptr - ARENA_ALIGNMENT == arena->base + arena->last)
+   {
+      arena->used = arena->last;
+   }
+}
+
+#ifdef __linux__
+static uint8_t *map_huge_pages(size_t size)
+{
+   void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if (block != MAP_FAILED)
+   {
+      return block;
+   }
+
+   // No reserved huge pages, fall back to transparent huge pages
+   block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (block == MAP_FAILED)
+   {
+      return NULL;
+   }
+   madvise(block, size, MADV_HUGEPAGE);
+   return block;
+}
+#endif
+
+struct png_arena_t *png_arena_create(size_t size, uint8_t flags)
+{
+   struct png_arena_t *arena = calloc(1, sizeof(*arena));
+   if (arena == NULL)
+   {
+      log_error("Failed to allocate arena");
+      return NULL;
+   }
+
+#ifdef __linux__
+   if (flags & PNG_ARENA_HUGE_PAGES)
+   {
+      size = align_size(size, ARENA_HUGE_PAGE_SIZE);
+      arena->base = map_huge_pages(size);
+      arena->mapped = arena->base != NULL;
+   }
+#else
+   (void)flags;
+#endif
+
+   if (arena->base == NULL)
+   {
+      arena->base = malloc(size);
+   }
+   if (arena->base == NULL)
+   {
+      log_error("Failed to allocate %zu byte arena", size);
+      free(arena);
+      return NULL;
+   }
+
+   arena->size = size;
+   log_debug("Arena of %zu bytes created%s", size, arena->mapped ? " with huge pages" : "");
+   return arena;
+}
+
+void png_arena_destroy(struct png_arena_t *arena)
+{
+   if (arena == NULL)
+   {
+      return;
+   }
+#ifdef __linux__
+   if (arena->mapped)
+   {
+      munmap(arena->base, arena->size);
+      free(arena);
+      return;
+   }
+#endif
+   free(arena->base);
+   free(arena);
+}
+
+void png_arena_reset(struct png_arena_t *arena)
+{
+   arena->used = 0;
+   arena->last = 0;
+}
+
+size_t png_arena_used(const struct png_arena_t *arena)
+{
+   return arena->used;
+}
+
+struct png_allocator_t png_arena_allocator(struct png_arena_t *arena)
+{
+   struct png_allocator_t allocator = {
+       .alloc = arena_alloc,
+       .realloc = arena_realloc,
+       .free = arena_free,
+       .user = arena};
+   return allocator;
+}
@@ -0,0 +1,195 @@
+#include "colour.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const struct matrix_3x3_t xyz_to_srgb = {.data = {{3.2404542f, -1.5371385f, -0.4985314f}, {-0.9692660f, 1.8760108f, 0.0415560f}, {0.0556434f, -0.2040259f, 1.0572252f}}};
+
+int chroma_matrix_set(struct chroma_matrix_t *matrix, const struct matrix_3x3_t *rgb_to_srgb)
+{
+   matrix->narrow = true;
+   matrix->identity = true;
+   for (int i = 0; i < 3; ++i)
+   {
+      int32_t deviation = 0;
+      for (int j = 0; j < 3; ++j)
+      {
+         if (!isfinite(rgb_to_srgb->data[i][j]))
+         {
+            return -1;
+         }
+         const double fixed = fmin(fmax(round((double)rgb_to_srgb->data[i][j] * (1 << CHROMA_SHIFT)), -CHROMA_LIMIT), CHROMA_LIMIT);
+         matrix->data[i][j] = (int32_t)fixed;
+         matrix->narrow &= fixed >= INT16_MIN && fixed <= INT16_MAX;
+         deviation += abs(matrix->data[i][j] - (i == j ? 1 << CHROMA_SHIFT : 0));
+      }
+      matrix->identity &= deviation < CHROMA_ROUND / 0xff;
+   }
+   return 0;
+}
+
+int chroma_matrix_build(struct chroma_matrix_t *matrix, const struct matrix_3x3_t *rgb_to_xyz)
+{
+   struct matrix_3x3_t rgb_to_srgb;
+   for (int i = 0; i < 3; ++i)
+   {
+      for (int j = 0; j < 3; ++j)
+      {
+         rgb_to_srgb.data[i][j] = (float)((double)xyz_to_srgb.data[i][0] * rgb_to_xyz->data[0][j] + (double)xyz_to_srgb.data[i][1] * rgb_to_xyz->data[1][j] + (double)xyz_to_srgb.data[i][2] * rgb_to_xyz->data[2][j]);
+      }
+   }
+   return chroma_matrix_set(matrix, &rgb_to_srgb);
+}
+
+static inline uint8_t saturate_8(int32_t value)
+{
+   return value < 0 ? 0 : value > 0xff ? 0xff : (uint8_t)value;
+}
+
+static inline uint16_t saturate_16(int64_t value)
+{
+   return value < 0 ? 0 : value > 0xffff ? 0xffff : (uint16_t)value;
+}
+
+static void correct_pixels_8(const struct chroma_matrix_t *matrix, const uint8_t *table, uint8_t *row, uint32_t first, uint32_t end, uint8_t channels)
+{
+   const int32_t(*m)[3] = matrix->data;
+   for (uint32_t x = first; x < end; ++x)
+   {
+      uint8_t *pixel = row + (size_t)x * channels;
+      const int32_t r = pixel[0];
+      const int32_t g = pixel[1];
+      const int32_t b = pixel[2];
+      for (int c = 0; c < 3; ++c)
+      {
+         uint8_t value = saturate_8((m[c][0] * r + m[c][1] * g + m[c][2] * b + CHROMA_ROUND) >> CHROMA_SHIFT);
+         pixel[c] = table == NULL ? value : table[value];
+      }
+   }
+}
+
+#ifdef __SSE2__
+// Q12 dot product of eight 16-bit pixels with one matrix row, rounded and narrowed with signed saturation
+static inline __m128i chroma_dot(__m128i r, __m128i g, __m128i b, __m128i rg_coefficients, __m128i b_coefficients)
+{
+   const __m128i one = _mm_set1_epi16(1);
+   __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), rg_coefficients), _mm_madd_epi16(_mm_unpacklo_epi16(b, one), b_coefficients));
+   __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), rg_coefficients), _mm_madd_epi16(_mm_unpackhi_epi16(b, one), b_coefficients));
+   return _mm_packs_epi32(_mm_srai_epi32(low, CHROMA_SHIFT), _mm_srai_epi32(high, CHROMA_SHIFT));
+}
+
+// Sixteen RGBA pixels at a time, transposed to planes so each matrix row is two multiply-adds per eight pixels
+static uint32_t correct_rgba_8_sse2(const struct chroma_matrix_t *matrix, const uint8_t *table, uint8_t *row, uint32_t width)
+{
+   __m128i rg_coefficients[3];
+   __m128i b_coefficients[3];
+   for (int c = 0; c < 3; ++c)
+   {
+      rg_coefficients[c] = _mm_set_epi16((int16_t)matrix->data[c][1], (int16_t)matrix->data[c][0], (int16_t)matrix->data[c][1], (int16_t)matrix->data[c][0],
+                                         (int16_t)matrix->data[c][1], (int16_t)matrix->data[c][0], (int16_t)matrix->data[c][1], (int16_t)matrix->data[c][0]);
+      b_coefficients[c] = _mm_set_epi16(CHROMA_ROUND, (int16_t)matrix->data[c][2], CHROMA_ROUND, (int16_t)matrix->data[c][2],
+                                        CHROMA_ROUND, (int16_t)matrix->data[c][2], CHROMA_ROUND, (int16_t)matrix->data[c][2]);
+   }
+   const __m128i zero = _mm_setzero_si128();
+
+   uint32_t x = 0;
+   for (; x + 16 <= width; x += 16)
+   {
+      uint8_t *pixels = row + (size_t)x * 4;
+      __m128i v0 = _mm_loadu_si128((const __m128i *)pixels);
+      __m128i v1 = _mm_loadu_si128((const __m128i *)(pixels + 16));
+      __m128i v2 = _mm_loadu_si128((const __m128i *)(pixels + 32));
+      __m128i v3 = _mm_loadu_si128((const __m128i *)(pixels + 48));
+
+      __m128i t0 = _mm_unpacklo_epi8(v0, v1);
+      __m128i t1 = _mm_unpackhi_epi8(v0, v1);
+      __m128i t2 = _mm_unpacklo_epi8(v2, v3);
+      __m128i t3 = _mm_unpackhi_epi8(v2, v3);
+      __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+      __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+      __m128i u2 = _mm_unpacklo_epi8(t2, t3);
+      __m128i u3 = _mm_unpackhi_epi8(t2, t3);
+      __m128i rg_low = _mm_unpacklo_epi8(u0, u1);
+      __m128i ba_low = _mm_unpackhi_epi8(u0, u1);
+      __m128i rg_high = _mm_unpacklo_epi8(u2, u3);
+      __m128i ba_high = _mm_unpackhi_epi8(u2, u3);
+      __m128i r = _mm_unpacklo_epi64(rg_low, rg_high);
+      __m128i g = _mm_unpackhi_epi64(rg_low, rg_high);
+      __m128i b = _mm_unpacklo_epi64(ba_low, ba_high);
+      __m128i a = _mm_unpackhi_epi64(ba_low, ba_high);
+
+      __m128i r_low = _mm_unpacklo_epi8(r, zero), r_high = _mm_unpackhi_epi8(r, zero);
+      __m128i g_low = _mm_unpacklo_epi8(g, zero), g_high = _mm_unpackhi_epi8(g, zero);
+      __m128i b_low = _mm_unpacklo_epi8(b, zero), b_high = _mm_unpackhi_epi8(b, zero);
+      __m128i out[3];
+      for (int c = 0; c < 3; ++c)
+      {
+         out[c] = _mm_packus_epi16(chroma_dot(r_low, g_low, b_low, rg_coefficients[c], b_coefficients[c]), chroma_dot(r_high, g_high, b_high, rg_coefficients[c], b_coefficients[c]));
+      }
+
+      __m128i rg0 = _mm_unpacklo_epi8(out[0], out[1]);
+      __m128i rg1 = _mm_unpackhi_epi8(out[0], out[1]);
+      __m128i ba0 = _mm_unpacklo_epi8(out[2], a);
+      __m128i ba1 = _mm_unpackhi_epi8(out[2], a);
+      _mm_storeu_si128((__m128i *)pixels, _mm_unpacklo_epi16(rg0, ba0));
+      _mm_storeu_si128((__m128i *)(pixels + 16), _mm_unpackhi_epi16(rg0, ba0));
+      _mm_storeu_si128((__m128i *)(pixels + 32), _mm_unpacklo_epi16(rg1, ba1));
+      _mm_storeu_si128((__m128i *)(pixels + 48), _mm_unpackhi_epi16(rg1, ba1));
+
+      // Gamma while the pixels are still in cache
+      if (table != NULL)
+      {
+         for (int i = 0; i < 64; i += 4)
+         {
+            pixels[i] = table[pixels[i]];
+            pixels[i + 1] = table[pixels[i + 1]];
+            pixels[i + 2] = table[pixels[i + 2]];
+         }
+      }
+   }
+   return x;
+}
+#endif
+
+static void correct_pixels_16(const struct chroma_matrix_t *matrix, const uint16_t *table, uint8_t *row, uint32_t width, uint8_t channels)
+{
+   const int32_t(*m)[3] = matrix->data;
+   const size_t stride = (size_t)channels * 2;
+   for (uint32_t x = 0; x < width; ++x)
+   {
+      uint8_t *pixel = row + x * stride;
+      const int64_t r = (pixel[0] << 8) | pixel[1];
+      const int64_t g = (pixel[2] << 8) | pixel[3];
+      const int64_t b = (pixel[4] << 8) | pixel[5];
+      for (int c = 0; c < 3; ++c)
+      {
+         uint16_t value = saturate_16((m[c][0] * r + m[c][1] * g + m[c][2] * b + CHROMA_ROUND) >> CHROMA_SHIFT);
+         value = table == NULL ? value : table[value];
+         pixel[c * 2] = (uint8_t)(value >> 8);
+         pixel[c * 2 + 1] = (uint8_t)value;
+      }
+   }
+}
+
+void chroma_correct_row(const struct chroma_matrix_t *matrix, const struct gamma_table_t *gamma, uint8_t *row, uint32_t width, uint8_t channels, uint8_t bit_depth)
+{
+   if (bit_depth == 16)
+   {
+      correct_pixels_16(matrix, gamma == NULL ? NULL : gamma->table_16, row, width, channels);
+      return;
+   }
+
+   const uint8_t *table = gamma == NULL ? NULL : gamma->table_8;
+   uint32_t first = 0;
+#ifdef __SSE2__
+   if (channels == 4 && matrix->narrow)
+   {
+      first = correct_rgba_8_sse2(matrix, table, row, width);
+   }
+#endif
+   correct_pixels_8(matrix, table, row, first, width, channels);
+}
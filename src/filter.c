@@ -117,39 +117,28 @@ uint8_t reconstruction_filter_type_4(uint8_t f, uint8_t a, uint8_t b, uint8_t c)
 
 typedef uint8_t (*filter_t)(uint8_t, uint8_t, uint8_t, uint8_t);
 
-void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_settings)
+// Swaps the scanline buffers and advances to the next row, returns 1 if a new sub-image was started
+static inline int next_scanline(struct output_settings_t *ptr)
 {
-   struct output_settings_t *ptr = (struct output_settings_t *)output_settings;
+   ptr->scanline.index = 0;
 
-   // Update scanline and output pointers
-   if (ptr->scanline.index == ptr->subimage.images[ptr->subimage.image_index].scanline_size)
-   {
-      ptr->scanline.index = 0;
-
-      uint8_t *temp = ptr->scanline.last;
-      ptr->scanline.last = ptr->scanline.new;
-      ptr->scanline.new = temp;
+   uint8_t *temp = ptr->scanline.last;
+   ptr->scanline.last = ptr->scanline.new;
+   ptr->scanline.new = temp;
 
-      ++ptr->subimage.row_index;
-      if (ptr->subimage.row_index == ptr->subimage.images[ptr->subimage.image_index].scanline_count)
-      {
-         ptr->subimage.row_index = 0;
-         ++ptr->subimage.image_index;
-         memset(ptr->scanline.buffer, 0, sizeof(uint8_t) * ptr->scanline.buffer_size);
-      }
-
-      ptr->pixel.index = 0;
-      output_image->index = ((ptr->subimage.images[ptr->subimage.image_index].row_offset + ptr->subimage.row_index * ptr->subimage.images[ptr->subimage.image_index].row_stride) * ptr->image_width + ptr->subimage.images[ptr->subimage.image_index].px_offset) * ptr->pixel.size;
-   }
-
-   // Update filter type
-   if (ptr->scanline.index == 0)
+   ++ptr->subimage.row_index;
+   if (ptr->subimage.row_index == ptr->subimage.images[ptr->subimage.image_index].scanline_count)
    {
-      ptr->filter_type = byte;
-      ++ptr->scanline.index;
-      return;
+      ptr->subimage.row_index = 0;
+      ++ptr->subimage.image_index;
+      memset(ptr->scanline.buffer, 0, sizeof(uint8_t) * ptr->scanline.buffer_size);
+      return 1;
    }
-   // Filter input and add to scanline buffer
+   return 0;
+}
+
+static inline uint8_t reconstruct_byte(struct output_settings_t *ptr, uint8_t byte)
+{
    int current_byte = SCANLINE_BUFFER_OFFSET + ptr->scanline.index;
    int previous_byte = current_byte - ptr->scanline.stride;
    uint8_t a = ptr->scanline.new[previous_byte];
@@ -182,7 +171,131 @@ void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_setti
       break;
    }
 
-   byte = ptr->scanline.new[current_byte];
+   return ptr->scanline.new[current_byte];
+}
+
+void validate_filter(uint8_t byte, struct data_buffer_t *output_image, void *output_settings)
+{
+   struct output_settings_t *ptr = (struct output_settings_t *)output_settings;
+   ++output_image->index;
+
+   if (ptr->scanline.index == ptr->subimage.images[ptr->subimage.image_index].scanline_size)
+   {
+      next_scanline(ptr);
+   }
+
+   // A zeroed sub-image terminates the list, any data past it is surplus
+   if (ptr->subimage.images[ptr->subimage.image_index].scanline_count == 0)
+   {
+      ptr->filter_error = FILTER_ERROR_EXCESS_DATA;
+      return;
+   }
+
+   if (ptr->scanline.index == 0)
+   {
+      if (byte > FILTER_TYPE_MAX)
+      {
+         ptr->filter_error = FILTER_ERROR_INVALID_TYPE;
+      }
+      ptr->filter_type = byte;
+      ++ptr->scanline.index;
+      return;
+   }
+
+   reconstruct_byte(ptr, byte);
+   ++ptr->scanline.index;
+}
+
+int filter_complete(const struct output_settings_t *settings)
+{
+   const struct sub_image_t *image = &settings->subimage.images[settings->subimage.image_index];
+   if (image->scanline_count == 0)
+   {
+      return 1;
+   }
+   return settings->subimage.images[settings->subimage.image_index + 1].scanline_count == 0 && settings->subimage.row_index == image->scanline_count - 1 && settings->scanline.index == image->scanline_size;
+}
+
+// Offset of the first output byte of the current scanline's row
+static inline size_t output_row_start(const struct output_settings_t *ptr)
+{
+   if (ptr->row_buffer)
+   {
+      return 0;
+   }
+   const struct sub_image_t *image = &ptr->subimage.images[ptr->subimage.image_index];
+   size_t row = image->row_offset + ptr->subimage.row_index * image->row_stride;
+   if (ptr->bottom_up)
+   {
+      row = ptr->image_height - 1 - row;
+   }
+   // Zero stride means tightly packed rows
+   size_t row_stride = ptr->row_stride ? ptr->row_stride : (size_t)ptr->image_width * ptr->pixel.size;
+   return row * row_stride;
+}
+
+void filter_start_scanline(struct output_settings_t *settings, uint8_t image_index, uint32_t row_index, struct data_buffer_t *output_image)
+{
+   settings->subimage.image_index = image_index;
+   settings->subimage.row_index = row_index;
+   settings->scanline.index = 0;
+   settings->pixel.index = 0;
+   output_image->index = output_row_start(settings) + settings->subimage.images[image_index].px_offset * settings->pixel.size;
+}
+
+// Packed rows keep the image's bit order, interlaced pixels are placed one at a time
+static void write_packed(const struct output_settings_t *ptr, uint8_t byte, const uint8_t *samples, uint8_t count, uint8_t *output)
+{
+   const struct sub_image_t *image = &ptr->subimage.images[ptr->subimage.image_index];
+   uint8_t *row = output + output_row_start(ptr);
+   if (image->px_stride == 1)
+   {
+      row[ptr->scanline.index - 1] = byte;
+      return;
+   }
+
+   const uint8_t bit_depth = ptr->pixel.bit_depth;
+   const uint8_t mask = (uint8_t)((1u << bit_depth) - 1);
+   uint64_t x = image->px_offset + (uint64_t)(ptr->scanline.index - 1) * count * image->px_stride;
+   for (uint8_t i = 0; i < count && x < ptr->image_width; ++i, x += image->px_stride)
+   {
+      const uint64_t bit = x * bit_depth;
+      const uint8_t shift = (uint8_t)(8 - bit_depth - (bit & 0x07));
+      row[bit >> 3] = (uint8_t)((row[bit >> 3] & ~(mask << shift)) | (samples[i] << shift));
+   }
+}
+
+static inline void end_byte(struct output_settings_t *ptr, struct data_buffer_t *output_image)
+{
+   ++ptr->scanline.index;
+   if (ptr->row_complete != NULL && ptr->scanline.index == ptr->subimage.images[ptr->subimage.image_index].scanline_size)
+   {
+      ptr->row_complete(ptr->row_arg, ptr, output_image->data + output_row_start(ptr));
+   }
+}
+
+void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_settings)
+{
+   struct output_settings_t *ptr = (struct output_settings_t *)output_settings;
+
+   // Update scanline and output pointers
+   if (ptr->scanline.index == ptr->subimage.images[ptr->subimage.image_index].scanline_size)
+   {
+      next_scanline(ptr);
+
+      ptr->pixel.index = 0;
+      output_image->index = output_row_start(ptr) + ptr->subimage.images[ptr->subimage.image_index].px_offset * ptr->pixel.size;
+   }
+
+   // Update filter type
+   if (ptr->scanline.index == 0)
+   {
+      ptr->filter_type = byte;
+      ++ptr->scanline.index;
+      return;
+   }
+   // Filter input and add to scanline buffer
+   byte = reconstruct_byte(ptr, byte);
 
    // Handle bit depth
    uint8_t input_pixels = 1;
@@ -222,13 +335,25 @@ void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_setti
       break;
    }
 
-   size_t max_output_index = (1 + ptr->subimage.images[ptr->subimage.image_index].row_offset + ptr->subimage.images[ptr->subimage.image_index].row_stride * ptr->subimage.row_index) * ptr->image_width * ptr->pixel.size;
+   if (ptr->samples == FILTER_SAMPLES_PACKED)
+   {
+      write_packed(ptr, byte, arr, input_pixels, output_image->data);
+      end_byte(ptr, output_image);
+      return;
+   }
+
+   size_t max_output_index = output_row_start(ptr) + ptr->image_width * ptr->pixel.size;
 
    // Deinterlace filtered byte(s)
    int i = 0;
    while (i < input_pixels && output_image->index < max_output_index)
    {
-      if (ptr->pixel.color_type == Indexed_colour)
+      if (ptr->pixel.color_type == Indexed_colour && ptr->samples == FILTER_SAMPLES_INDICES)
+      {
+         output_image->data[output_image->index] = arr[i];
+         output_image->index += ptr->subimage.images[ptr->subimage.image_index].px_stride;
+      }
+      else if (ptr->pixel.color_type == Indexed_colour)
       {
          output_image->data[output_image->index] = ptr->palette.buffer[arr[i]].r;
          output_image->data[output_image->index + 1] = ptr->palette.buffer[arr[i]].g;
@@ -275,5 +400,5 @@ void filter(uint8_t byte, struct data_buffer_t *output_image, void *output_setti
       ++i;
    }
 
-   ++ptr->scanline.index;
+   end_byte(ptr, output_image);
 }
\ No newline at end of file
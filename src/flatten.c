@@ -0,0 +1,157 @@
+#include "flatten.h"
+#include "simd.h"
+
+// Rounded (c * a + background * (255 - a)) / 255
+static inline uint8_t blend_8(uint32_t c, uint32_t a, uint32_t background)
+{
+   const uint32_t t = c * a + background * (0xff - a) + 0x80;
+   return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+// Rounded (c * a + background * (65535 - a)) / 65535, taken from the halves of the sum so it stays in 32 bits
+static inline uint16_t blend_16(uint32_t c, uint32_t a, uint32_t background)
+{
+   const uint32_t u = c * a + background * (0xffff - a) + 0x7fff;
+   const uint32_t high = u >> 16;
+   return (uint16_t)(high + (high + (u & 0xffff) >= 0xffff));
+}
+
+#ifdef __SSE2__
+static inline __m128i blend_epi16_8(__m128i c, __m128i a, __m128i background)
+{
+   const __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(c, a), _mm_mullo_epi16(background, _mm_sub_epi16(_mm_set1_epi16(0xff), a))), _mm_set1_epi16(0x80));
+   return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Rounded division of 32-bit sums as in blend_16
+static inline __m128i divide_epi32_16(__m128i c_a, __m128i b_a)
+{
+   const __m128i u = _mm_add_epi32(_mm_add_epi32(c_a, b_a), _mm_set1_epi32(0x7fff));
+   const __m128i high = _mm_srli_epi32(u, 16);
+   const __m128i carry = _mm_cmpgt_epi32(_mm_add_epi32(high, _mm_and_si128(u, _mm_set1_epi32(0xffff))), _mm_set1_epi32(0xfffe));
+   return _mm_sub_epi32(high, carry);
+}
+
+// 32-bit products are rebuilt from their 16-bit halves
+static inline __m128i blend_epi16_16(__m128i c, __m128i a, __m128i background)
+{
+   const __m128i inverse = _mm_xor_si128(a, _mm_set1_epi16(-1));
+   const __m128i c_a_low = _mm_mullo_epi16(c, a);
+   const __m128i c_a_high = _mm_mulhi_epu16(c, a);
+   const __m128i b_a_low = _mm_mullo_epi16(background, inverse);
+   const __m128i b_a_high = _mm_mulhi_epu16(background, inverse);
+   const __m128i low = divide_epi32_16(_mm_unpacklo_epi16(c_a_low, c_a_high), _mm_unpacklo_epi16(b_a_low, b_a_high));
+   const __m128i high = divide_epi32_16(_mm_unpackhi_epi16(c_a_low, c_a_high), _mm_unpackhi_epi16(b_a_low, b_a_high));
+   return packus_epi32(low, high);
+}
+
+// Drops the last two bytes of each 64-bit half and joins the remaining twelve
+static inline __m128i pack_halves(__m128i v)
+{
+   const __m128i low = _mm_and_si128(v, _mm_set_epi32(0, 0, 0x0000ffff, -1));
+   const __m128i high = _mm_and_si128(_mm_srli_si128(v, 2), _mm_set_epi32(0, -1, (int)0xffff0000, 0));
+   return _mm_or_si128(low, high);
+}
+
+// Each 16-byte store runs four bytes past the pixels it completes, so the loops stop short of the row end
+static uint32_t flatten_rgba_8_sse2(const uint8_t *row, uint8_t *output, uint32_t width, const uint16_t *background)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i colour = _mm_set_epi16(0, (int16_t)background[2], (int16_t)background[1], (int16_t)background[0], 0, (int16_t)background[2], (int16_t)background[1], (int16_t)background[0]);
+   const __m128i low_pixels = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+   const __m128i high_pixels = _mm_set_epi32(0x00ffffff, 0, 0x00ffffff, 0);
+   uint32_t x = 0;
+   for (; x + 6 <= width; x += 4)
+   {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 4));
+      const __m128i low = _mm_unpacklo_epi8(v, zero);
+      const __m128i high = _mm_unpackhi_epi8(v, zero);
+      const __m128i low_alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(low, 0xff), 0xff);
+      const __m128i high_alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(high, 0xff), 0xff);
+      const __m128i out = _mm_packus_epi16(blend_epi16_8(low, low_alpha, colour), blend_epi16_8(high, high_alpha, colour));
+      // RGBX pairs to six bytes per 64-bit half
+      const __m128i pairs = _mm_or_si128(_mm_and_si128(out, low_pixels), _mm_srli_epi64(_mm_and_si128(out, high_pixels), 8));
+      _mm_storeu_si128((__m128i *)(output + (size_t)x * 3), pack_halves(pairs));
+   }
+   return x;
+}
+
+static uint32_t flatten_ga_8_sse2(const uint8_t *row, uint8_t *output, uint32_t width, const uint16_t *background)
+{
+   const __m128i grey = _mm_set1_epi16((int16_t)background[0]);
+   const __m128i mask = _mm_set1_epi16(0xff);
+   uint32_t x = 0;
+   for (; x + 8 <= width; x += 8)
+   {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 2));
+      const __m128i out = blend_epi16_8(_mm_and_si128(v, mask), _mm_srli_epi16(v, 8), grey);
+      _mm_storel_epi64((__m128i *)(output + x), _mm_packus_epi16(out, out));
+   }
+   return x;
+}
+
+static uint32_t flatten_rgba_16_sse2(const uint8_t *row, uint8_t *output, uint32_t width, const uint16_t *background)
+{
+   const __m128i colour = _mm_set_epi16(0, (int16_t)background[2], (int16_t)background[1], (int16_t)background[0], 0, (int16_t)background[2], (int16_t)background[1], (int16_t)background[0]);
+   uint32_t x = 0;
+   for (; x + 3 <= width; x += 2)
+   {
+      const __m128i v = swap_epi16(_mm_loadu_si128((const __m128i *)(row + (size_t)x * 8)));
+      const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+      _mm_storeu_si128((__m128i *)(output + (size_t)x * 6), pack_halves(swap_epi16(blend_epi16_16(v, alpha, colour))));
+   }
+   return x;
+}
+
+static uint32_t flatten_ga_16_sse2(const uint8_t *row, uint8_t *output, uint32_t width, const uint16_t *background)
+{
+   const __m128i grey = _mm_set1_epi32(background[0]);
+   uint32_t x = 0;
+   for (; x + 4 <= width; x += 4)
+   {
+      const __m128i v = swap_epi16(_mm_loadu_si128((const __m128i *)(row + (size_t)x * 4)));
+      const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xf5), 0xf5);
+      // Grey samples are the even lanes, sign extended so the signed pack keeps their bits
+      const __m128i out = _mm_srai_epi32(_mm_slli_epi32(blend_epi16_16(v, alpha, grey), 16), 16);
+      _mm_storel_epi64((__m128i *)(output + (size_t)x * 2), swap_epi16(_mm_packs_epi32(out, out)));
+   }
+   return x;
+}
+#endif
+
+void flatten_row(const uint8_t *row, uint8_t *output, uint32_t width, uint8_t channels, uint8_t bit_depth, const uint16_t *background)
+{
+   uint32_t first = 0;
+   if (bit_depth == 16)
+   {
+#ifdef __SSE2__
+      first = channels == 3 ? flatten_rgba_16_sse2(row, output, width, background) : flatten_ga_16_sse2(row, output, width, background);
+#endif
+      for (uint32_t x = first; x < width; ++x)
+      {
+         const uint8_t *pixel = row + (size_t)x * (channels + 1) * 2;
+         uint8_t *out = output + (size_t)x * channels * 2;
+         const uint32_t alpha = (pixel[channels * 2] << 8) | pixel[channels * 2 + 1];
+         for (uint8_t c = 0; c < channels; ++c)
+         {
+            const uint16_t value = blend_16((pixel[c * 2] << 8) | pixel[c * 2 + 1], alpha, background[c]);
+            out[c * 2] = (uint8_t)(value >> 8);
+            out[c * 2 + 1] = (uint8_t)value;
+         }
+      }
+      return;
+   }
+
+#ifdef __SSE2__
+   first = channels == 3 ? flatten_rgba_8_sse2(row, output, width, background) : flatten_ga_8_sse2(row, output, width, background);
+#endif
+   for (uint32_t x = first; x < width; ++x)
+   {
+      const uint8_t *pixel = row + (size_t)x * (channels + 1);
+      uint8_t *out = output + (size_t)x * channels;
+      for (uint8_t c = 0; c < channels; ++c)
+      {
+         out[c] = blend_8(pixel[c], pixel[channels], background[c]);
+      }
+   }
+}
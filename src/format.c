@@ -0,0 +1,628 @@
+#include "format.h"
+#include "simd.h"
+
+#include <string.h>
+
+void format_output(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, enum pixel_format_t *output_mode, uint8_t *output_bit_depth)
+{
+   switch (format)
+   {
+   case PNG_FORMAT_SOURCE:
+   case PNG_FORMAT_NATIVE_16:
+      *output_mode = mode;
+      *output_bit_depth = bit_depth;
+      return;
+   case PNG_FORMAT_SOURCE_8:
+      *output_mode = mode;
+      break;
+   case PNG_FORMAT_RGBA8:
+      *output_mode = RGBA;
+      break;
+   case PNG_FORMAT_BGRA8:
+      *output_mode = BGRA;
+      break;
+   case PNG_FORMAT_RGBX8:
+      *output_mode = RGBX;
+      break;
+   case PNG_FORMAT_BGRX8:
+      *output_mode = BGRX;
+      break;
+   case PNG_FORMAT_PLANAR_F32:
+      *output_mode = mode;
+      *output_bit_depth = 32;
+      return;
+   case PNG_FORMAT_PLANAR_F16:
+      *output_mode = mode;
+      *output_bit_depth = 16;
+      return;
+   case PNG_FORMAT_I444:
+   case PNG_FORMAT_I420:
+   case PNG_FORMAT_NV12:
+      *output_mode = RGB;
+      break;
+   case PNG_FORMAT_INDEX8:
+   case PNG_FORMAT_ALPHA8:
+   case PNG_FORMAT_LUMA8:
+   case PNG_FORMAT_CHANNEL8:
+      *output_mode = G;
+      break;
+   case PNG_FORMAT_PACKED:
+      *output_mode = G;
+      *output_bit_depth = bit_depth;
+      return;
+   }
+   *output_bit_depth = 8;
+}
+
+bool format_converts(enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, bool premultiply)
+{
+   const bool premultiplies = premultiply && (mode == GA || mode == RGBA);
+   switch (format)
+   {
+   case PNG_FORMAT_SOURCE:
+      return premultiplies;
+   case PNG_FORMAT_SOURCE_8:
+   case PNG_FORMAT_NATIVE_16:
+      return premultiplies || bit_depth == 16;
+   case PNG_FORMAT_RGBA8:
+      return premultiplies || bit_depth == 16 || mode != RGBA;
+   case PNG_FORMAT_INDEX8:
+   case PNG_FORMAT_PACKED:
+      return false;
+   case PNG_FORMAT_LUMA8:
+      return premultiplies || bit_depth == 16 || mode != G;
+   default:
+      return true;
+   }
+}
+
+size_t format_chroma_size(enum png_output_format_t format, uint32_t stride, uint32_t height, uint32_t *chroma_stride)
+{
+   switch (format)
+   {
+   case PNG_FORMAT_I444:
+      *chroma_stride = stride;
+      return 2 * (size_t)stride * height;
+   case PNG_FORMAT_I420:
+      *chroma_stride = (stride + 1) / 2;
+      return 2 * (size_t)*chroma_stride * ((height + 1) / 2);
+   case PNG_FORMAT_NV12:
+      *chroma_stride = (stride + 1) & ~1u;
+      return (size_t)*chroma_stride * ((height + 1) / 2);
+   default:
+      *chroma_stride = 0;
+      return 0;
+   }
+}
+
+// Rounded c * a / 255
+static inline uint32_t premultiply_8(uint32_t c, uint32_t a)
+{
+   const uint32_t t = c * a + 0x80;
+   return (t + (t >> 8)) >> 8;
+}
+
+// Rounded c * a / 65535, as blend_16 in flatten.c
+static inline uint32_t premultiply_16(uint32_t c, uint32_t a)
+{
+   const uint32_t u = c * a + 0x7fff;
+   const uint32_t high = u >> 16;
+   return high + (high + (u & 0xffff) >= 0xffff);
+}
+
+// Rounded v / 257, exact for every 16-bit sample
+static inline uint32_t reduce_16(uint32_t v)
+{
+   return (v + 0x80 - ((v + 0x80) >> 8)) >> 8;
+}
+
+// Round to nearest even, values from 65520 up become infinity
+static uint16_t float_to_half(float value)
+{
+   uint32_t bits;
+   memcpy(&bits, &value, sizeof(bits));
+   const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+   uint32_t magnitude = bits & 0x7fffffff;
+   if (magnitude >= 0x47800000)
+   {
+      return sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00);
+   }
+   if (magnitude < 0x38800000)
+   {
+      // Below the smallest normal half, adding 0.5 leaves the rounded subnormal in the low mantissa bits
+      float absolute;
+      memcpy(&absolute, &magnitude, sizeof(absolute));
+      absolute += 0.5f;
+      memcpy(&magnitude, &absolute, sizeof(magnitude));
+      return sign | (uint16_t)(magnitude - 0x3f000000);
+   }
+   magnitude = magnitude - ((uint32_t)(127 - 15) << 23) + 0xfff + ((magnitude >> 13) & 1);
+   return sign | (uint16_t)(magnitude >> 13);
+}
+
+// Samples of one pixel, colour samples are multiplied by alpha when premultiply is set
+static void read_pixel(const uint8_t *pixel, enum pixel_format_t mode, uint8_t sample_size, bool premultiply, uint32_t *samples)
+{
+   const uint8_t channels = (uint8_t)mode;
+   const bool alpha = mode == GA || mode == RGBA;
+   const uint8_t colours = alpha ? channels - 1 : channels;
+   for (uint8_t c = 0; c < channels; ++c)
+   {
+      samples[c] = sample_size == 2 ? (uint32_t)((pixel[c * 2] << 8) | pixel[c * 2 + 1]) : pixel[c];
+   }
+   for (uint8_t c = 0; premultiply && alpha && c < colours; ++c)
+   {
+      samples[c] = sample_size == 2 ? premultiply_16(samples[c], samples[colours]) : premultiply_8(samples[c], samples[colours]);
+   }
+}
+
+static void format_pixels(const uint8_t *row, uint8_t *output, uint32_t first, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings)
+{
+   const enum png_output_format_t format = settings->format;
+   const bool premultiply = settings->premultiply;
+   const bool planar = format_planar(format);
+   enum pixel_format_t output_mode;
+   uint8_t output_bit_depth;
+   format_output(format, mode, bit_depth, &output_mode, &output_bit_depth);
+   const uint8_t channels = (uint8_t)mode;
+   const bool alpha = mode == GA || mode == RGBA;
+   const uint8_t colours = alpha ? channels - 1 : channels;
+   const uint8_t sample_size = bit_depth >> 3;
+   const uint8_t output_size = format_pixel_size(format, output_mode, output_bit_depth);
+
+   for (uint32_t x = first; x < width; ++x)
+   {
+      const uint8_t *pixel = row + (size_t)x * channels * sample_size;
+      uint8_t *out = output + (size_t)x * output_size;
+      uint32_t samples[4];
+      read_pixel(pixel, mode, sample_size, premultiply, samples);
+      for (uint8_t c = 0; bit_depth == 16 && output_bit_depth == 8 && c < channels; ++c)
+      {
+         samples[c] = reduce_16(samples[c]);
+      }
+
+      if (planar)
+      {
+         for (uint8_t c = 0; c < channels; ++c)
+         {
+            const float value = (float)samples[c] * settings->scale[c] + settings->bias[c];
+            uint8_t *plane = out + c * settings->plane_size;
+            if (format == PNG_FORMAT_PLANAR_F32)
+            {
+               memcpy(plane, &value, sizeof(value));
+            }
+            else
+            {
+               const uint16_t half = float_to_half(value);
+               memcpy(plane, &half, sizeof(half));
+            }
+         }
+         continue;
+      }
+
+      if (output_mode == mode)
+      {
+         for (uint8_t c = 0; c < channels; ++c)
+         {
+            if (output_bit_depth == 8)
+            {
+               out[c] = (uint8_t)samples[c];
+            }
+            else if (format == PNG_FORMAT_NATIVE_16)
+            {
+               const uint16_t sample = (uint16_t)samples[c];
+               memcpy(out + c * 2, &sample, sizeof(sample));
+            }
+            else
+            {
+               out[c * 2] = (uint8_t)(samples[c] >> 8);
+               out[c * 2 + 1] = (uint8_t)samples[c];
+            }
+         }
+         continue;
+      }
+
+      const uint8_t red = (uint8_t)samples[0];
+      const uint8_t green = (uint8_t)samples[colours == 3 ? 1 : 0];
+      const uint8_t blue = (uint8_t)samples[colours == 3 ? 2 : 0];
+      const bool bgr = output_mode == BGRA || output_mode == BGRX;
+      out[0] = bgr ? blue : red;
+      out[1] = green;
+      out[2] = bgr ? red : blue;
+      out[3] = alpha && (output_mode == RGBA || output_mode == BGRA) ? (uint8_t)samples[colours] : 0xff;
+   }
+}
+
+#ifdef __SSE2__
+// Four RGBA pixels at a time, alpha is multiplied into the colour samples, replaced by padding, or red and blue are swapped
+static uint32_t format_rgba_8_sse2(const uint8_t *row, uint8_t *output, uint32_t width, enum png_output_format_t format, bool premultiply)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000);
+   const __m128i bias = _mm_set1_epi16(0x80);
+   const bool padded = format == PNG_FORMAT_RGBX8 || format == PNG_FORMAT_BGRX8;
+   const bool bgr = format == PNG_FORMAT_BGRA8 || format == PNG_FORMAT_BGRX8;
+   uint32_t x = 0;
+   for (; x + 4 <= width; x += 4)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 4));
+      if (premultiply)
+      {
+         __m128i low = _mm_unpacklo_epi8(v, zero);
+         __m128i high = _mm_unpackhi_epi8(v, zero);
+         low = _mm_add_epi16(_mm_mullo_epi16(low, _mm_shufflehi_epi16(_mm_shufflelo_epi16(low, 0xff), 0xff)), bias);
+         high = _mm_add_epi16(_mm_mullo_epi16(high, _mm_shufflehi_epi16(_mm_shufflelo_epi16(high, 0xff), 0xff)), bias);
+         low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+         high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+         v = _mm_or_si128(_mm_andnot_si128(alpha_mask, _mm_packus_epi16(low, high)), _mm_and_si128(v, alpha_mask));
+      }
+      if (padded)
+      {
+         v = _mm_or_si128(v, alpha_mask);
+      }
+      if (bgr)
+      {
+         const __m128i red = _mm_and_si128(v, _mm_set1_epi32(0x000000ff));
+         const __m128i blue = _mm_and_si128(v, _mm_set1_epi32(0x00ff0000));
+         v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32((int)0xff00ff00)), _mm_or_si128(_mm_slli_epi32(red, 16), _mm_srli_epi32(blue, 16)));
+      }
+      _mm_storeu_si128((__m128i *)(output + (size_t)x * 4), v);
+   }
+   return x;
+}
+
+// Eight samples at a time, (v + 128) >> 8 is taken with a rounding average so nothing overflows 16 bits
+static size_t reduce_16_sse2(const uint8_t *row, uint8_t *output, size_t count)
+{
+   const __m128i bias = _mm_set1_epi16(0x7f);
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      const __m128i v = swap_epi16(_mm_loadu_si128((const __m128i *)(row + i * 2)));
+      const __m128i u = _mm_sub_epi16(v, _mm_srli_epi16(_mm_avg_epu16(v, bias), 7));
+      const __m128i out = _mm_srli_epi16(_mm_avg_epu16(u, bias), 7);
+      _mm_storel_epi64((__m128i *)(output + i), _mm_packus_epi16(out, out));
+   }
+   return i;
+}
+
+static size_t swap_16_sse2(const uint8_t *row, uint8_t *output, size_t count)
+{
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      _mm_storeu_si128((__m128i *)(output + i * 2), swap_epi16(_mm_loadu_si128((const __m128i *)(row + i * 2))));
+   }
+   return i;
+}
+
+// float_to_half on four lanes, the halves are left in the low 16 bits of each
+static __m128i half_epi32(__m128 value)
+{
+   const __m128i sign = _mm_and_si128(_mm_castps_si128(value), _mm_set1_epi32((int)0x80000000));
+   const __m128i magnitude = _mm_xor_si128(_mm_castps_si128(value), sign);
+   const __m128i nan = _mm_castps_si128(_mm_cmpunord_ps(value, value));
+   const __m128i special = _mm_or_si128(_mm_and_si128(nan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+   const __m128i regular = _mm_cmpgt_epi32(_mm_set1_epi32(0x47800000), magnitude);
+   const __m128i subnormal = _mm_cmpgt_epi32(_mm_set1_epi32(0x38800000), magnitude);
+
+   const __m128i magic = _mm_set1_epi32(0x3f000000);
+   const __m128i small = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(magnitude), _mm_castsi128_ps(magic))), magic);
+   const __m128i odd = _mm_and_si128(_mm_srli_epi32(magnitude, 13), _mm_set1_epi32(1));
+   const __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(magnitude, _mm_set1_epi32(0xfff - ((127 - 15) << 23))), odd), 13);
+
+   const __m128i finite = _mm_or_si128(_mm_and_si128(subnormal, small), _mm_andnot_si128(subnormal, normal));
+   const __m128i half = _mm_or_si128(_mm_and_si128(regular, finite), _mm_andnot_si128(regular, special));
+   return _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+}
+
+// Four pixels at a time, each channel's samples are gathered, scaled and stored to its plane
+static uint32_t format_planar_sse2(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings)
+{
+   const uint8_t channels = (uint8_t)mode;
+   const size_t step = (size_t)channels * (bit_depth >> 3);
+   uint32_t x = 0;
+   for (; x + 4 <= width; x += 4)
+   {
+      for (uint8_t c = 0; c < channels; ++c)
+      {
+         const uint8_t *s = row + (size_t)x * step + c * (bit_depth >> 3);
+         const __m128i samples = bit_depth == 16 ? _mm_set_epi32((s[step * 3] << 8) | s[step * 3 + 1], (s[step * 2] << 8) | s[step * 2 + 1], (s[step] << 8) | s[step + 1], (s[0] << 8) | s[1])
+                                                 : _mm_set_epi32(s[step * 3], s[step * 2], s[step], s[0]);
+         const __m128 value = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(samples), _mm_set1_ps(settings->scale[c])), _mm_set1_ps(settings->bias[c]));
+         uint8_t *plane = output + c * settings->plane_size;
+         if (settings->format == PNG_FORMAT_PLANAR_F32)
+         {
+            _mm_storeu_ps((float *)(plane + (size_t)x * 4), value);
+         }
+         else
+         {
+            const __m128i half = half_epi32(value);
+            _mm_storel_epi64((__m128i *)(plane + (size_t)x * 2), packus_epi32(half, half));
+         }
+      }
+   }
+   return x;
+}
+#endif
+
+void format_row(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings)
+{
+   uint32_t first = 0;
+#ifdef __SSE2__
+   const enum png_output_format_t format = settings->format;
+   const bool premultiply = settings->premultiply;
+   const bool premultiplies = premultiply && (mode == GA || mode == RGBA);
+   if (format_planar(format))
+   {
+      first = premultiplies ? 0 : format_planar_sse2(row, output, width, mode, bit_depth, settings);
+   }
+   else if (bit_depth == 8 && mode == RGBA && format >= PNG_FORMAT_RGBA8)
+   {
+      first = format_rgba_8_sse2(row, output, width, format, premultiply);
+   }
+   else if (bit_depth == 16 && !premultiplies && format == PNG_FORMAT_SOURCE_8)
+   {
+      // A pixel split by the vector loop is simply converted again
+      first = (uint32_t)(reduce_16_sse2(row, output, (size_t)width * mode) / mode);
+   }
+   else if (bit_depth == 16 && !premultiplies && format == PNG_FORMAT_NATIVE_16)
+   {
+      first = (uint32_t)(swap_16_sse2(row, output, (size_t)width * mode) / mode);
+   }
+#endif
+   format_pixels(row, output, first, width, mode, bit_depth, settings);
+}
+
+#define FORMAT_YUV_BLOCK 16
+
+// Y, U and V weights for red, green and blue in 8.8 fixed point, limited range
+static const int16_t yuv_weights[2][3][3] = {
+    {{66, 129, 25}, {-38, -74, 112}, {112, -94, -18}},
+    {{47, 157, 16}, {-26, -86, 112}, {112, -102, -10}},
+};
+// Offsets of 16 and 128 with the rounding bias, every sum then stays within 16 unsigned bits
+static const uint16_t yuv_offsets[3] = {(16 << 8) + 0x80, (128 << 8) + 0x80, (128 << 8) + 0x80};
+
+// Red, green and blue of count pixels from first, as 8-bit samples
+static void read_rgb(const uint8_t *row, uint32_t first, uint32_t count, enum pixel_format_t mode, uint8_t bit_depth, bool premultiply, uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+   const uint8_t channels = (uint8_t)mode;
+   const uint8_t colours = mode == GA || mode == RGBA ? channels - 1 : channels;
+   const uint8_t sample_size = bit_depth >> 3;
+   for (uint32_t i = 0; i < count; ++i)
+   {
+      uint32_t samples[4];
+      read_pixel(row + (size_t)(first + i) * channels * sample_size, mode, sample_size, premultiply, samples);
+      for (uint8_t c = 0; sample_size == 2 && c < colours; ++c)
+      {
+         samples[c] = reduce_16(samples[c]);
+      }
+      red[i] = (uint16_t)samples[0];
+      green[i] = (uint16_t)samples[colours == 3 ? 1 : 0];
+      blue[i] = (uint16_t)samples[colours == 3 ? 2 : 0];
+   }
+}
+
+// One of Y, U or V for count pixels, weights is its row of yuv_weights, or full range luma from luma_weights
+static void yuv_component(const uint16_t *red, const uint16_t *green, const uint16_t *blue, uint32_t count, const int16_t *weights, uint16_t offset, uint8_t *output)
+{
+   uint32_t i = 0;
+#ifdef __SSE2__
+   const __m128i red_weight = _mm_set1_epi16(weights[0]);
+   const __m128i green_weight = _mm_set1_epi16(weights[1]);
+   const __m128i blue_weight = _mm_set1_epi16(weights[2]);
+   const __m128i bias = _mm_set1_epi16((int16_t)offset);
+   for (; i + 8 <= count; i += 8)
+   {
+      // Sums wrap through negative weights but end in range, so 16-bit lanes give the exact result
+      __m128i sum = _mm_add_epi16(_mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(red + i)), red_weight), bias);
+      sum = _mm_add_epi16(sum, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(green + i)), green_weight));
+      sum = _mm_add_epi16(sum, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(blue + i)), blue_weight));
+      sum = _mm_srli_epi16(sum, 8);
+      _mm_storel_epi64((__m128i *)(output + i), _mm_packus_epi16(sum, sum));
+   }
+#endif
+   for (; i < count; ++i)
+   {
+      output[i] = (uint8_t)((weights[0] * red[i] + weights[1] * green[i] + weights[2] * blue[i] + offset) >> 8);
+   }
+}
+
+// Rounded means of 2x2 pixels from the first and second rows, the last column is repeated at an odd count
+static uint32_t average_2x2(const uint16_t *first, const uint16_t *second, uint32_t count, uint16_t *output)
+{
+   const uint32_t pairs = (count + 1) / 2;
+   uint32_t i = 0;
+#ifdef __SSE2__
+   if (count == FORMAT_YUV_BLOCK)
+   {
+      const __m128i ones = _mm_set1_epi16(1);
+      const __m128i two = _mm_set1_epi32(2);
+      const __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)first), ones), _mm_madd_epi16(_mm_loadu_si128((const __m128i *)second), ones));
+      const __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)(first + 8)), ones), _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(second + 8)), ones));
+      _mm_storeu_si128((__m128i *)output, _mm_packs_epi32(_mm_srli_epi32(_mm_add_epi32(low, two), 2), _mm_srli_epi32(_mm_add_epi32(high, two), 2)));
+      i = pairs;
+   }
+#endif
+   for (; i < pairs; ++i)
+   {
+      const uint32_t left = 2 * i;
+      const uint32_t right = left + 1 < count ? left + 1 : left;
+      output[i] = (uint16_t)((first[left] + first[right] + second[left] + second[right] + 2) >> 2);
+   }
+   return pairs;
+}
+
+void format_yuv_rows(const uint8_t *first, const uint8_t *second, uint8_t *first_luma, uint8_t *second_luma, uint8_t *chroma, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings)
+{
+   const int16_t(*weights)[3] = yuv_weights[settings->matrix == PNG_YUV_BT709];
+   const bool premultiply = settings->premultiply && (mode == GA || mode == RGBA);
+   uint16_t red[2][FORMAT_YUV_BLOCK];
+   uint16_t green[2][FORMAT_YUV_BLOCK];
+   uint16_t blue[2][FORMAT_YUV_BLOCK];
+   for (uint32_t x = 0; x < width; x += FORMAT_YUV_BLOCK)
+   {
+      const uint32_t count = width - x < FORMAT_YUV_BLOCK ? width - x : FORMAT_YUV_BLOCK;
+      read_rgb(first, x, count, mode, bit_depth, premultiply, red[0], green[0], blue[0]);
+      yuv_component(red[0], green[0], blue[0], count, weights[0], yuv_offsets[0], first_luma + x);
+      if (settings->format == PNG_FORMAT_I444)
+      {
+         yuv_component(red[0], green[0], blue[0], count, weights[1], yuv_offsets[1], chroma + x);
+         yuv_component(red[0], green[0], blue[0], count, weights[2], yuv_offsets[2], chroma + settings->chroma_plane_size + x);
+         continue;
+      }
+
+      // The last row of an odd height is averaged with itself
+      const int other = second != NULL;
+      if (second != NULL)
+      {
+         read_rgb(second, x, count, mode, bit_depth, premultiply, red[1], green[1], blue[1]);
+         yuv_component(red[1], green[1], blue[1], count, weights[0], yuv_offsets[0], second_luma + x);
+      }
+      uint16_t mean[3][FORMAT_YUV_BLOCK / 2];
+      const uint32_t pairs = average_2x2(red[0], red[other], count, mean[0]);
+      average_2x2(green[0], green[other], count, mean[1]);
+      average_2x2(blue[0], blue[other], count, mean[2]);
+      uint8_t u[FORMAT_YUV_BLOCK / 2];
+      uint8_t v[FORMAT_YUV_BLOCK / 2];
+      yuv_component(mean[0], mean[1], mean[2], pairs, weights[1], yuv_offsets[1], u);
+      yuv_component(mean[0], mean[1], mean[2], pairs, weights[2], yuv_offsets[2], v);
+      if (settings->format == PNG_FORMAT_NV12)
+      {
+         uint8_t *uv = chroma + x;
+#ifdef __SSE2__
+         if (pairs == FORMAT_YUV_BLOCK / 2)
+         {
+            _mm_storeu_si128((__m128i *)uv, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)u), _mm_loadl_epi64((const __m128i *)v)));
+            continue;
+         }
+#endif
+         for (uint32_t i = 0; i < pairs; ++i)
+         {
+            uv[i * 2] = u[i];
+            uv[i * 2 + 1] = v[i];
+         }
+      }
+      else
+      {
+         memcpy(chroma + x / 2, u, pairs);
+         memcpy(chroma + settings->chroma_plane_size + x / 2, v, pairs);
+      }
+   }
+}
+
+// Full range luma weights for red, green and blue in 8.8 fixed point, each set sums to 256 so grey is unchanged
+static const int16_t luma_weights[2][3] = {{77, 150, 29}, {54, 183, 19}};
+
+// Decoded channel holding channel 0 to 3 of RGBA, -1 for alpha of an image without it
+static int8_t projection_source(enum pixel_format_t mode, uint8_t channel)
+{
+   const bool alpha = mode == GA || mode == RGBA;
+   if (channel == 3)
+   {
+      return alpha ? (int8_t)(mode - 1) : -1;
+   }
+   return mode == G || mode == GA ? 0 : (int8_t)channel;
+}
+
+#ifdef __SSE2__
+// Sixteen 8-bit pixels at a time, the source sample of each GA or RGBA pixel is shifted down and packed
+static uint32_t project_channel_8_sse2(const uint8_t *row, uint8_t *output, uint32_t width, uint8_t channels, int8_t source)
+{
+   const __m128i shift = _mm_cvtsi32_si128(source * 8);
+   uint32_t x = 0;
+   if (channels == 4)
+   {
+      const __m128i mask = _mm_set1_epi32(0xff);
+      for (; x + 16 <= width; x += 16)
+      {
+         const __m128i *s = (const __m128i *)(row + (size_t)x * 4);
+         const __m128i a = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s), shift), mask);
+         const __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s + 1), shift), mask);
+         const __m128i c = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s + 2), shift), mask);
+         const __m128i d = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s + 3), shift), mask);
+         _mm_storeu_si128((__m128i *)(output + x), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+      }
+   }
+   else if (channels == 2)
+   {
+      const __m128i mask = _mm_set1_epi16(0xff);
+      for (; x + 16 <= width; x += 16)
+      {
+         const __m128i *s = (const __m128i *)(row + (size_t)x * 2);
+         const __m128i a = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(s), shift), mask);
+         const __m128i b = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(s + 1), shift), mask);
+         _mm_storeu_si128((__m128i *)(output + x), _mm_packus_epi16(a, b));
+      }
+   }
+   return x;
+}
+#endif
+
+// Colour samples are multiplied by alpha when premultiply is set, 16-bit samples are rounded to 8 bits
+static void project_channel(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, int8_t source, bool premultiply)
+{
+   const uint8_t channels = (uint8_t)mode;
+   const uint8_t sample_size = bit_depth >> 3;
+   const uint8_t alpha = channels - 1;
+   uint32_t x = 0;
+   if (source < 0)
+   {
+      memset(output, 0xff, width);
+      return;
+   }
+   if (channels == 1 && sample_size == 1)
+   {
+      memcpy(output, row, width);
+      return;
+   }
+#ifdef __SSE2__
+   if (sample_size == 1 && !premultiply)
+   {
+      x = project_channel_8_sse2(row, output, width, channels, source);
+   }
+#endif
+   for (; x < width; ++x)
+   {
+      const uint8_t *pixel = row + (size_t)x * channels * sample_size;
+      if (sample_size == 1)
+      {
+         output[x] = (uint8_t)(premultiply ? premultiply_8(pixel[source], pixel[alpha]) : pixel[source]);
+         continue;
+      }
+      uint32_t sample = (uint32_t)((pixel[source * 2] << 8) | pixel[source * 2 + 1]);
+      if (premultiply)
+      {
+         sample = premultiply_16(sample, (uint32_t)((pixel[alpha * 2] << 8) | pixel[alpha * 2 + 1]));
+      }
+      output[x] = (uint8_t)reduce_16(sample);
+   }
+}
+
+void format_projection_row(const uint8_t *row, uint8_t *output, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth, const struct format_settings_t *settings)
+{
+   const bool alpha = mode == GA || mode == RGBA;
+   if (settings->format != PNG_FORMAT_LUMA8)
+   {
+      const uint8_t channel = settings->format == PNG_FORMAT_ALPHA8 ? 3 : settings->channel;
+      project_channel(row, output, width, mode, bit_depth, projection_source(mode, channel), settings->premultiply && alpha && channel < 3);
+      return;
+   }
+   if (mode == G || mode == GA)
+   {
+      project_channel(row, output, width, mode, bit_depth, 0, settings->premultiply && alpha);
+      return;
+   }
+
+   const int16_t *weights = luma_weights[settings->matrix == PNG_YUV_BT709];
+   uint16_t red[FORMAT_YUV_BLOCK];
+   uint16_t green[FORMAT_YUV_BLOCK];
+   uint16_t blue[FORMAT_YUV_BLOCK];
+   for (uint32_t x = 0; x < width; x += FORMAT_YUV_BLOCK)
+   {
+      const uint32_t count = width - x < FORMAT_YUV_BLOCK ? width - x : FORMAT_YUV_BLOCK;
+      read_rgb(row, x, count, mode, bit_depth, settings->premultiply && alpha, red, green, blue);
+      yuv_component(red, green, blue, count, weights, 0x80, output + x);
+   }
+}
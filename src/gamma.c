@@ -0,0 +1,54 @@
+#include "gamma.h"
+#include "logger.h"
+
+#include <math.h>
+#include <pthread.h>
+
+static struct gamma_table_t gamma_cache[GAMMA_CACHE_SIZE];
+static uint32_t gamma_cache_count = 0;
+static pthread_mutex_t gamma_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void build_table_16(uint16_t *table, uint32_t gamma)
+{
+   const double exponent = (double)GAMMA_SRGB / gamma;
+   for (int i = 0; i < 65536; ++i)
+   {
+      table[i] = (uint16_t)(pow(i / 65535.0, exponent) * 65535.0 + 0.5);
+   }
+}
+
+void gamma_table_build(struct gamma_table_t *table, uint32_t gamma, uint8_t bit_depth)
+{
+   const double exponent = (double)GAMMA_SRGB / gamma;
+   table->gamma = gamma;
+   for (int i = 0; i < 256; ++i)
+   {
+      table->table_8[i] = (uint8_t)(pow(i / 255.0, exponent) * 255.0 + 0.5);
+   }
+   if (bit_depth == 16)
+   {
+      build_table_16(table->table_16, gamma);
+   }
+}
+
+const struct gamma_table_t *gamma_table_find(uint32_t gamma)
+{
+   pthread_mutex_lock(&gamma_cache_lock);
+   struct gamma_table_t *table = NULL;
+   for (uint32_t i = 0; i < gamma_cache_count && table == NULL; ++i)
+   {
+      if (gamma_cache[i].gamma == gamma)
+      {
+         table = &gamma_cache[i];
+      }
+   }
+   if (table == NULL && gamma_cache_count < GAMMA_CACHE_SIZE)
+   {
+      table = &gamma_cache[gamma_cache_count++];
+      table->table_16 = NULL;
+      gamma_table_build(table, gamma, 8);
+      log_debug("Cached gamma table %u of %u", gamma_cache_count, GAMMA_CACHE_SIZE);
+   }
+   pthread_mutex_unlock(&gamma_cache_lock);
+   return table;
+}
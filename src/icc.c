@@ -0,0 +1,373 @@
+#include "icc.h"
+#include "logger.h"
+#include "md5.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ICC_HEADER_SIZE 128
+#define ICC_TAG_ENTRY_SIZE 12
+#define ICC_SIGNATURE(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+#define ICC_RGB ICC_SIGNATURE('R', 'G', 'B', ' ')
+#define ICC_GRAY ICC_SIGNATURE('G', 'R', 'A', 'Y')
+#define ICC_XYZ ICC_SIGNATURE('X', 'Y', 'Z', ' ')
+#define ICC_CURV ICC_SIGNATURE('c', 'u', 'r', 'v')
+#define ICC_PARA ICC_SIGNATURE('p', 'a', 'r', 'a')
+
+static struct icc_transform_t icc_cache[ICC_CACHE_SIZE];
+static uint32_t icc_cache_count = 0;
+static pthread_mutex_t icc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// PCS XYZ is relative to D50, Bradford adapted to the D65 white of sRGB
+static const double xyz_d50_to_srgb[3][3] = {{3.1338561, -1.6168667, -0.4906146}, {-0.9787684, 1.9161415, 0.0334540}, {0.0719453, -0.2289914, 1.4052427}};
+
+// Tag data located in the profile, a curve is either a curv or a para tag
+struct icc_tag_t
+{
+   const uint8_t *data;
+   uint32_t size;
+};
+
+static uint32_t read_u32(const uint8_t *data)
+{
+   return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+static uint16_t read_u16(const uint8_t *data)
+{
+   return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+static double read_s15_fixed16(const uint8_t *data)
+{
+   return (int32_t)read_u32(data) / 65536.0;
+}
+
+static int find_tag(const uint8_t *profile, size_t size, uint32_t signature, struct icc_tag_t *tag)
+{
+   const uint32_t count = read_u32(profile + ICC_HEADER_SIZE);
+   if (count > (size - ICC_HEADER_SIZE - 4) / ICC_TAG_ENTRY_SIZE)
+   {
+      return -1;
+   }
+   for (uint32_t i = 0; i < count; ++i)
+   {
+      const uint8_t *entry = profile + ICC_HEADER_SIZE + 4 + i * ICC_TAG_ENTRY_SIZE;
+      const uint32_t offset = read_u32(entry + 4);
+      const uint32_t tag_size = read_u32(entry + 8);
+      if (read_u32(entry) == signature && offset <= size && tag_size <= size - offset)
+      {
+         tag->data = profile + offset;
+         tag->size = tag_size;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+static int read_colorant(const uint8_t *profile, size_t size, uint32_t signature, double *xyz)
+{
+   struct icc_tag_t tag;
+   if (find_tag(profile, size, signature, &tag) != 0 || tag.size < 20 || read_u32(tag.data) != ICC_XYZ)
+   {
+      return -1;
+   }
+   for (int i = 0; i < 3; ++i)
+   {
+      xyz[i] = read_s15_fixed16(tag.data + 8 + i * 4);
+   }
+   return 0;
+}
+
+static int read_curve(const uint8_t *profile, size_t size, uint32_t signature, struct icc_tag_t *curve)
+{
+   const uint8_t parameter_counts[5] = {1, 3, 4, 5, 7};
+   if (find_tag(profile, size, signature, curve) != 0 || curve->size < 12)
+   {
+      return -1;
+   }
+   const uint32_t type = read_u32(curve->data);
+   if (type == ICC_CURV)
+   {
+      return read_u32(curve->data + 8) <= (curve->size - 12) / 2 ? 0 : -1;
+   }
+   if (type == ICC_PARA)
+   {
+      const uint16_t function = read_u16(curve->data + 8);
+      return function < 5 && curve->size >= 12u + parameter_counts[function] * 4u ? 0 : -1;
+   }
+   return -1;
+}
+
+// Encoded value in [0, 1] to linear
+static double evaluate_curve(const struct icc_tag_t *curve, double x)
+{
+   if (read_u32(curve->data) == ICC_CURV)
+   {
+      const uint32_t count = read_u32(curve->data + 8);
+      const uint8_t *points = curve->data + 12;
+      if (count == 0)
+      {
+         return x;
+      }
+      if (count == 1)
+      {
+         return pow(x, read_u16(points) / 256.0);
+      }
+      const double position = x * (count - 1);
+      const uint32_t index = position >= count - 1 ? count - 2 : (uint32_t)position;
+      const double fraction = position - index;
+      return (read_u16(points + index * 2) * (1 - fraction) + read_u16(points + index * 2 + 2) * fraction) / 65535.0;
+   }
+
+   double p[7] = {0};
+   const uint16_t function = read_u16(curve->data + 8);
+   for (int i = 0; i < 7 && 12u + i * 4u + 4u <= curve->size; ++i)
+   {
+      p[i] = read_s15_fixed16(curve->data + 12 + i * 4);
+   }
+   switch (function)
+   {
+   case 0:
+      return pow(x, p[0]);
+   case 1:
+      return x >= -p[2] / p[1] ? pow(p[1] * x + p[2], p[0]) : 0;
+   case 2:
+      return x >= -p[2] / p[1] ? pow(p[1] * x + p[2], p[0]) + p[3] : p[3];
+   case 3:
+      return x >= p[4] ? pow(p[1] * x + p[2], p[0]) : p[3] * x;
+   default:
+      return x >= p[4] ? pow(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6];
+   }
+}
+
+static uint16_t to_linear(const struct icc_tag_t *curve, double x)
+{
+   const double y = evaluate_curve(curve, x);
+   return isfinite(y) ? (uint16_t)(fmin(fmax(y, 0), 1) * 65535.0 + 0.5) : 0;
+}
+
+static double encode_srgb(double linear)
+{
+   return linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+}
+
+static void build_tables_16(uint16_t *tables, const struct icc_tag_t *curves, uint8_t channels)
+{
+   for (uint8_t c = 0; c < channels; ++c)
+   {
+      for (int i = 0; i < 0x10000; ++i)
+      {
+         tables[c * 0x10000 + i] = to_linear(&curves[c], i / 65535.0);
+      }
+   }
+   uint16_t *encode = tables + 3 * 0x10000;
+   for (int i = 0; i < 0x10000; ++i)
+   {
+      encode[i] = (uint16_t)(encode_srgb(i / 65535.0) * 65535.0 + 0.5);
+   }
+}
+
+// Reads the curves of a matrix/TRC profile, and its colorants when it is RGB
+static int read_profile(const uint8_t *profile, size_t size, struct icc_tag_t *curves, uint8_t *channels, struct matrix_3x3_t *rgb_to_srgb)
+{
+   // The header's own size field bounds the tags
+   if (size < ICC_HEADER_SIZE + 4 || read_u32(profile) < ICC_HEADER_SIZE + 4 || read_u32(profile) > size || read_u32(profile + 20) != ICC_XYZ)
+   {
+      return -1;
+   }
+   size = read_u32(profile);
+   const uint32_t colour_space = read_u32(profile + 16);
+   if (colour_space == ICC_GRAY)
+   {
+      *channels = 1;
+      return read_curve(profile, size, ICC_SIGNATURE('k', 'T', 'R', 'C'), &curves[0]);
+   }
+   if (colour_space != ICC_RGB)
+   {
+      return -1;
+   }
+
+   *channels = 3;
+   double colorants[3][3];
+   const uint32_t colorant_tags[3] = {ICC_SIGNATURE('r', 'X', 'Y', 'Z'), ICC_SIGNATURE('g', 'X', 'Y', 'Z'), ICC_SIGNATURE('b', 'X', 'Y', 'Z')};
+   const uint32_t curve_tags[3] = {ICC_SIGNATURE('r', 'T', 'R', 'C'), ICC_SIGNATURE('g', 'T', 'R', 'C'), ICC_SIGNATURE('b', 'T', 'R', 'C')};
+   for (int c = 0; c < 3; ++c)
+   {
+      if (read_colorant(profile, size, colorant_tags[c], colorants[c]) != 0 || read_curve(profile, size, curve_tags[c], &curves[c]) != 0)
+      {
+         return -1;
+      }
+   }
+   // Colorants are the columns of the profile's RGB to XYZ matrix
+   for (int i = 0; i < 3; ++i)
+   {
+      for (int j = 0; j < 3; ++j)
+      {
+         rgb_to_srgb->data[i][j] = (float)(xyz_d50_to_srgb[i][0] * colorants[j][0] + xyz_d50_to_srgb[i][1] * colorants[j][1] + xyz_d50_to_srgb[i][2] * colorants[j][2]);
+      }
+   }
+   return 0;
+}
+
+// Everything but the key and the 16-bit tables
+static int compile_transform(struct icc_transform_t *transform, const uint8_t *profile, size_t size)
+{
+   struct icc_tag_t curves[3];
+   struct matrix_3x3_t rgb_to_srgb;
+   if (read_profile(profile, size, curves, &transform->channels, &rgb_to_srgb) != 0 || (transform->channels == 3 && chroma_matrix_set(&transform->matrix, &rgb_to_srgb) != 0))
+   {
+      return -1;
+   }
+   for (uint8_t c = 0; c < transform->channels; ++c)
+   {
+      for (int i = 0; i < 256; ++i)
+      {
+         transform->linear_8[c][i] = to_linear(&curves[c], i / 255.0);
+      }
+   }
+   for (int i = 0; i < ICC_ENCODE_8_SIZE; ++i)
+   {
+      transform->encode_8[i] = (uint8_t)(encode_srgb(((i << ICC_ENCODE_8_SHIFT) + 1.5) / 65535.0) * 255.0 + 0.5);
+   }
+
+   // sRGB profiles leave 8-bit samples as they are
+   transform->identity = transform->channels == 1 || transform->matrix.identity;
+   for (uint8_t c = 0; c < transform->channels && transform->identity; ++c)
+   {
+      for (int i = 0; i < 256 && transform->identity; ++i)
+      {
+         transform->identity = transform->encode_8[transform->linear_8[c][i] >> ICC_ENCODE_8_SHIFT] == i;
+      }
+   }
+   return 0;
+}
+
+int icc_tables_16_build(struct icc_transform_t *transform, const uint8_t *profile, size_t size)
+{
+   struct icc_tag_t curves[3];
+   struct matrix_3x3_t rgb_to_srgb;
+   uint8_t channels;
+   if (read_profile(profile, size, curves, &channels, &rgb_to_srgb) != 0)
+   {
+      return -1;
+   }
+   build_tables_16(transform->tables_16, curves, channels);
+   return 0;
+}
+
+static struct icc_transform_t *find_cached(const uint8_t *key)
+{
+   for (uint32_t i = 0; i < icc_cache_count; ++i)
+   {
+      if (memcmp(icc_cache[i].key, key, sizeof(icc_cache[i].key)) == 0)
+      {
+         return &icc_cache[i];
+      }
+   }
+   return NULL;
+}
+
+int icc_transform_find(const uint8_t *profile, size_t size, struct icc_transform_t *fallback, const struct icc_transform_t **transform)
+{
+   union md5_t key = md5_hash(profile, size * 8);
+   *transform = NULL;
+
+   pthread_mutex_lock(&icc_cache_lock);
+   const struct icc_transform_t *cached = find_cached(key.out);
+   pthread_mutex_unlock(&icc_cache_lock);
+   if (cached != NULL)
+   {
+      *transform = cached->usable ? cached : NULL;
+      return cached->usable ? 0 : -1;
+   }
+
+   // Compiled outside the lock, another decoder may cache the same profile meanwhile
+   fallback->usable = compile_transform(fallback, profile, size) == 0;
+   memcpy(fallback->key, key.out, sizeof(key.out));
+
+   pthread_mutex_lock(&icc_cache_lock);
+   cached = find_cached(key.out);
+   if (cached == NULL && icc_cache_count < ICC_CACHE_SIZE)
+   {
+      struct icc_transform_t *entry = &icc_cache[icc_cache_count];
+      *entry = *fallback;
+      entry->tables_16 = NULL;
+      cached = entry;
+      ++icc_cache_count;
+      log_debug("Cached ICC transform %u of %u", icc_cache_count, ICC_CACHE_SIZE);
+   }
+   pthread_mutex_unlock(&icc_cache_lock);
+
+   *transform = cached != NULL ? cached : fallback;
+   if (!(*transform)->usable)
+   {
+      *transform = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+static inline uint16_t saturate_linear(int64_t value)
+{
+   return value < 0 ? 0 : value > 0xffff ? 0xffff : (uint16_t)value;
+}
+
+void icc_transform_row(const struct icc_transform_t *transform, uint8_t *row, uint32_t width, uint8_t channels, uint8_t bit_depth)
+{
+   const int32_t(*m)[3] = transform->matrix.data;
+   if (bit_depth == 16)
+   {
+      const uint16_t *linear = transform->tables_16;
+      const uint16_t *encode = transform->tables_16 + 3 * 0x10000;
+      const size_t stride = (size_t)channels * 2;
+      for (uint32_t x = 0; x < width; ++x)
+      {
+         uint8_t *pixel = row + x * stride;
+         uint16_t out[3];
+         if (transform->channels == 1)
+         {
+            out[0] = encode[linear[(pixel[0] << 8) | pixel[1]]];
+         }
+         else
+         {
+            const int64_t r = linear[(pixel[0] << 8) | pixel[1]];
+            const int64_t g = linear[0x10000 + ((pixel[2] << 8) | pixel[3])];
+            const int64_t b = linear[0x20000 + ((pixel[4] << 8) | pixel[5])];
+            for (int c = 0; c < 3; ++c)
+            {
+               out[c] = encode[saturate_linear((m[c][0] * r + m[c][1] * g + m[c][2] * b + CHROMA_ROUND) >> CHROMA_SHIFT)];
+            }
+         }
+         for (uint8_t c = 0; c < transform->channels; ++c)
+         {
+            pixel[c * 2] = (uint8_t)(out[c] >> 8);
+            pixel[c * 2 + 1] = (uint8_t)out[c];
+         }
+      }
+      return;
+   }
+
+   if (transform->channels == 1)
+   {
+      for (uint32_t x = 0; x < width; ++x)
+      {
+         uint8_t *pixel = row + (size_t)x * channels;
+         pixel[0] = transform->encode_8[transform->linear_8[0][pixel[0]] >> ICC_ENCODE_8_SHIFT];
+      }
+      return;
+   }
+   for (uint32_t x = 0; x < width; ++x)
+   {
+      uint8_t *pixel = row + (size_t)x * channels;
+      const int64_t r = transform->linear_8[0][pixel[0]];
+      const int64_t g = transform->linear_8[1][pixel[1]];
+      const int64_t b = transform->linear_8[2][pixel[2]];
+      for (int c = 0; c < 3; ++c)
+      {
+         pixel[c] = transform->encode_8[saturate_linear((m[c][0] * r + m[c][1] * g + m[c][2] * b + CHROMA_ROUND) >> CHROMA_SHIFT) >> ICC_ENCODE_8_SHIFT];
+      }
+   }
+}
@@ -1,9 +1,14 @@
 // https://cplusplus.com/reference/cstdio/printf/
 // %[flags][width][.precision][length]specifier
 
+#ifndef __MINGW32__
+#define _POSIX_C_SOURCE 200809L // localtime_r
+#endif
+
 #include "logger.h"
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -40,7 +45,7 @@
 
 struct logger_settings_t
 {
-    char name[LOG_MAX_APP_NAME_LENGTH];
+    char name[LOG_MAX_APP_NAME_LENGTH + 1];
 };
 
 struct token_t
@@ -68,9 +73,17 @@ static size_t string_copy(char *output, size_t limit, const char *input)
     return index;
 }
 
-static struct logger_settings_t *logger_settings(uint32_t mode, void *settings)
+// Settings are shared by every thread that logs, updates and reads are serialised by a spinlock
+// and readers receive a copy so no reference to the shared settings escapes the lock
+static void logger_settings(uint32_t mode, void *settings, struct logger_settings_t *copy)
 {
     static struct logger_settings_t logger_settings = {0};
+    static atomic_flag lock = ATOMIC_FLAG_INIT;
+
+    while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire))
+    {
+    }
+
     if (mode & LOG_UPDATE_SETTINGS && mode & LOG_UPDATE_APP_NAME && settings != NULL)
     {
         const char *app_name = (const char *)settings;
@@ -80,9 +93,14 @@ static struct logger_settings_t *logger_settings(uint32_t mode, void *settings)
             app_name_len = LOG_MAX_APP_NAME_LENGTH;
         }
         string_copy(logger_settings.name, app_name_len, app_name);
+        logger_settings.name[app_name_len] = '\0';
+    }
+    if (copy != NULL)
+    {
+        *copy = logger_settings;
     }
 
-    return &logger_settings;
+    atomic_flag_clear_explicit(&lock, memory_order_release);
 }
 
 static size_t readtoken(const char *input, struct token_t *token)
@@ -487,8 +505,13 @@ size_t parse_message(char *output_buffer, size_t output_buffer_size, const char
 static size_t add_timestamp(char *timebuffer)
 {
     time_t ltime = time(NULL);
-    struct tm *time2 = localtime(&ltime);
-    strftime(timebuffer, 32, "%Y-%m-%dT%H:%M:%S", time2);
+    struct tm time2;
+#ifdef __MINGW32__
+    localtime_s(&time2, &ltime);
+#else
+    localtime_r(&ltime, &time2);
+#endif
+    strftime(timebuffer, 32, "%Y-%m-%dT%H:%M:%S", &time2);
     size_t index = strlen(timebuffer);
 
     struct timespec now;
@@ -506,7 +529,7 @@ static size_t add_timestamp(char *timebuffer)
 
 void log_set_app_name(const char *name)
 {
-    logger_settings(LOG_UPDATE_SETTINGS | LOG_UPDATE_APP_NAME, (void *)name);
+    logger_settings(LOG_UPDATE_SETTINGS | LOG_UPDATE_APP_NAME, (void *)name, NULL);
 }
 
 void logger(const char *type, const char *message, va_list *args)
@@ -517,9 +540,10 @@ void logger(const char *type, const char *message, va_list *args)
     output[index] = ' ';
     output[index + 1] = '[';
     index += 2;
-    const char *app_name = logger_settings(LOG_READ_SETTINGS, NULL)->name;
+    struct logger_settings_t settings;
+    logger_settings(LOG_READ_SETTINGS, NULL, &settings);
 
-    index += string_copy(output + index, strlen(app_name), app_name);
+    index += string_copy(output + index, strlen(settings.name), settings.name);
     index += string_copy(output + index, MAX_STR_LEN - index, type);
     index += parse_message(output + index, MAX_STR_LEN - index, message, args);
     output[index] = '\n';
@@ -54,6 +54,22 @@ void export_ppm(struct image_t *image)
             fwrite(px_alpha, 3, 1, fp_alpha);
         }
         break;
+    case BGRA:
+    case RGBX:
+    case BGRX:
+        for (uint32_t i = 0; i < image->size; i += 4)
+        {
+            uint8_t px[3] = {image->data[i], image->data[i + 1], image->data[i + 2]};
+            if (image->mode != RGBX)
+            {
+                px[0] = image->data[i + 2];
+                px[2] = image->data[i];
+            }
+            fwrite(px, 3, 1, fp);
+            uint8_t px_alpha[3] = {image->data[i + 3], image->data[i + 3], image->data[i + 3]};
+            fwrite(px_alpha, 3, 1, fp_alpha);
+        }
+        break;
     case INVALID:
         break;
     }
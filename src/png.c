@@ -4,11 +4,18 @@
 #include "zlib.h"
 #include "filter.h"
 #include "logger.h"
+#include "thread_pool.h"
+#include "colour.h"
+#include "gamma.h"
+#include "icc.h"
+#include "flatten.h"
+#include "format.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <sched.h>
 
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define PNG_HEADER 0x0A1A0A0D474E5089
@@ -35,6 +42,8 @@
 #define PNG_fcTL 0x4C546366
 #define PNG_fdAT 0x54416466
 #define PNG_eXIf 0x66495865
+#define PNG_iDOT 0x544F4469
+#define PNG_rsIX 0x58497372
 #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #error Endianess not supported
 // #define PNG_HEADER 0x89504E470D0A1A0A
@@ -47,6 +56,12 @@
 #define PNG_CHUNK_LENGTH_SIZE sizeof(uint32_t)
 #define PNG_CHUNK_TYPE_SIZE sizeof(uint32_t)
 #define PNG_CHUNK_CRC_SIZE sizeof(uint32_t)
+#define PNG_CHUNK_LENGTH_MAX 0x7FFFFFFF
+
+#define PNG_PROBE_CHUNK_LIST_SIZE 16
+#define PNG_PROBE_BLOCK_SIZE 4096
+#define PNG_PROFILE_BLOCK_SIZE 4096
+#define PNG_KEYWORD_MAX 79
 
 #define GREYSCALE_TRNS_SIZE 2
 #define TRUECOLOUR_TRNS_SIZE 6
@@ -56,38 +71,203 @@
 #define CHRM_DISABLED 0x00
 #define CHRM_CHROMA 0x02
 #define CHRM_GAMMA 0x01
+#define CHRM_SRGB 0x04 // Samples are already sRGB, overrides gAMA and cHRM
+#define CHRM_CICP 0x08 // sRGB cICP, overrides every other colour chunk
+#define CHRM_ICC 0x10 // Overrides sRGB, gAMA and cHRM
+
+#define SRGB_INTENT_MAX 3
+#define CICP_PRIMARIES_BT709 1
+#define CICP_TRANSFER_SRGB 13
+#define CICP_MATRIX_IDENTITY 0 // RGB samples, PNG allows no other matrix
+
+#define PNG_PALETTE_MAX 256
+
+#define PNG_SPLIT_THRESHOLD 0x400000 // Pixels, 4 MP
+#define PNG_BAND_ROWS_MIN 16
+#define PNG_BANDS_PER_WORKER 4
+
+#define PNG_DECODE_THREADED (PNG_DECODE_PIPELINE | PNG_DECODE_PARALLEL_PASSES | PNG_DECODE_PARALLEL_ROWS | PNG_DECODE_PARALLEL_INFLATE | PNG_DECODE_SEGMENTS | PNG_DECODE_ASYNC_CRC | PNG_DECODE_ROW_BANDS)
+#define PNG_CHAINS_PER_WORKER 4
+#define PNG_CRC_SLICE_MIN 0x20000 // Smaller IDAT chunks are checked before they are inflated
+#define PNG_CRC_SLICE_MAX 16
+
+#define PNG_SEGMENT_MAX 256
+#define IDOT_HEADER_SIZE 16
+#define IDOT_ENTRY_SIZE 12
+#define RSIX_ENTRY_SIZE 12
+
+#define PIPELINE_SLOT_COUNT 64 // Power of two
+#define PIPELINE_SPIN_COUNT 256
+
+struct png_suspended_t;
+
+struct png_decoder_t
+{
+   struct png_allocator_t allocator;
+   uint8_t lz77_window[ZLIB_BUFFER_MAX_SIZE];
+   struct rgb_t palette[PNG_PALETTE_MAX];
+   uint8_t alpha[PNG_PALETTE_MAX];
+   uint8_t *scanline_buffers;
+   size_t scanline_buffers_size;
+   uint8_t *chunk_buffer;
+   size_t chunk_buffer_size;
+   uint8_t *output; // Spare output buffer, handed back by close_png
+   size_t output_size;
+   uint32_t open_images; // Images whose data close_png still has to hand back
+   bool destroyed; // png_decoder_destroy ran while images were open, the last close_png frees the decoder
+   struct thread_pool_t *pool; // Post-processing of images at or above split_threshold is split into row bands when set
+   uint64_t split_threshold;
+   uint8_t owns_pool; // Pool was created from the decoder options rather than lent by a batch
+   uint32_t flags;
+   uint8_t *ring; // Pipeline slots, reused between decodes
+   size_t ring_size;
+   uint8_t *pipeline_bands; // Row bands colour corrected while a pipeline runs
+   size_t pipeline_bands_size;
+   uint8_t *row_bands; // Row bands post-processed once an image is decoded
+   size_t row_bands_size;
+   uint8_t *filtered; // Whole inflated image for the parallel unfilter modes
+   size_t filtered_size;
+   uint8_t *task_scanlines; // Scanline buffer pairs for parallel unfilter tasks
+   size_t task_scanlines_size;
+   uint8_t *compressed; // Whole zlib stream for speculative inflate
+   size_t compressed_size;
+   struct png_suspended_t *suspend; // Set by batches that interleave inflate, decoding stops at IEND until it is resumed
+   struct gamma_table_t gamma; // Used by 16-bit images and once the process wide gamma cache is full
+   uint32_t gamma_16; // Gamma table_16 was built for, 0 before it is built
+   struct icc_transform_t icc; // Likewise for ICC transforms
+   uint8_t icc_16[16]; // Profile MD5 icc.tables_16 was built for, zero before it is built
+   uint8_t *profile; // Inflated iCCP profile
+   size_t profile_size;
+   uint16_t background[3]; // Flattened onto without bKGD, 16-bit RGB
+   enum png_output_format_t format;
+   float scale[4];
+   float bias[4];
+   enum png_yuv_matrix_t yuv_matrix;
+   uint8_t channel;
+   uint8_t *staged; // Decoded rows waiting to be flattened or converted into the output
+   size_t staged_size;
+};
+
+// Inflated image data held back until IEND, bytes past the expected size are dropped
+struct filtered_buffer_t
+{
+   uint8_t *data;
+   size_t size;
+   size_t index;
+};
+
+// Restart points of a segmented IDAT stream, iDOT locates segments by the file offset of their first IDAT chunk
+struct png_segments_t
+{
+   struct zlib_segment_t entries[PNG_SEGMENT_MAX];
+   uint32_t first_rows[PNG_SEGMENT_MAX];
+   uint64_t file_offsets[PNG_SEGMENT_MAX];
+   uint32_t count;
+   uint32_t located; // Segments whose stream offset is known
+   uint32_t name;
+};
+
+// Image bytes come either from an open file or a caller buffer
+struct png_source_t
+{
+   FILE *file;
+   const uint8_t *data;
+   size_t size;
+   size_t position;
+};
 
 struct colour_transforms_t
 {
-   struct matrix_3x3_t rgb_to_xyz_matrix;
-   float gamma;
+   struct chroma_matrix_t chroma;
+   const struct gamma_table_t *gamma;
+   const struct icc_transform_t *icc;
    uint8_t active;
 };
 
+static const struct colour_transforms_t no_colour_transforms = {.active = CHRM_DISABLED};
+
+// Rows are decoded into a decoder buffer, then flattened, colour corrected and converted into target
+struct output_stage_t
+{
+   enum pixel_format_t mode; // Of the decoded rows
+   uint8_t bit_depth;
+   bool flatten;
+   uint16_t background[3]; // At the decoded bit depth
+   const struct colour_transforms_t *ct; // Applied after flattening, as bKGD is in the image's colour space
+   bool convert;
+   struct format_settings_t settings;
+   bool bottom_up;
+   const struct image_t *target;
+   uint8_t *held; // Serial decodes to subsampled YUV keep the first row of each pair here
+   size_t held_size;
+};
+
+// Decode state at IEND, everything left once the image data is inflated
+struct png_finish_t
+{
+   struct output_settings_t settings;
+   struct colour_transforms_t ct;
+   struct filtered_buffer_t filtered;
+   struct data_buffer_t image;
+   struct output_stage_t stage;
+   struct image_t staged; // Decoded rows run through stage into the output when staging is set
+   bool staging;
+   bool deferred; // Filtered data is still to be unfiltered
+   bool segmented;
+   uint8_t interlace_method;
+   bool corrected;
+};
+
+// Decode state kept at IEND with the image data still in the decoder's compressed buffer
+struct png_suspended_t
+{
+   struct png_finish_t finish;
+   struct zlib_t zlib; // Untouched, for inflating serially when the interleaved inflate fails
+   size_t compressed_length;
+   bool suspended;
+};
+
 const char *const colour_names[] = {"Greyscale", "Invalid", "Truecolour", "Indexed", "Greyscale Alpha", "Invalid", "Truecolour Alpha"};
 
 void debug_image(const struct image_t *image)
 {
    for (uint32_t y = 0; y < image->height; y++)
    {
-      for (uint32_t x = 0; x < image->width * image->mode; x++)
+      for (uint32_t x = 0; x < image->width * format_channels(image->mode); x++)
       {
-         printf("%02x ", image->data[(y * image->width * image->mode) + x]);
+         printf("%02x ", image->data[(y * image->stride) + x]);
       }
       printf("\n");
    }
 }
 
-int check_png_file_header(FILE *png_ptr)
+// Returns 1 when all size bytes were read, matching fread with a count of one
+static size_t source_read(struct png_source_t *source, void *buffer, size_t size)
 {
-   if (png_ptr == NULL)
+   if (source->file != NULL)
+   {
+      return fread(buffer, size, 1, source->file);
+   }
+   if (size > source->size - source->position)
+   {
+      source->position = source->size;
+      return 0;
+   }
+   memcpy(buffer, source->data + source->position, size);
+   source->position += size;
+   return 1;
+}
+
+static int check_png_file_header(struct png_source_t *source)
+{
+   if (source->file == NULL && source->data == NULL)
    {
       log_error("Failed to open PNG file");
       return -1;
    }
 
    uint64_t file_header;
-   if (fread(&file_header, sizeof(file_header), 1, png_ptr) != 1)
+   if (source_read(source, &file_header, sizeof(file_header)) != 1)
    {
       log_error("Failed to read png header");
       return -1;
@@ -99,14 +279,20 @@ int check_png_file_header(FILE *png_ptr)
       return -1;
    }
 
-   fseek(png_ptr, 0L, SEEK_END);
-   long filesize = ftell(png_ptr); // Not POSIX compliant. stat for Linux, GetFileSize for Win.
+   if (source->file == NULL)
+   {
+      log_debug("Buffer size: %zu bytes", source->size);
+      return 0;
+   }
+
+   fseek(source->file, 0L, SEEK_END);
+   long filesize = ftell(source->file); // Not POSIX compliant. stat for Linux, GetFileSize for Win.
    if (filesize < 0)
    {
       log_error("Error determining file size");
       return -1;
    }
-   fseek(png_ptr, sizeof(file_header), SEEK_SET);
+   fseek(source->file, sizeof(file_header), SEEK_SET);
 
    log_debug("File size: %ld bytes", filesize);
 
@@ -206,37 +392,1882 @@ int check_png_header(uint32_t header_length, struct png_header_t *new_header, ui
    return 0;
 }
 
-int load_png(const char *filename, struct image_t *output)
+static int read_png_header(struct png_source_t *source, struct png_header_t *png_header)
 {
-   output->mode = INVALID;
+   uint32_t chunk_data_size;
+   if (source_read(source, &chunk_data_size, sizeof(chunk_data_size)) != 1 || source_read(source, png_header, sizeof(*png_header)) != 1)
+   {
+      log_error("Failed to read png header");
+      return -1;
+   }
+
+   uint32_t crc_check;
+   if (check_png_header(chunk_data_size, png_header, &crc_check) < 0)
+   {
+      log_error("Check failed for png header");
+      return -1;
+   }
+
+   return 0;
+}
+
+// Carries the unread tail of one IDAT chunk over to the next, the zlib stream may be split at any byte
+struct idat_stream_t
+{
+   struct stream_ptr_t bitstream;
+   uint8_t carry[PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE];
+   size_t carry_size;
+};
+
+// chunk_buffer holds a whole chunk as read from file, the length and name fields are overwritten with the carried bytes
+static int inflate_idat(struct idat_stream_t *idat, struct zlib_t *zlib, uint8_t *chunk_buffer, uint32_t chunk_data_size, struct data_buffer_t *output, zlib_callback cb, void *output_settings)
+{
+   uint8_t *chunk_data = chunk_buffer + PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE;
+   memcpy(chunk_buffer, idat->carry, sizeof(idat->carry));
+   memcpy(idat->carry, chunk_data + chunk_data_size - sizeof(idat->carry), sizeof(idat->carry));
+
+   idat->bitstream.data = chunk_data - idat->carry_size;
+   idat->bitstream.size = chunk_data_size + idat->carry_size;
+   idat->bitstream.byte_index = 0;
+
+   int zlib_status = decompress_zlib(zlib, &idat->bitstream, output, cb, output_settings);
+
+   idat->carry_size = idat->bitstream.size - idat->bitstream.byte_index;
+   return zlib_status;
+}
+
+struct crc_slice_t
+{
+   const uint8_t *data;
+   size_t size;
+   uint32_t crc;
+};
+
+// CRC of a chunk checked by pool workers while the calling thread inflates it
+struct chunk_crc_t
+{
+   struct task_group_t group;
+   struct crc_slice_t slices[PNG_CRC_SLICE_MAX];
+   uint32_t slice_count;
+   uint32_t name_crc;
+   uint32_t chunk_crc;
+};
+
+static void crc_slice_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct crc_slice_t *slice = (struct crc_slice_t *)arg;
+   slice->crc = compute_crc(slice->data, (int)slice->size);
+}
+
+// Only the chunk data is read by the workers, inflate_idat overwrites the length and name fields
+static void start_chunk_crc(struct thread_pool_t *pool, struct chunk_crc_t *check, const uint8_t *chunk_buffer, uint32_t chunk_data_size)
+{
+   const uint8_t *chunk_data = chunk_buffer + PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE;
+   check->name_crc = compute_crc(chunk_buffer + PNG_CHUNK_LENGTH_SIZE, PNG_CHUNK_TYPE_SIZE);
+   check->chunk_crc = order_png32_t(*(const uint32_t *)(chunk_data + chunk_data_size));
+
+   uint32_t slice_count = chunk_data_size / PNG_CRC_SLICE_MIN;
+   slice_count = slice_count < thread_pool_size(pool) ? slice_count : thread_pool_size(pool);
+   slice_count = slice_count < PNG_CRC_SLICE_MAX ? slice_count : PNG_CRC_SLICE_MAX;
+   check->slice_count = slice_count;
+
+   task_group_init(&check->group);
+   const size_t slice_size = chunk_data_size / slice_count;
+   for (uint32_t i = 0; i < slice_count; ++i)
+   {
+      struct crc_slice_t *slice = &check->slices[i];
+      slice->data = chunk_data + i * slice_size;
+      slice->size = i == slice_count - 1 ? chunk_data_size - i * slice_size : slice_size;
+      if (thread_pool_spawn(pool, &check->group, crc_slice_task, slice) != 0)
+      {
+         crc_slice_task(slice, 0);
+      }
+   }
+}
+
+static int finish_chunk_crc(struct thread_pool_t *pool, struct chunk_crc_t *check)
+{
+   thread_pool_wait(pool, &check->group);
+   uint32_t crc = check->name_crc;
+   for (uint32_t i = 0; i < check->slice_count; ++i)
+   {
+      crc = crc_combine(crc, check->slices[i].crc, check->slices[i].size);
+   }
+   if (crc != check->chunk_crc)
+   {
+      log_error("CRC check failed for IDAT chunk");
+      return -1;
+   }
+   return 0;
+}
+
+static int add_chunk_info(struct png_info_t *info, uint32_t *capacity, uint32_t name, uint32_t length, long offset)
+{
+   if (info->chunk_count == *capacity)
+   {
+      uint32_t new_capacity = *capacity ? *capacity << 1 : PNG_PROBE_CHUNK_LIST_SIZE;
+      struct png_chunk_info_t *chunks = realloc(info->chunks, new_capacity * sizeof(*chunks));
+      if (chunks == NULL)
+      {
+         log_error("Failed to allocate chunk list");
+         return -1;
+      }
+      info->chunks = chunks;
+      *capacity = new_capacity;
+   }
+
+   info->chunks[info->chunk_count].name = name;
+   info->chunks[info->chunk_count].length = length;
+   info->chunks[info->chunk_count].offset = offset;
+   ++info->chunk_count;
+   return 0;
+}
+
+// Streams the chunk payload through the CRC in fixed size blocks so no chunk is ever buffered whole
+static int check_chunk_crc(FILE *png_ptr, uint32_t chunk_name, uint32_t chunk_data_size)
+{
+   uint8_t block[PNG_PROBE_BLOCK_SIZE];
+   uint32_t crc = update_crc(CRC32_INITIAL, (uint8_t *)&chunk_name, PNG_CHUNK_TYPE_SIZE);
+   while (chunk_data_size > 0)
+   {
+      uint32_t block_size = chunk_data_size < PNG_PROBE_BLOCK_SIZE ? chunk_data_size : PNG_PROBE_BLOCK_SIZE;
+      if (fread(block, block_size, 1, png_ptr) != 1)
+      {
+         log_error("Unexpected end of file in %c%c%c%c chunk", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+         return -1;
+      }
+      crc = update_crc(crc, block, block_size);
+      chunk_data_size -= block_size;
+   }
+
+   uint32_t chunk_crc;
+   if (fread(&chunk_crc, sizeof(chunk_crc), 1, png_ptr) != 1)
+   {
+      log_error("Missing CRC for %c%c%c%c chunk", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+      return -1;
+   }
+   if ((uint32_t)(crc ^ CRC32_INITIAL) != order_png32_t(chunk_crc))
+   {
+      log_error("CRC check failed for %c%c%c%c chunk", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+      return -1;
+   }
+   return 0;
+}
+
+int png_probe(const char *filename, struct png_info_t *info, uint8_t flags)
+{
+   memset(info, 0, sizeof(*info));
 
    FILE *png_ptr = fopen(filename, "rb");
-   if (check_png_file_header(png_ptr) != 0)
+   struct png_source_t source = {.file = png_ptr};
+   if (check_png_file_header(&source) != 0)
    {
-      fclose(png_ptr);
+      if (png_ptr != NULL)
+      {
+         fclose(png_ptr);
+      }
       return -1;
    }
 
    struct png_header_t png_header;
-   uint32_t chunk_data_size;
-   fread(&chunk_data_size, sizeof(chunk_data_size), 1, png_ptr);
-   fread(&png_header, sizeof(png_header), 1, png_ptr);
-
-   uint32_t crc_check;
-   if (check_png_header(chunk_data_size, &png_header, &crc_check) < 0)
+   if (read_png_header(&source, &png_header) != 0)
    {
-      log_error("Check failed for png header");
       fclose(png_ptr);
       return -1;
    }
 
+   info->width = png_header.width;
+   info->height = png_header.height;
+   info->bit_depth = png_header.bit_depth;
+   info->colour_type = png_header.colour_type;
+   info->interlace_method = png_header.interlace_method;
+
+   uint32_t capacity = 0;
+   int status = add_chunk_info(info, &capacity, PNG_IHDR, sizeof(png_header) - sizeof(png_header.name) - sizeof(png_header.crc), sizeof(uint64_t));
+
+   uint32_t chunk_header[2];
+   while (status == 0)
+   {
+      long offset = ftell(png_ptr);
+      if (fread(chunk_header, sizeof(chunk_header), 1, png_ptr) != 1)
+      {
+         log_error("Missing IEND chunk");
+         status = -1;
+         break;
+      }
+
+      uint32_t chunk_data_size = order_png32_t(chunk_header[0]);
+      uint32_t chunk_name = chunk_header[1];
+      if (chunk_data_size > PNG_CHUNK_LENGTH_MAX)
+      {
+         log_error("Invalid chunk length");
+         status = -1;
+         break;
+      }
+
+      status = add_chunk_info(info, &capacity, chunk_name, chunk_data_size, offset);
+      if (status != 0)
+      {
+         break;
+      }
+
+      if (chunk_name == PNG_IDAT)
+      {
+         info->idat_size += chunk_data_size;
+         if (flags & PNG_PROBE_SKIP_IDAT_CRC)
+         {
+            if (fseek(png_ptr, chunk_data_size + PNG_CHUNK_CRC_SIZE, SEEK_CUR) != 0)
+            {
+               log_error("Failed to seek over IDAT chunk");
+               status = -1;
+            }
+            continue;
+         }
+      }
+
+      status = check_chunk_crc(png_ptr, chunk_name, chunk_data_size);
+      if (chunk_name == PNG_IEND)
+      {
+         break;
+      }
+   }
+
+   fclose(png_ptr);
+
+   if (status != 0)
+   {
+      close_probe(info);
+   }
+   return status;
+}
+
+void close_probe(struct png_info_t *info)
+{
+   free(info->chunks);
+   info->chunks = NULL;
+   info->chunk_count = 0;
+}
+
+static int check_chunk_order(const struct png_info_t *info)
+{
+   int64_t plte_index = -1;
+   int64_t idat_index = -1;
+   for (uint32_t i = 1; i < info->chunk_count; ++i)
+   {
+      uint32_t chunk_name = info->chunks[i].name;
+      switch (chunk_name)
+      {
+      case PNG_IHDR:
+         log_error("Multiple header chunks");
+         return -1;
+      case PNG_PLTE:
+         if (plte_index >= 0)
+         {
+            log_error("Critical chunk PLTE already defined");
+            return -1;
+         }
+         if (idat_index >= 0)
+         {
+            log_error("Critical chunk PLTE out of order");
+            return -1;
+         }
+         if (info->colour_type == Greyscale || info->colour_type == GreyscaleAlpha)
+         {
+            log_error("Palette incompatible with specified colour type");
+            return -1;
+         }
+         if (info->chunks[i].length == 0 || info->chunks[i].length % 3 != 0 || info->chunks[i].length > 768)
+         {
+            log_error("Incorrect palette size");
+            return -1;
+         }
+         plte_index = i;
+         break;
+      case PNG_IDAT:
+         if (idat_index >= 0 && idat_index != i - 1)
+         {
+            log_error("Non-consecutive IDAT chunk");
+            return -1;
+         }
+         idat_index = i;
+         break;
+      case PNG_IEND:
+         if (info->chunks[i].length != 0)
+         {
+            log_error("Invalid IEND chunk");
+            return -1;
+         }
+         break;
+      case PNG_cHRM:
+      case PNG_gAMA:
+      case PNG_iCCP:
+      case PNG_sBIT:
+      case PNG_sRGB:
+      case PNG_cICP:
+         if (plte_index >= 0 || idat_index >= 0)
+         {
+            log_error("%c%c%c%c chunk found at incorrect position", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+            return -1;
+         }
+         break;
+      case PNG_tRNS:
+      case PNG_bKGD:
+      case PNG_hIST:
+         if ((info->colour_type == Indexed_colour || chunk_name == PNG_hIST) && plte_index < 0)
+         {
+            log_error("%c%c%c%c chunk found before PLTE", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+            return -1;
+         }
+         // fall through
+      case PNG_pHYs:
+      case PNG_sPLT:
+      case PNG_eXIf:
+      case PNG_acTL:
+         if (idat_index >= 0)
+         {
+            log_error("%c%c%c%c chunk found after IDAT", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+            return -1;
+         }
+         break;
+      default:
+         // Bit 5 of the first name byte is clear for critical chunks
+         if ((chunk_name & 0x20) == 0)
+         {
+            log_error("Unrecognised critical chunk %c%c%c%c", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+            return -1;
+         }
+         break;
+      }
+   }
+
+   if (idat_index < 0)
+   {
+      log_error("Missing IDAT chunk");
+      return -1;
+   }
+   if (info->colour_type == Indexed_colour && plte_index < 0)
+   {
+      log_error("No PLTE chunk present for Indexed colour type");
+      return -1;
+   }
+   return 0;
+}
+
+static void discard_output(uint8_t byte, struct data_buffer_t *output, void *output_settings)
+{
+   (void)byte;
+   (void)output_settings;
+   ++output->index;
+}
+
+// Grows a decoder owned buffer, existing contents are not preserved
+static uint8_t *reserve_buffer(struct png_decoder_t *decoder, uint8_t **buffer, size_t *capacity, size_t size)
+{
+   if (size > *capacity)
+   {
+      decoder->allocator.free(*buffer, decoder->allocator.user);
+      *buffer = decoder->allocator.alloc(size, decoder->allocator.user);
+      *capacity = (*buffer == NULL) ? 0 : size;
+   }
+   return *buffer;
+}
+
+// Reads each IDAT chunk once, checking its CRC before passing it to the inflate stage
+// The working buffers are borrowed from decoder
+static int validate_image_data(struct png_decoder_t *decoder, const char *filename, const struct png_info_t *info, enum png_validation_tier_t tier)
+{
+   FILE *png_ptr = fopen(filename, "rb");
+   if (png_ptr == NULL)
+   {
+      log_error("Failed to open PNG file");
+      return -1;
+   }
+
+   struct png_header_t png_header = {
+       .width = info->width,
+       .height = info->height,
+       .bit_depth = info->bit_depth,
+       .colour_type = info->colour_type,
+       .interlace_method = info->interlace_method};
+
    const uint8_t bytes_per_pixel[7] = {1, 0, 3, 1, 2, 0, 4};
    const uint32_t bits_per_pixel = png_header.bit_depth * bytes_per_pixel[png_header.colour_type];
    const uint8_t scanline_stride = (bits_per_pixel + 0x07) >> 3;
-   const uint32_t scanline_pixel_byte_count = (png_header.width * bits_per_pixel + 0x07) >> 3;
-   const uint32_t scanline_buffer_size = (scanline_stride + scanline_pixel_byte_count);
-   const uint8_t palette_scale = (png_header.colour_type == Indexed_colour) ? 3 : 1;
-   uint8_t *scanline_buffers = calloc(scanline_buffer_size * 2, sizeof(uint8_t));
+   const uint32_t scanline_buffer_size = scanline_stride + ((png_header.width * bits_per_pixel + 0x07) >> 3);
+
+   zlib_callback callback = discard_output;
+   struct output_settings_t output_settings = {.filter_error = FILTER_ERROR_NONE};
+   if (tier >= PNG_VALIDATE_UNFILTER)
+   {
+      uint8_t *scanline_buffers = reserve_buffer(decoder, &decoder->scanline_buffers, &decoder->scanline_buffers_size, scanline_buffer_size * 2);
+      if (scanline_buffers == NULL)
+      {
+         log_error("Failed to allocate scanline buffers");
+         fclose(png_ptr);
+         return -1;
+      }
+      memset(scanline_buffers, 0, scanline_buffer_size * 2);
+      output_settings.scanline.stride = scanline_stride;
+      output_settings.scanline.buffer = scanline_buffers;
+      output_settings.scanline.buffer_size = scanline_buffer_size * 2;
+      output_settings.scanline.new = scanline_buffers + scanline_stride;
+      output_settings.scanline.last = scanline_buffers + scanline_stride + scanline_buffer_size;
+      set_interlacing(&png_header, bits_per_pixel, output_settings.subimage.images);
+      callback = validate_filter;
+   }
+
+   struct zlib_t zlib_idat = {
+       .state = READING_ZLIB_HEADER,
+       .LZ77_buffer.data = decoder->lz77_window,
+       .bytes_read = 0};
+   adler32_init(&zlib_idat.adler32);
+
+   struct idat_stream_t idat = {.bitstream.bit_index = 0, .carry_size = 0};
+   struct data_buffer_t sink = {.data = NULL, .index = 0};
+   int zlib_status = ZLIB_INCOMPLETE;
+   int status = 0;
+
+   for (uint32_t i = 0; i < info->chunk_count && status == 0; ++i)
+   {
+      if (info->chunks[i].name != PNG_IDAT)
+      {
+         continue;
+      }
+
+      uint32_t chunk_data_size = info->chunks[i].length;
+      size_t chunk_size = PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE;
+      uint8_t *chunk_buffer = reserve_buffer(decoder, &decoder->chunk_buffer, &decoder->chunk_buffer_size, chunk_size);
+      if (chunk_buffer == NULL)
+      {
+         log_error("Failed to allocate chunk buffer");
+         status = -1;
+         break;
+      }
+
+      if (fseek(png_ptr, info->chunks[i].offset, SEEK_SET) != 0 || fread(chunk_buffer, chunk_size, 1, png_ptr) != 1)
+      {
+         log_error("Failed to read IDAT chunk");
+         status = -1;
+         break;
+      }
+
+      uint8_t *chunk_data = chunk_buffer + PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE;
+      if (compute_crc(chunk_buffer + PNG_CHUNK_LENGTH_SIZE, chunk_data_size + PNG_CHUNK_TYPE_SIZE) != order_png32_t(*(uint32_t *)(chunk_data + chunk_data_size)))
+      {
+         log_error("CRC check failed for IDAT chunk");
+         status = -1;
+         break;
+      }
+
+      if (tier < PNG_VALIDATE_INFLATE)
+      {
+         continue;
+      }
+      if (zlib_status == ZLIB_COMPLETE)
+      {
+         log_warning("Extra data after end of zlib stream");
+         continue;
+      }
+
+      zlib_status = inflate_idat(&idat, &zlib_idat, chunk_buffer, chunk_data_size, &sink, callback, (void *)&output_settings);
+      if (zlib_status != ZLIB_COMPLETE && zlib_status != ZLIB_INCOMPLETE && zlib_status != ZLIB_ADLER32_CHECKSUM_MISSING)
+      {
+         status = -1;
+      }
+   }
+
+   if (status == 0 && zlib_status != ZLIB_COMPLETE)
+   {
+      log_error("Incomplete zlib stream");
+      status = -1;
+   }
+
+   if (status == 0 && tier >= PNG_VALIDATE_UNFILTER)
+   {
+      if (output_settings.filter_error == FILTER_ERROR_INVALID_TYPE)
+      {
+         log_error("Invalid filter type");
+         status = -1;
+      }
+      else if (output_settings.filter_error == FILTER_ERROR_EXCESS_DATA || !filter_complete(&output_settings))
+      {
+         log_error("Image data size mismatch, inflated %zu bytes", sink.index);
+         status = -1;
+      }
+   }
+
+   fclose(png_ptr);
+   return status;
+}
+
+int png_validate(const char *filename, enum png_validation_tier_t tier)
+{
+   // IDAT CRCs are checked as the image data is read when inflating
+   struct png_info_t info;
+   if (png_probe(filename, &info, tier >= PNG_VALIDATE_INFLATE ? PNG_PROBE_SKIP_IDAT_CRC : PNG_PROBE_DEFAULT) != 0)
+   {
+      return -1;
+   }
+
+   int status = check_chunk_order(&info);
+   if (status == 0 && tier >= PNG_VALIDATE_INFLATE)
+   {
+      struct png_decoder_t *decoder = png_decoder_create(NULL);
+      status = decoder != NULL ? validate_image_data(decoder, filename, &info, tier) : -1;
+      png_decoder_destroy(decoder);
+   }
+
+   close_probe(&info);
+   return status;
+}
+
+static void *default_alloc(size_t size, void *user)
+{
+   (void)user;
+   return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *user)
+{
+   (void)user;
+   return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *user)
+{
+   (void)user;
+   free(ptr);
+}
+
+static const struct png_allocator_t default_allocator = {
+    .alloc = default_alloc,
+    .realloc = default_realloc,
+    .free = default_free,
+    .user = NULL};
+
+struct png_decoder_t *png_decoder_create(const struct png_allocator_t *allocator)
+{
+   if (allocator == NULL)
+   {
+      allocator = &default_allocator;
+   }
+
+   struct png_decoder_t *decoder = allocator->alloc(sizeof(*decoder), allocator->user);
+   if (decoder == NULL)
+   {
+      log_error("Failed to allocate decoder");
+      return NULL;
+   }
+   memset(decoder, 0, sizeof(*decoder));
+   decoder->allocator = *allocator;
+   return decoder;
+}
+
+static void free_decoder(struct png_decoder_t *decoder)
+{
+   const struct png_allocator_t allocator = decoder->allocator;
+   allocator.free(decoder->gamma.table_16, allocator.user);
+   allocator.free(decoder->icc.tables_16, allocator.user);
+   allocator.free(decoder->profile, allocator.user);
+   allocator.free(decoder->staged, allocator.user);
+   allocator.free(decoder->compressed, allocator.user);
+   allocator.free(decoder->task_scanlines, allocator.user);
+   allocator.free(decoder->filtered, allocator.user);
+   allocator.free(decoder->ring, allocator.user);
+   allocator.free(decoder->pipeline_bands, allocator.user);
+   allocator.free(decoder->row_bands, allocator.user);
+   allocator.free(decoder->output, allocator.user);
+   allocator.free(decoder->chunk_buffer, allocator.user);
+   allocator.free(decoder->scanline_buffers, allocator.user);
+   allocator.free(decoder, allocator.user);
+}
+
+void png_decoder_destroy(struct png_decoder_t *decoder)
+{
+   if (decoder == NULL)
+   {
+      return;
+   }
+   if (decoder->owns_pool)
+   {
+      thread_pool_destroy(decoder->pool);
+      decoder->pool = NULL;
+      decoder->owns_pool = 0;
+   }
+   if (decoder->open_images != 0)
+   {
+      log_debug("Decoder destroyed before %u of its images were closed, freed with the last of them", decoder->open_images);
+      decoder->destroyed = true;
+      return;
+   }
+   free_decoder(decoder);
+}
+
+int png_decoder_set_options(struct png_decoder_t *decoder, const struct png_decoder_options_t *options)
+{
+   if ((unsigned)options->format > PNG_FORMAT_CHANNEL8)
+   {
+      log_error("Invalid output format %u", (unsigned)options->format);
+      return -1;
+   }
+   if ((unsigned)options->yuv_matrix > PNG_YUV_BT709)
+   {
+      log_error("Invalid YUV matrix %u", (unsigned)options->yuv_matrix);
+      return -1;
+   }
+   if (options->channel > 3)
+   {
+      log_error("Invalid output channel %u", options->channel);
+      return -1;
+   }
+   if (decoder->owns_pool)
+   {
+      thread_pool_destroy(decoder->pool);
+      decoder->pool = NULL;
+      decoder->owns_pool = 0;
+   }
+
+   decoder->flags = options->flags;
+   decoder->split_threshold = options->split_threshold ? options->split_threshold : PNG_SPLIT_THRESHOLD;
+   memcpy(decoder->background, options->background, sizeof(decoder->background));
+   decoder->format = options->format;
+   memcpy(decoder->scale, options->scale, sizeof(decoder->scale));
+   memcpy(decoder->bias, options->bias, sizeof(decoder->bias));
+   decoder->yuv_matrix = options->yuv_matrix;
+   decoder->channel = options->channel;
+   if (options->flags & PNG_DECODE_THREADED)
+   {
+      decoder->pool = thread_pool_create(options->thread_count);
+      if (decoder->pool == NULL)
+      {
+         decoder->flags = PNG_DECODE_DEFAULT;
+         return -1;
+      }
+      decoder->owns_pool = 1;
+   }
+   return 0;
+}
+
+// 8-bit images share the process wide tables, 16-bit images and a full cache use the decoder's own table
+static const struct gamma_table_t *find_gamma_table(struct png_decoder_t *decoder, uint32_t gamma, uint8_t bit_depth)
+{
+   if (bit_depth != 16)
+   {
+      const struct gamma_table_t *table = gamma_table_find(gamma);
+      if (table != NULL)
+      {
+         return table;
+      }
+   }
+   else if (decoder->gamma.table_16 == NULL)
+   {
+      decoder->gamma.table_16 = decoder->allocator.alloc(65536 * sizeof(uint16_t), decoder->allocator.user);
+      if (decoder->gamma.table_16 == NULL)
+      {
+         return NULL;
+      }
+   }
+   // Only rebuilt when the gamma changes, or the first time a 16-bit image needs table_16
+   if (decoder->gamma.gamma != gamma || (bit_depth == 16 && decoder->gamma_16 != gamma))
+   {
+      gamma_table_build(&decoder->gamma, gamma, bit_depth);
+      decoder->gamma_16 = bit_depth == 16 ? gamma : 0;
+   }
+   return &decoder->gamma;
+}
+
+// Returns -1 when the profile cannot be used, NULL transforms are an allocation failure
+// 16-bit images copy the shared transform next to the decoder's own tables
+static int find_icc_transform(struct png_decoder_t *decoder, size_t size, uint8_t bit_depth, const struct icc_transform_t **transform)
+{
+   if (icc_transform_find(decoder->profile, size, &decoder->icc, transform) != 0 || bit_depth != 16)
+   {
+      return *transform == NULL ? -1 : 0;
+   }
+   const struct icc_transform_t *found = *transform;
+   *transform = NULL;
+   if (decoder->icc.tables_16 == NULL)
+   {
+      decoder->icc.tables_16 = decoder->allocator.alloc(ICC_TABLES_16_SIZE, decoder->allocator.user);
+      if (decoder->icc.tables_16 == NULL)
+      {
+         return 0;
+      }
+   }
+   if (found != &decoder->icc)
+   {
+      uint16_t *tables_16 = decoder->icc.tables_16;
+      decoder->icc = *found;
+      decoder->icc.tables_16 = tables_16;
+   }
+   // Only rebuilt when the profile changes
+   if (memcmp(decoder->icc_16, decoder->icc.key, sizeof(decoder->icc_16)) != 0)
+   {
+      if (icc_tables_16_build(&decoder->icc, decoder->profile, size) != 0)
+      {
+         return -1;
+      }
+      memcpy(decoder->icc_16, decoder->icc.key, sizeof(decoder->icc_16));
+   }
+   *transform = &decoder->icc;
+   return 0;
+}
+
+// Inflated iCCP bytes, grown with the decoder's allocator
+struct profile_sink_t
+{
+   struct png_decoder_t *decoder;
+   size_t size;
+   bool overflow;
+};
+
+static void collect_profile(uint8_t byte, struct data_buffer_t *output, void *output_settings)
+{
+   (void)output;
+   struct profile_sink_t *sink = (struct profile_sink_t *)output_settings;
+   struct png_decoder_t *decoder = sink->decoder;
+   if (sink->size == decoder->profile_size)
+   {
+      const size_t capacity = decoder->profile_size != 0 ? decoder->profile_size * 2 : PNG_PROFILE_BLOCK_SIZE;
+      uint8_t *profile = (sink->overflow || capacity > ICC_PROFILE_MAX) ? NULL : decoder->allocator.realloc(decoder->profile, capacity, decoder->allocator.user);
+      if (profile == NULL)
+      {
+         sink->overflow = true;
+         return;
+      }
+      decoder->profile = profile;
+      decoder->profile_size = capacity;
+   }
+   decoder->profile[sink->size++] = byte;
+}
+
+// Name, compression method and a zlib stream, profiles that cannot be used are ignored with a warning
+static int read_icc_profile(struct png_decoder_t *decoder, const uint8_t *data, uint32_t size, uint8_t bit_depth, uint8_t channels, const struct icc_transform_t **transform)
+{
+   const uint8_t *name_end = memchr(data, 0, size < PNG_KEYWORD_MAX + 1 ? size : PNG_KEYWORD_MAX + 1);
+   if (name_end == NULL || name_end == data || (uint32_t)(name_end - data) + 2 > size || name_end[1] != 0)
+   {
+      log_error("Invalid iCCP chunk");
+      return -1;
+   }
+
+   struct zlib_t zlib = {
+       .state = READING_ZLIB_HEADER,
+       .LZ77_buffer.data = decoder->lz77_window,
+       .bytes_read = 0};
+   adler32_init(&zlib.adler32);
+   const uint32_t offset = (uint32_t)(name_end - data) + 2;
+   struct stream_ptr_t bitstream = {.data = data + offset, .size = size - offset, .byte_index = 0, .bit_index = 0};
+   struct data_buffer_t unused = {.data = NULL, .index = 0};
+   struct profile_sink_t sink = {.decoder = decoder, .size = 0, .overflow = false};
+   if (decompress_zlib(&zlib, &bitstream, &unused, collect_profile, &sink) != ZLIB_COMPLETE || sink.overflow)
+   {
+      log_warning("Failed to inflate ICC profile %s", (const char *)data);
+      return -1;
+   }
+
+   if (find_icc_transform(decoder, sink.size, bit_depth, transform) != 0)
+   {
+      log_warning("ICC profile %s has no matrix/TRC form, ignoring it", (const char *)data);
+      return -1;
+   }
+   if (*transform == NULL)
+   {
+      log_error("Failed to allocate ICC transform");
+      return -1;
+   }
+   if ((*transform)->channels != channels)
+   {
+      log_warning("ICC profile %s does not match the colour type, ignoring it", (const char *)data);
+      return -1;
+   }
+   log_debug("ICC profile %s, %zu bytes", (const char *)data, sink.size);
+   return 0;
+}
+
+// Hands the spare output buffer to the caller, the decoder no longer owns it
+static uint8_t *acquire_output(struct png_decoder_t *decoder, size_t size)
+{
+   if (reserve_buffer(decoder, &decoder->output, &decoder->output_size, size) == NULL)
+   {
+      log_error("Failed to allocate output image");
+      return NULL;
+   }
+   uint8_t *data = decoder->output;
+   decoder->output = NULL;
+   decoder->output_size = 0;
+   return data;
+}
+
+static void release_output(struct png_decoder_t *decoder, struct image_t *image)
+{
+   // Keep the larger of the two buffers for the next decode
+   if (image->size > decoder->output_size && !decoder->destroyed)
+   {
+      decoder->allocator.free(decoder->output, decoder->allocator.user);
+      decoder->output = image->data;
+      decoder->output_size = image->size;
+   }
+   else
+   {
+      decoder->allocator.free(image->data, decoder->allocator.user);
+   }
+   image->data = NULL;
+   image->decoder = NULL;
+   if (--decoder->open_images == 0 && decoder->destroyed)
+   {
+      free_decoder(decoder);
+   }
+}
+
+// Data is freed with allocator by close_png instead of going back to the decoder
+static void detach_output(struct image_t *image, const struct png_allocator_t *allocator)
+{
+   struct png_decoder_t *decoder = image->decoder;
+   image->decoder = NULL;
+   image->allocator = allocator;
+   if (decoder != NULL && --decoder->open_images == 0 && decoder->destroyed)
+   {
+      free_decoder(decoder);
+   }
+}
+
+// Output of a failed decode goes back to the decoder, or to the caller when it came from their buffer
+static void drop_output(struct png_decoder_t *decoder, struct image_t *output)
+{
+   if (output->data == NULL)
+   {
+      return;
+   }
+   if (output->external)
+   {
+      output->data = NULL;
+   }
+   else
+   {
+      release_output(decoder, output);
+   }
+   output->mode = INVALID;
+}
+
+int load_png(const char *filename, struct image_t *output)
+{
+   return load_png_with_allocator(filename, output, NULL);
+}
+
+int load_png_with_allocator(const char *filename, struct image_t *output, const struct png_allocator_t *allocator)
+{
+   struct png_decoder_t *decoder = png_decoder_create(allocator);
+   if (decoder == NULL)
+   {
+      output->data = NULL;
+      output->decoder = NULL;
+      output->allocator = NULL;
+      output->external = 0;
+      output->mode = INVALID;
+      return -1;
+   }
+
+   int status = png_decoder_load(decoder, filename, output);
+
+   // Output is detached from the temporary decoder and freed directly by close_png
+   detach_output(output, allocator);
+   png_decoder_destroy(decoder);
+   return status;
+}
+
+static int decode_png(struct png_decoder_t *decoder, struct png_source_t *source, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output);
+
+// Samples of one row of the final image, alpha is linear and left as it is
+static void correct_colour_row(const struct colour_transforms_t *ct, uint8_t *row, uint32_t width, enum pixel_format_t mode, uint8_t bit_depth)
+{
+   if (ct->active & CHRM_ICC)
+   {
+      icc_transform_row(ct->icc, row, width, (uint8_t)mode, bit_depth);
+      return;
+   }
+   // Gamma is fused into the chroma pass
+   if (ct->active & CHRM_CHROMA)
+   {
+      chroma_correct_row(&ct->chroma, (ct->active & CHRM_GAMMA) ? ct->gamma : NULL, row, width, (uint8_t)mode, bit_depth);
+      return;
+   }
+
+   const uint32_t stride = mode * (bit_depth >> 3);
+   const uint32_t channels = (mode == GA || mode == RGBA) ? mode - 1 : mode;
+   if (bit_depth == 16)
+   {
+      const uint16_t *table = ct->gamma->table_16;
+      for (uint32_t i = 0; i < width * stride; i += stride)
+      {
+         for (uint32_t c = 0; c < channels * 2; c += 2)
+         {
+            uint16_t sample = table[(row[i + c] << 8) | row[i + c + 1]];
+            row[i + c] = (uint8_t)(sample >> 8);
+            row[i + c + 1] = (uint8_t)sample;
+         }
+      }
+   }
+   else if (channels == (uint32_t)mode)
+   {
+      const uint8_t *table = ct->gamma->table_8;
+      for (uint32_t i = 0; i < width * stride; ++i)
+      {
+         row[i] = table[row[i]];
+      }
+   }
+   else
+   {
+      const uint8_t *table = ct->gamma->table_8;
+      for (uint32_t i = 0; i < width * stride; i += stride)
+      {
+         for (uint32_t c = 0; c < channels; ++c)
+         {
+            row[i + c] = table[row[i + c]];
+         }
+      }
+   }
+}
+
+// Rows [first_row, end_row) only, so bands of one image can be corrected in parallel
+static void apply_colour_transforms(const struct colour_transforms_t *ct, const struct image_t *image, uint32_t first_row, uint32_t end_row)
+{
+   for (uint32_t y = first_row; y < end_row; ++y)
+   {
+      correct_colour_row(ct, image->data + (size_t)y * image->stride, image->width, image->mode, image->bit_depth);
+   }
+}
+
+// Called by filter() as each row of a non-interlaced image is completed, before it leaves the cache
+static void correct_completed_row(const void *arg, const struct output_settings_t *settings, uint8_t *row)
+{
+   const uint8_t sample_size = settings->pixel.bit_depth == 16 ? 2 : 1;
+   correct_colour_row((const struct colour_transforms_t *)arg, row, settings->image_width, (enum pixel_format_t)(settings->pixel.size / sample_size), sample_size * 8);
+}
+
+// Post-processes rows [first_row, end_row) of an image in place
+typedef void (*row_band_fn)(const void *arg, const struct image_t *image, uint32_t first_row, uint32_t end_row);
+
+struct row_band_t
+{
+   row_band_fn run;
+   const void *arg;
+   const struct image_t *image;
+   uint32_t first_row;
+   uint32_t end_row;
+};
+
+static void row_band_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   const struct row_band_t *band = (const struct row_band_t *)arg;
+   band->run(band->arg, band->image, band->first_row, band->end_row);
+}
+
+static void correct_colour_rows(const void *arg, const struct image_t *image, uint32_t first_row, uint32_t end_row)
+{
+   apply_colour_transforms((const struct colour_transforms_t *)arg, image, first_row, end_row);
+}
+
+static uint8_t *stage_target_row(const struct output_stage_t *stage, uint32_t y)
+{
+   const struct image_t *target = stage->target;
+   return target->data + (size_t)(stage->bottom_up ? target->height - 1 - y : y) * target->stride;
+}
+
+// Subsampled YUV rows are converted in pairs, once the second row, or the last of an odd height, is staged
+static void stage_yuv_row(const struct output_stage_t *stage, const uint8_t *row, const uint8_t *previous, uint32_t y, enum pixel_format_t mode)
+{
+   const struct image_t *target = stage->target;
+   const bool subsampled = stage->settings.format != PNG_FORMAT_I444;
+   if (subsampled && (y & 1) == 0 && y + 1 < target->height)
+   {
+      return;
+   }
+
+   const uint32_t chroma_height = subsampled ? (target->height + 1) / 2 : target->height;
+   const uint32_t chroma_y = subsampled ? y / 2 : y;
+   uint8_t *chroma = target->data + target->plane_size + (size_t)(stage->bottom_up ? chroma_height - 1 - chroma_y : chroma_y) * target->chroma_stride;
+   if (subsampled && (y & 1) == 1)
+   {
+      format_yuv_rows(previous, row, stage_target_row(stage, y - 1), stage_target_row(stage, y), chroma, target->width, mode, stage->bit_depth, &stage->settings);
+   }
+   else
+   {
+      format_yuv_rows(row, NULL, stage_target_row(stage, y), NULL, chroma, target->width, mode, stage->bit_depth, &stage->settings);
+   }
+}
+
+// Row belongs to the decoder, so it is flattened and corrected in place when it still has to be converted
+// previous is the staged row before it, only read by subsampled YUV formats
+static void stage_output_row(const struct output_stage_t *stage, uint8_t *row, const uint8_t *previous, uint32_t y)
+{
+   const struct image_t *target = stage->target;
+   uint8_t *output = stage_target_row(stage, y);
+   uint8_t *samples = stage->convert ? row : output;
+   enum pixel_format_t mode = stage->mode;
+   if (stage->flatten)
+   {
+      mode = (enum pixel_format_t)(mode - 1);
+      flatten_row(row, samples, target->width, (uint8_t)mode, stage->bit_depth, stage->background);
+   }
+   if (stage->ct != NULL)
+   {
+      correct_colour_row(stage->ct, samples, target->width, mode, stage->bit_depth);
+   }
+   if (format_yuv(stage->settings.format))
+   {
+      stage_yuv_row(stage, samples, previous, y, mode);
+   }
+   else if (format_projection(stage->settings.format))
+   {
+      format_projection_row(samples, output, target->width, mode, stage->bit_depth, &stage->settings);
+   }
+   else if (stage->convert)
+   {
+      format_row(samples, output, target->width, mode, stage->bit_depth, &stage->settings);
+   }
+}
+
+// Called by filter() with each row of a non-interlaced image, all of them unfiltered into one row buffer
+static void stage_completed_row(const void *arg, const struct output_settings_t *settings, uint8_t *row)
+{
+   const struct output_stage_t *stage = (const struct output_stage_t *)arg;
+   const uint32_t y = settings->subimage.row_index;
+   stage_output_row(stage, row, stage->held, y);
+   if (stage->held != NULL && (y & 1) == 0)
+   {
+      memcpy(stage->held, row, stage->held_size);
+   }
+}
+
+// Image is the whole decoded image, bands of subsampled YUV take the pairs starting in them
+static void stage_rows(const void *arg, const struct image_t *image, uint32_t first_row, uint32_t end_row)
+{
+   const struct output_stage_t *stage = (const struct output_stage_t *)arg;
+   if (format_yuv(stage->settings.format) && stage->settings.format != PNG_FORMAT_I444)
+   {
+      first_row += first_row & 1;
+      end_row = end_row + (end_row & 1) < image->height ? end_row + (end_row & 1) : image->height;
+   }
+   for (uint32_t y = first_row; y < end_row; ++y)
+   {
+      uint8_t *row = image->data + (size_t)y * image->stride;
+      stage_output_row(stage, row, y > 0 ? row - image->stride : NULL, y);
+   }
+}
+
+static uint32_t band_height(const struct thread_pool_t *pool, uint32_t height)
+{
+   uint32_t band_count = thread_pool_size(pool) * PNG_BANDS_PER_WORKER;
+   uint32_t band_rows = (height + band_count - 1) / band_count;
+   return band_rows < PNG_BAND_ROWS_MIN ? PNG_BAND_ROWS_MIN : band_rows;
+}
+
+// Images at or above the decoder's split threshold are post-processed in row bands on its pool
+static void run_row_bands(struct png_decoder_t *decoder, const struct image_t *image, row_band_fn run, const void *arg)
+{
+   if (decoder->pool == NULL || (uint64_t)image->width * image->height < decoder->split_threshold)
+   {
+      run(arg, image, 0, image->height);
+      return;
+   }
+
+   uint32_t band_rows = band_height(decoder->pool, image->height);
+   uint32_t band_count = (image->height + band_rows - 1) / band_rows;
+
+   struct row_band_t *bands = (struct row_band_t *)reserve_buffer(decoder, &decoder->row_bands, &decoder->row_bands_size, band_count * sizeof(*bands));
+   if (bands == NULL)
+   {
+      run(arg, image, 0, image->height);
+      return;
+   }
+
+   struct task_group_t group;
+   task_group_init(&group);
+   for (uint32_t i = 0; i < band_count; ++i)
+   {
+      bands[i].run = run;
+      bands[i].arg = arg;
+      bands[i].image = image;
+      bands[i].first_row = i * band_rows;
+      bands[i].end_row = (i + 1) * band_rows < image->height ? (i + 1) * band_rows : image->height;
+      if (thread_pool_spawn(decoder->pool, &group, row_band_task, &bands[i]) != 0)
+      {
+         row_band_task(&bands[i], 0);
+      }
+   }
+   thread_pool_wait(decoder->pool, &group);
+   log_debug("Post-processed %u rows in %u bands", image->height, band_count);
+}
+
+// Filtered bytes pass from the inflating thread to an unfilter task through a single producer, single consumer ring
+// of scanline sized slots, completed row bands of non-interlaced images are colour corrected while decoding continues
+struct png_pipeline_t
+{
+   struct thread_pool_t *pool;
+   struct task_group_t group;
+   uint8_t *slots;
+   uint32_t *slot_lengths;
+   uint32_t slot_size;
+   uint32_t fill;   // Producer only, bytes in the slot being written
+   size_t produced; // Producer only, index of the slot being written
+   atomic_size_t head; // Slots published by the producer
+   atomic_size_t tail; // Slots released by the consumer
+   atomic_bool closed;
+   atomic_bool cancelled;
+
+   struct output_settings_t *settings;
+   struct data_buffer_t *image;
+
+   const struct colour_transforms_t *ct;
+   struct row_band_t *bands; // NULL when colour correction waits for the whole image
+   struct task_group_t band_group;
+   uint64_t scanline_size;
+   uint64_t bytes_consumed;
+   uint32_t band_rows;
+   uint32_t rows_banded;
+};
+
+static inline void pipeline_backoff(uint32_t *spins)
+{
+   if (++*spins > PIPELINE_SPIN_COUNT)
+   {
+      sched_yield();
+   }
+}
+
+// Spawns a colour band for every band of rows the unfilter stage has finished
+static void pipeline_schedule_bands(struct png_pipeline_t *pipeline)
+{
+   const struct image_t *output = pipeline->bands[0].image;
+   uint64_t rows_done = pipeline->bytes_consumed / pipeline->scanline_size;
+   while (pipeline->rows_banded < output->height)
+   {
+      uint32_t end_row = pipeline->rows_banded + pipeline->band_rows < output->height ? pipeline->rows_banded + pipeline->band_rows : output->height;
+      if (rows_done < end_row)
+      {
+         break;
+      }
+      struct row_band_t *band = &pipeline->bands[pipeline->rows_banded / pipeline->band_rows];
+      // Bands are in memory order, bottom-up images fill the buffer from its last row
+      band->first_row = pipeline->settings->bottom_up ? output->height - end_row : pipeline->rows_banded;
+      band->end_row = pipeline->settings->bottom_up ? output->height - pipeline->rows_banded : end_row;
+      if (thread_pool_spawn(pipeline->pool, &pipeline->band_group, row_band_task, band) != 0)
+      {
+         row_band_task(band, 0);
+      }
+      pipeline->rows_banded = end_row;
+   }
+}
+
+static void pipeline_unfilter_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct png_pipeline_t *pipeline = (struct png_pipeline_t *)arg;
+   size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+
+   for (;;)
+   {
+      uint32_t spins = 0;
+      size_t head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+      while (head == tail && !atomic_load_explicit(&pipeline->closed, memory_order_acquire))
+      {
+         pipeline_backoff(&spins);
+         head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+      }
+      // Closing happens after the last publish, so a closed ring needs one more look for data
+      head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+      if (head == tail || atomic_load_explicit(&pipeline->cancelled, memory_order_relaxed))
+      {
+         break;
+      }
+
+      const size_t slot = tail & (PIPELINE_SLOT_COUNT - 1);
+      const uint8_t *data = pipeline->slots + slot * pipeline->slot_size;
+      const uint32_t length = pipeline->slot_lengths[slot];
+      for (uint32_t i = 0; i < length; ++i)
+      {
+         filter(data[i], pipeline->image, pipeline->settings);
+      }
+      atomic_store_explicit(&pipeline->tail, ++tail, memory_order_release);
+
+      pipeline->bytes_consumed += length;
+      if (pipeline->bands != NULL)
+      {
+         pipeline_schedule_bands(pipeline);
+      }
+   }
+
+   if (pipeline->bands != NULL)
+   {
+      thread_pool_wait(pipeline->pool, &pipeline->band_group);
+   }
+}
+
+static void pipeline_publish(struct png_pipeline_t *pipeline)
+{
+   pipeline->slot_lengths[pipeline->produced & (PIPELINE_SLOT_COUNT - 1)] = pipeline->fill;
+   atomic_store_explicit(&pipeline->head, ++pipeline->produced, memory_order_release);
+   pipeline->fill = 0;
+
+   // The next slot must be free before the producer writes into it
+   uint32_t spins = 0;
+   while (pipeline->produced - atomic_load_explicit(&pipeline->tail, memory_order_acquire) == PIPELINE_SLOT_COUNT && !atomic_load_explicit(&pipeline->cancelled, memory_order_relaxed))
+   {
+      pipeline_backoff(&spins);
+   }
+}
+
+static void pipeline_push(uint8_t byte, struct data_buffer_t *output, void *output_settings)
+{
+   (void)output;
+   struct png_pipeline_t *pipeline = (struct png_pipeline_t *)output_settings;
+   pipeline->slots[(pipeline->produced & (PIPELINE_SLOT_COUNT - 1)) * pipeline->slot_size + pipeline->fill] = byte;
+   if (++pipeline->fill == pipeline->slot_size)
+   {
+      pipeline_publish(pipeline);
+   }
+}
+
+static int start_pipeline(struct png_decoder_t *decoder, struct png_pipeline_t *pipeline, struct output_settings_t *settings, struct data_buffer_t *image, const struct colour_transforms_t *ct, const struct image_t *output)
+{
+   uint64_t slot_size = 0;
+   for (int i = 0; i < 8 && settings->subimage.images[i].scanline_count != 0; ++i)
+   {
+      slot_size = settings->subimage.images[i].scanline_size > slot_size ? settings->subimage.images[i].scanline_size : slot_size;
+   }
+   size_t lengths_size = PIPELINE_SLOT_COUNT * sizeof(uint32_t);
+   if (slot_size > UINT32_MAX || reserve_buffer(decoder, &decoder->ring, &decoder->ring_size, lengths_size + PIPELINE_SLOT_COUNT * slot_size) == NULL)
+   {
+      log_warning("Failed to allocate pipeline, decoding serially");
+      return -1;
+   }
+
+   memset(pipeline, 0, sizeof(*pipeline));
+   pipeline->pool = decoder->pool;
+   pipeline->slot_lengths = (uint32_t *)decoder->ring;
+   pipeline->slots = decoder->ring + lengths_size;
+   pipeline->slot_size = (uint32_t)slot_size;
+   pipeline->settings = settings;
+   pipeline->image = image;
+   pipeline->ct = ct;
+   pipeline->scanline_size = settings->subimage.images[0].scanline_size;
+   atomic_init(&pipeline->head, 0);
+   atomic_init(&pipeline->tail, 0);
+   atomic_init(&pipeline->closed, false);
+   atomic_init(&pipeline->cancelled, false);
+   task_group_init(&pipeline->group);
+   task_group_init(&pipeline->band_group);
+
+   // Adam7 rows are only complete in the last pass, those images are corrected after IEND instead
+   if (ct->active != CHRM_DISABLED && settings->subimage.images[1].scanline_count == 0)
+   {
+      pipeline->band_rows = band_height(decoder->pool, output->height);
+      const size_t band_count = (output->height + pipeline->band_rows - 1) / pipeline->band_rows;
+      pipeline->bands = (struct row_band_t *)reserve_buffer(decoder, &decoder->pipeline_bands, &decoder->pipeline_bands_size, band_count * sizeof(*pipeline->bands));
+      for (uint32_t i = 0; pipeline->bands != NULL && i * pipeline->band_rows < output->height; ++i)
+      {
+         pipeline->bands[i].run = correct_colour_rows;
+         pipeline->bands[i].arg = ct;
+         pipeline->bands[i].image = output;
+      }
+   }
+
+   if (thread_pool_submit(decoder->pool, &pipeline->group, pipeline_unfilter_task, pipeline, INT32_MAX, 0) != 0)
+   {
+      return -1;
+   }
+   log_debug("Pipeline started, %u slots of %u bytes", PIPELINE_SLOT_COUNT, pipeline->slot_size);
+   return 0;
+}
+
+static void collect_filtered(uint8_t byte, struct data_buffer_t *output, void *output_settings)
+{
+   (void)output;
+   struct filtered_buffer_t *filtered = (struct filtered_buffer_t *)output_settings;
+   if (filtered->index < filtered->size)
+   {
+      filtered->data[filtered->index++] = byte;
+   }
+}
+
+static int start_deferred_unfilter(struct png_decoder_t *decoder, const struct output_settings_t *settings, struct filtered_buffer_t *filtered)
+{
+   uint64_t size = 0;
+   for (int i = 0; i < 8 && settings->subimage.images[i].scanline_count != 0; ++i)
+   {
+      size += settings->subimage.images[i].scanline_size * settings->subimage.images[i].scanline_count;
+   }
+   if (size > SIZE_MAX || reserve_buffer(decoder, &decoder->filtered, &decoder->filtered_size, (size_t)size) == NULL)
+   {
+      log_warning("Failed to allocate %lu bytes of image data, decoding serially", (unsigned long)size);
+      return -1;
+   }
+   filtered->data = decoder->filtered;
+   filtered->size = (size_t)size;
+   filtered->index = 0;
+   return 0;
+}
+
+// Keeps the zlib stream of every IDAT chunk so it can be split between threads at IEND
+static int append_compressed(struct png_decoder_t *decoder, size_t *length, const uint8_t *data, uint32_t size)
+{
+   size_t needed = *length + size + ZLIB_STREAM_PADDING;
+   if (needed > decoder->compressed_size)
+   {
+      size_t capacity = decoder->compressed_size ? decoder->compressed_size : needed;
+      while (capacity < needed)
+      {
+         capacity <<= 1;
+      }
+      uint8_t *compressed = decoder->allocator.realloc(decoder->compressed, capacity, decoder->allocator.user);
+      if (compressed == NULL)
+      {
+         log_error("Failed to allocate %zu bytes of compressed image data", capacity);
+         return -1;
+      }
+      decoder->compressed = compressed;
+      decoder->compressed_size = capacity;
+   }
+   memcpy(decoder->compressed + *length, data, size);
+   *length += size;
+   return 0;
+}
+
+// Apple's iDOT: segment count, a reserved word, rows per segment and the chunk size, then for each restart point
+// the rows above it, the rows in it and the offset of its first IDAT chunk from the start of the iDOT chunk
+static int read_idot(const uint8_t *data, uint32_t size, uint64_t chunk_offset, uint32_t height, struct png_segments_t *segments)
+{
+   uint32_t count = (size >= IDOT_HEADER_SIZE) ? order_png32_t(*(uint32_t *)data) : 0;
+   if (count < 2 || count > PNG_SEGMENT_MAX || size != IDOT_HEADER_SIZE + (count - 1) * IDOT_ENTRY_SIZE)
+   {
+      log_warning("Unsupported iDOT layout, decoding serially");
+      return -1;
+   }
+
+   segments->count = 0;
+   segments->first_rows[0] = 0;
+   for (uint32_t i = 0; i < count; ++i)
+   {
+      segments->entries[i].offset = 0;
+      segments->entries[i].has_adler32 = 0;
+      if (i == 0)
+      {
+         continue;
+      }
+      const uint8_t *entry = data + IDOT_HEADER_SIZE + (i - 1) * IDOT_ENTRY_SIZE;
+      segments->first_rows[i] = order_png32_t(*(uint32_t *)entry);
+      segments->file_offsets[i] = chunk_offset + order_png32_t(*(uint32_t *)(entry + 8));
+      if (segments->first_rows[i] <= segments->first_rows[i - 1] || segments->first_rows[i] >= height)
+      {
+         log_warning("Invalid iDOT segment %u, decoding serially", i);
+         return -1;
+      }
+   }
+   segments->count = count;
+   segments->located = 1;
+   segments->name = PNG_iDOT;
+   return 0;
+}
+
+// rsIX, described in the README: segment count, then for each segment its first row, the offset of its data in the
+// zlib stream and the Adler-32 of its inflated bytes
+static int read_rsix(const uint8_t *data, uint32_t size, uint32_t height, struct png_segments_t *segments)
+{
+   uint32_t count = (size >= sizeof(uint32_t)) ? order_png32_t(*(uint32_t *)data) : 0;
+   if (count < 1 || count > PNG_SEGMENT_MAX || size != sizeof(uint32_t) + count * RSIX_ENTRY_SIZE)
+   {
+      log_warning("Invalid rsIX chunk, decoding serially");
+      return -1;
+   }
+
+   segments->count = 0;
+   for (uint32_t i = 0; i < count; ++i)
+   {
+      const uint8_t *entry = data + sizeof(uint32_t) + i * RSIX_ENTRY_SIZE;
+      segments->first_rows[i] = order_png32_t(*(uint32_t *)entry);
+      segments->entries[i].offset = order_png32_t(*(uint32_t *)(entry + 4));
+      segments->entries[i].adler32 = order_png32_t(*(uint32_t *)(entry + 8));
+      segments->entries[i].has_adler32 = 1;
+      bool valid = (i == 0) ? segments->first_rows[i] == 0 && segments->entries[i].offset == 0
+                            : segments->first_rows[i] > segments->first_rows[i - 1] && segments->first_rows[i] < height && segments->entries[i].offset > segments->entries[i - 1].offset;
+      if (!valid)
+      {
+         log_warning("Invalid rsIX segment %u, decoding serially", i);
+         return -1;
+      }
+   }
+   segments->count = count;
+   segments->located = count;
+   segments->name = PNG_rsIX;
+   return 0;
+}
+
+// Restart points or speculation split the stream between threads, failures fall back to the serial inflater
+// over the same buffer, which also reports any error in the stream
+static int inflate_compressed(struct png_decoder_t *decoder, size_t length, struct png_segments_t *segments, uint64_t scanline_size, struct zlib_t *zlib, struct data_buffer_t *image, struct filtered_buffer_t *filtered)
+{
+   memset(decoder->compressed + length, 0, ZLIB_STREAM_PADDING);
+   int result = -1;
+   if (segments != NULL && segments->located < segments->count)
+   {
+      log_warning("%u of %u restart points not found in the IDAT stream", segments->count - segments->located, segments->count);
+   }
+   else if (segments != NULL)
+   {
+      for (uint32_t i = 0; i < segments->count; ++i)
+      {
+         segments->entries[i].output_offset = segments->first_rows[i] * scanline_size;
+      }
+      result = decompress_zlib_segments(decoder->pool, &decoder->allocator, decoder->compressed, length, segments->entries, segments->count, filtered->data, filtered->size);
+   }
+   if (result != 0 && (decoder->flags & PNG_DECODE_PARALLEL_INFLATE))
+   {
+      result = decompress_zlib_parallel(decoder->pool, &decoder->allocator, decoder->compressed, length, ZLIB_REGION_SIZE_DEFAULT, filtered->data, filtered->size);
+   }
+   if (result == 0)
+   {
+      filtered->index = filtered->size;
+      return ZLIB_COMPLETE;
+   }
+   log_warning("Parallel inflate failed, inflating serially");
+   filtered->index = 0;
+   struct stream_ptr_t bitstream = {.data = decoder->compressed, .size = length, .byte_index = 0, .bit_index = 0};
+   return decompress_zlib(zlib, &bitstream, image, collect_filtered, (void *)filtered);
+}
+
+// Runs filter() over a range of rows with private settings and scanline buffers
+struct unfilter_task_t
+{
+   struct output_settings_t settings;
+   struct data_buffer_t image;
+   const uint8_t *data;
+   size_t size;
+};
+
+static void unfilter_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct unfilter_task_t *task = (struct unfilter_task_t *)arg;
+   for (size_t i = 0; i < task->size; ++i)
+   {
+      filter(task->data[i], &task->image, &task->settings);
+   }
+}
+
+static void init_unfilter_task(struct unfilter_task_t *task, const struct output_settings_t *settings, uint8_t *scanlines, uint8_t *output, uint8_t image_index, uint32_t row_index)
+{
+   task->settings = *settings;
+   task->settings.scanline.buffer = scanlines;
+   task->settings.scanline.new = scanlines + settings->scanline.stride;
+   task->settings.scanline.last = task->settings.scanline.new + (settings->scanline.buffer_size >> 1);
+   task->image.data = output;
+   filter_start_scanline(&task->settings, image_index, row_index, &task->image);
+}
+
+// Adam7 passes reset the previous scanline, so each one is unfiltered and scattered by its own task
+static int unfilter_passes(struct png_decoder_t *decoder, const struct output_settings_t *settings, const struct filtered_buffer_t *filtered, uint8_t *output)
+{
+   struct unfilter_task_t tasks[7];
+   const size_t scanlines_size = settings->scanline.buffer_size;
+   if (reserve_buffer(decoder, &decoder->task_scanlines, &decoder->task_scanlines_size, 7 * scanlines_size) == NULL)
+   {
+      log_error("Failed to allocate scanline buffers");
+      return -1;
+   }
+   memset(decoder->task_scanlines, 0, 7 * scanlines_size);
+
+   struct task_group_t group;
+   task_group_init(&group);
+   size_t offset = 0;
+   for (uint8_t i = 0; i < 7 && settings->subimage.images[i].scanline_count != 0 && offset < filtered->index; ++i)
+   {
+      const struct sub_image_t *pass = &settings->subimage.images[i];
+      uint64_t pass_size = pass->scanline_size * pass->scanline_count;
+      struct unfilter_task_t *task = &tasks[i];
+      init_unfilter_task(task, settings, decoder->task_scanlines + i * scanlines_size, output, i, 0);
+      task->data = filtered->data + offset;
+      task->size = filtered->index - offset < pass_size ? filtered->index - offset : (size_t)pass_size;
+      offset += task->size;
+
+      if (thread_pool_spawn(decoder->pool, &group, unfilter_task, task) != 0)
+      {
+         unfilter_task(task, 0);
+      }
+   }
+   thread_pool_wait(decoder->pool, &group);
+   log_debug("Unfiltered %zu bytes of Adam7 passes in parallel", offset);
+   return 0;
+}
+
+// Rows filtered with None or Sub do not read the previous scanline, so each starts an independent chain
+// Chains are merged into tasks of roughly equal height and unfiltered in parallel
+static int unfilter_rows(struct png_decoder_t *decoder, const struct output_settings_t *settings, const struct filtered_buffer_t *filtered, uint8_t *output)
+{
+   const uint64_t scanline_size = settings->subimage.images[0].scanline_size;
+   const uint32_t row_count = (uint32_t)(filtered->index / scanline_size) + (filtered->index % scanline_size != 0);
+   const uint32_t task_limit = thread_pool_size(decoder->pool) * PNG_CHAINS_PER_WORKER;
+   const uint32_t target_rows = (row_count + task_limit - 1) / task_limit;
+   const size_t scanlines_size = settings->scanline.buffer_size;
+
+   const struct png_allocator_t *allocator = &decoder->allocator;
+   struct unfilter_task_t *tasks = allocator->alloc(task_limit * sizeof(*tasks), allocator->user);
+   if (tasks == NULL || reserve_buffer(decoder, &decoder->task_scanlines, &decoder->task_scanlines_size, task_limit * scanlines_size) == NULL)
+   {
+      log_error("Failed to allocate scanline buffers");
+      allocator->free(tasks, allocator->user);
+      return -1;
+   }
+   memset(decoder->task_scanlines, 0, task_limit * scanlines_size);
+
+   struct task_group_t group;
+   task_group_init(&group);
+   uint32_t task_count = 0;
+   uint32_t chain_count = 0;
+   uint32_t start_row = 0;
+   for (uint32_t row = 1; row <= row_count; ++row)
+   {
+      bool chain_head = row < row_count && filtered->data[row * scanline_size] <= 1;
+      chain_count += chain_head;
+      // The last task takes whatever is left so the task count never exceeds the limit
+      if (row < row_count && (!chain_head || row - start_row < target_rows || task_count == task_limit - 1))
+      {
+         continue;
+      }
+
+      struct unfilter_task_t *task = &tasks[task_count];
+      init_unfilter_task(task, settings, decoder->task_scanlines + task_count * scanlines_size, output, 0, start_row);
+      task->data = filtered->data + start_row * scanline_size;
+      task->size = (row == row_count ? filtered->index : row * scanline_size) - start_row * scanline_size;
+
+      if (thread_pool_spawn(decoder->pool, &group, unfilter_task, task) != 0)
+      {
+         unfilter_task(task, 0);
+      }
+      ++task_count;
+      start_row = row;
+   }
+   thread_pool_wait(decoder->pool, &group);
+   log_debug("Unfiltered %u rows in %u tasks, %u independent chains", row_count, task_count, chain_count + 1);
+   allocator->free(tasks, allocator->user);
+   return 0;
+}
+
+// Collected image data goes to whichever parallel unfilter mode is enabled, otherwise it is unfiltered in order
+static int unfilter_deferred(struct png_decoder_t *decoder, struct output_settings_t *settings, const struct filtered_buffer_t *filtered, struct data_buffer_t *image, uint8_t interlace_method)
+{
+   // Passes of packed low bit depth rows share output bytes, so those are unfiltered in order
+   const bool shared_bytes = settings->samples == FILTER_SAMPLES_PACKED && settings->pixel.bit_depth < 8;
+   if (interlace_method == PNG_INTERLACE_ADAM7 && (decoder->flags & PNG_DECODE_PARALLEL_PASSES) && !shared_bytes)
+   {
+      return unfilter_passes(decoder, settings, filtered, image->data);
+   }
+   if (interlace_method != PNG_INTERLACE_ADAM7 && (decoder->flags & PNG_DECODE_PARALLEL_ROWS))
+   {
+      return unfilter_rows(decoder, settings, filtered, image->data);
+   }
+   for (size_t i = 0; i < filtered->index; ++i)
+   {
+      filter(filtered->data[i], image, settings);
+   }
+   return 0;
+}
+
+// Flushes the partial slot and waits for the unfilter and colour stages, a cancelled pipeline drops queued slots
+static void finish_pipeline(struct png_pipeline_t *pipeline, bool cancel)
+{
+   if (!cancel && pipeline->fill > 0)
+   {
+      pipeline_publish(pipeline);
+   }
+   atomic_store_explicit(&pipeline->cancelled, cancel, memory_order_relaxed);
+   atomic_store_explicit(&pipeline->closed, true, memory_order_release);
+   thread_pool_wait(pipeline->pool, &pipeline->group);
+}
+
+static int decode_file(struct png_decoder_t *decoder, const char *filename, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output)
+{
+   struct png_source_t source = {.file = fopen(filename, "rb")};
+   int status = decode_png(decoder, &source, layout, buffer, buffer_size, output);
+   if (source.file != NULL)
+   {
+      fclose(source.file);
+   }
+   return status;
+}
+
+// bKGD samples scaled as the filter scales pixels, so they are at the output bit depth
+static int read_background(const uint8_t *data, uint32_t size, const struct png_header_t *png_header, const struct output_settings_t *settings, uint16_t *background)
+{
+   if (png_header->colour_type == Indexed_colour)
+   {
+      if (size != 1 || settings->palette.buffer == NULL || data[0] >= settings->palette.size)
+      {
+         log_error("Invalid bKGD chunk");
+         return -1;
+      }
+      background[0] = settings->palette.buffer[data[0]].r;
+      background[1] = settings->palette.buffer[data[0]].g;
+      background[2] = settings->palette.buffer[data[0]].b;
+      return 0;
+   }
+
+   const uint32_t channels = (png_header->colour_type & 0x02) ? 3 : 1;
+   if (size != channels * 2)
+   {
+      log_error("Invalid bKGD chunk");
+      return -1;
+   }
+   const uint16_t max = png_header->bit_depth == 16 ? 0xffff : (uint16_t)((1 << png_header->bit_depth) - 1);
+   for (uint32_t c = 0; c < channels; ++c)
+   {
+      const uint16_t sample = (uint16_t)((data[c * 2] << 8) | data[c * 2 + 1]) & max;
+      background[c] = png_header->bit_depth >= 8 ? sample : (uint16_t)(sample * (0xff / max));
+   }
+   return 0;
+}
+
+// Decoder background at the output bit depth, greyscale images take its Rec. 709 luma
+static void caller_background(const struct png_decoder_t *decoder, uint8_t channels, uint8_t bit_depth, uint16_t *background)
+{
+   const uint16_t *rgb = decoder->background;
+   uint32_t samples[3] = {rgb[0], rgb[1], rgb[2]};
+   if (channels == 1)
+   {
+      samples[0] = (2126u * rgb[0] + 7152u * rgb[1] + 722u * rgb[2] + 5000u) / 10000u;
+   }
+   for (uint8_t c = 0; c < channels; ++c)
+   {
+      background[c] = bit_depth == 16 ? (uint16_t)samples[c] : (uint16_t)((samples[c] * 0xff + 0x7fff) / 0xffff);
+   }
+}
+
+// Native formats fall back to PNG_FORMAT_SOURCE for images they cannot hold, transparent is set by a valid tRNS
+static enum png_output_format_t resolve_format(enum png_output_format_t format, uint8_t colour_type, uint8_t bit_depth, bool transparent)
+{
+   if (format == PNG_FORMAT_INDEX8 && colour_type != Indexed_colour)
+   {
+      return PNG_FORMAT_SOURCE;
+   }
+   if (format == PNG_FORMAT_PACKED && colour_type != Indexed_colour && !(colour_type == Greyscale && bit_depth < 8 && !transparent))
+   {
+      return PNG_FORMAT_SOURCE;
+   }
+   return format;
+}
+
+// Palette of an image decoded to indices, corrected by ct when it is not NULL
+static void export_palette(struct image_t *output, const struct output_settings_t *settings, const struct colour_transforms_t *ct)
+{
+   memset(output->palette, 0, sizeof(output->palette));
+   output->palette_size = settings->palette.size;
+   for (uint16_t i = 0; i < settings->palette.size; ++i)
+   {
+      output->palette[i][0] = settings->palette.buffer[i].r;
+      output->palette[i][1] = settings->palette.buffer[i].g;
+      output->palette[i][2] = settings->palette.buffer[i].b;
+      output->palette[i][3] = settings->palette.alpha != NULL ? settings->palette.alpha[i] : OPAQUE;
+   }
+   if (ct != NULL)
+   {
+      correct_colour_row(ct, output->palette[0], output->palette_size, RGBA, 8);
+   }
+}
+
+// Size covers every plane of an image in format, mode and bit_depth are those format_output gives
+static int resolve_layout(const struct png_layout_t *layout, uint32_t width, uint32_t height, enum png_output_format_t format, enum pixel_format_t mode, uint8_t bit_depth, uint32_t *stride, size_t *size, uint32_t *chroma_stride)
+{
+   uint64_t row_size = format_row_size(format, mode, bit_depth, width);
+   uint64_t row_stride = row_size;
+   uint64_t row_alignment = 1;
+   if (layout != NULL)
+   {
+      if (layout->row_stride != 0)
+      {
+         if (layout->row_stride < row_size)
+         {
+            log_error("Row stride %u is smaller than a row of %lu bytes", layout->row_stride, (unsigned long)row_size);
+            return -1;
+         }
+         row_stride = layout->row_stride;
+      }
+      if (layout->row_alignment > 1)
+      {
+         if ((layout->row_alignment & (layout->row_alignment - 1)) != 0)
+         {
+            log_error("Row alignment %u is not a power of two", layout->row_alignment);
+            return -1;
+         }
+         row_alignment = layout->row_alignment;
+      }
+   }
+
+   row_stride = (row_stride + row_alignment - 1) & ~(uint64_t)(row_alignment - 1);
+   if (row_stride > UINT32_MAX)
+   {
+      log_error("Image too large for layout");
+      return -1;
+   }
+   const uint64_t total = row_stride * height * format_planes(format, mode) + format_chroma_size(format, (uint32_t)row_stride, height, chroma_stride);
+   if (total > UINT32_MAX)
+   {
+      log_error("Image too large for layout");
+      return -1;
+   }
+   *stride = (uint32_t)row_stride;
+   *size = (size_t)total;
+   return 0;
+}
+
+int png_plan_layout(const struct png_info_t *info, struct png_layout_t *layout)
+{
+   const enum pixel_format_t modes[7] = {G, INVALID, RGB, RGB, GA, INVALID, RGBA};
+   if (info->colour_type > TruecolourAlpha || modes[info->colour_type] == INVALID)
+   {
+      log_error("Illegal colour type");
+      return -1;
+   }
+   if ((unsigned)layout->format > PNG_FORMAT_CHANNEL8)
+   {
+      log_error("Invalid output format %u", (unsigned)layout->format);
+      return -1;
+   }
+
+   layout->width = info->width;
+   layout->height = info->height;
+   layout->bit_depth = info->bit_depth == 16 ? 16 : 8;
+   layout->mode = modes[info->colour_type];
+
+   // tRNS adds an alpha channel under the same conditions the decoder accepts it
+   uint32_t palette_size = 0;
+   for (uint32_t i = 0; i < info->chunk_count; ++i)
+   {
+      uint32_t length = info->chunks[i].length;
+      if (info->chunks[i].name == PNG_PLTE)
+      {
+         palette_size = length / 3;
+      }
+      else if (info->chunks[i].name == PNG_tRNS)
+      {
+         if ((info->colour_type == Greyscale && length == GREYSCALE_TRNS_SIZE) ||
+             (info->colour_type == Truecolour && length == TRUECOLOUR_TRNS_SIZE) ||
+             (info->colour_type == Indexed_colour && length <= palette_size))
+         {
+            layout->mode = layout->mode == G ? GA : RGBA;
+         }
+         break;
+      }
+   }
+
+   const enum png_output_format_t format = resolve_format(layout->format, info->colour_type, info->bit_depth, layout->mode == GA || layout->mode == RGBA);
+   format_output(format, layout->mode, format == PNG_FORMAT_PACKED ? info->bit_depth : layout->bit_depth, &layout->mode, &layout->bit_depth);
+   uint32_t chroma_stride;
+   return resolve_layout(layout, layout->width, layout->height, format, layout->mode, layout->bit_depth, &layout->stride, &layout->size, &chroma_stride);
+}
+
+int png_decoder_load(struct png_decoder_t *decoder, const char *filename, struct image_t *output)
+{
+   return decode_file(decoder, filename, NULL, NULL, 0, output);
+}
+
+int png_decoder_load_memory(struct png_decoder_t *decoder, const uint8_t *data, size_t size, struct image_t *output)
+{
+   struct png_source_t source = {.data = data, .size = size, .position = 0};
+   return decode_png(decoder, &source, NULL, NULL, 0, output);
+}
+
+int png_decoder_load_into(struct png_decoder_t *decoder, const char *filename, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output)
+{
+   return decode_file(decoder, filename, layout, buffer, buffer_size, output);
+}
+
+int load_png_into(const char *filename, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output)
+{
+   struct png_decoder_t *decoder = png_decoder_create(NULL);
+   if (decoder == NULL)
+   {
+      output->data = NULL;
+      output->decoder = NULL;
+      output->allocator = NULL;
+      output->external = 0;
+      output->mode = INVALID;
+      return -1;
+   }
+   int status = png_decoder_load_into(decoder, filename, layout, buffer, buffer_size, output);
+   png_decoder_destroy(decoder);
+   return status;
+}
+
+// Layout and buffer are optional, without them rows are tightly packed in a buffer from the decoder
+// Unfilters deferred image data, then stages or colour corrects the whole image, shared by decode_png and resume_png
+static int finish_png(struct png_decoder_t *decoder, struct png_finish_t *finish, struct image_t *output)
+{
+   uint8_t *decoded = finish->staging ? finish->staged.data : output->data;
+   if (finish->deferred && (finish->segmented ? unfilter_rows(decoder, &finish->settings, &finish->filtered, decoded) : unfilter_deferred(decoder, &finish->settings, &finish->filtered, &finish->image, finish->interlace_method)) != 0)
+   {
+      return -1;
+   }
+
+   if (finish->staging)
+   {
+      // The stage was copied along with ct, so it must use this copy
+      if (finish->stage.ct != NULL)
+      {
+         finish->stage.ct = &finish->ct;
+      }
+      run_row_bands(decoder, &finish->staged, stage_rows, &finish->stage);
+   }
+   else if (finish->ct.active != CHRM_DISABLED && !finish->corrected)
+   {
+      run_row_bands(decoder, output, correct_colour_rows, &finish->ct);
+   }
+   return 0;
+}
+
+static int decode_png(struct png_decoder_t *decoder, struct png_source_t *source, const struct png_layout_t *layout, uint8_t *buffer, size_t buffer_size, struct image_t *output)
+{
+   output->mode = INVALID;
+   output->data = NULL;
+   output->size = 0;
+   output->stride = 0;
+   output->decoder = NULL;
+   output->allocator = NULL;
+   output->external = 0;
+   output->format = PNG_FORMAT_SOURCE;
+   output->premultiplied = 0;
+   output->plane_size = 0;
+   output->chroma_stride = 0;
+   output->palette_size = 0;
+
+   if (check_png_file_header(source) != 0)
+   {
+      return -1;
+   }
+
+   struct png_header_t png_header;
+   if (read_png_header(source, &png_header) != 0)
+   {
+      return -1;
+   }
+
+   uint32_t chunk_data_size;
+   uint32_t crc_check;
+
+   const uint8_t bytes_per_pixel[7] = {1, 0, 3, 1, 2, 0, 4};
+   const uint32_t bits_per_pixel = png_header.bit_depth * bytes_per_pixel[png_header.colour_type];
+   const uint8_t scanline_stride = (bits_per_pixel + 0x07) >> 3;
+   const uint32_t scanline_pixel_byte_count = (png_header.width * bits_per_pixel + 0x07) >> 3;
+   const uint32_t scanline_buffer_size = (scanline_stride + scanline_pixel_byte_count);
+   const uint8_t palette_scale = (png_header.colour_type == Indexed_colour) ? 3 : 1;
+   uint8_t *scanline_buffers = reserve_buffer(decoder, &decoder->scanline_buffers, &decoder->scanline_buffers_size, scanline_buffer_size * 2);
+   if (scanline_buffers == NULL)
+   {
+      log_error("Failed to allocate scanline buffers");
+      return -1;
+   }
+   memset(scanline_buffers, 0, scanline_buffer_size * 2);
 
    struct output_settings_t output_settings = {
        .pixel.rgb_size = palette_scale * bytes_per_pixel[png_header.colour_type] * ((png_header.bit_depth + 0x07) >> 3),
@@ -250,6 +2281,8 @@ int load_png(const char *filename, struct image_t *output)
        .palette.alpha = NULL,
        .palette.size = 0,
        .image_width = png_header.width,
+       .image_height = png_header.height,
+       .bottom_up = layout != NULL && (layout->flags & PNG_LAYOUT_BOTTOM_UP),
        .scanline.stride = scanline_stride,
        .scanline.buffer = scanline_buffers,
        .scanline.buffer_size = scanline_buffer_size * 2,
@@ -264,27 +2297,20 @@ int load_png(const char *filename, struct image_t *output)
    output->height = png_header.height;
    output->bit_depth = png_header.bit_depth == 16 ? 16 : 8;
    output->mode = modes[png_header.colour_type];
-   output->size = palette_scale * bytes_per_pixel[png_header.colour_type] * png_header.width * png_header.height;
-   if (png_header.bit_depth == 16)
-   {
-      output->size <<= 1;
-   }
 
    struct zlib_t zlib_idat = {
        .state = READING_ZLIB_HEADER,
-       .LZ77_buffer.data = malloc(ZLIB_BUFFER_MAX_SIZE),
+       .LZ77_buffer.data = decoder->lz77_window,
        .bytes_read = 0};
    adler32_init(&zlib_idat.adler32);
 
-   output->data = malloc(output->size);
-
+   // Output is allocated at the first IDAT chunk, once tRNS has set the final pixel size
    struct data_buffer_t image =
        {
-           .data = output->data,
+           .data = NULL,
            .index = 0};
 
    log_debug("\tScanline buffer size: %u", scanline_buffer_size * 2);
-   log_debug("Output image size: %d bytes", output->size);
    log_debug("\tBits per pixel: %d", bits_per_pixel);
    log_debug("\tOutput pixel size: %d", output_settings.pixel.size);
 
@@ -299,23 +2325,68 @@ int load_png(const char *filename, struct image_t *output)
    } chunk_state = IHDR_PROCESSED;
 
    struct colour_transforms_t ct = {.active = CHRM_DISABLED};
-   uint8_t *chunk_buffer = malloc(PNG_CHUNK_LENGTH_SIZE);
-   while (fread(chunk_buffer, PNG_CHUNK_LENGTH_SIZE, 1, png_ptr) != 0 && feof(png_ptr) == 0 && chunk_state != EXIT_CHUNK_PROCESSING)
+   uint16_t bkgd[3] = {0};
+   bool has_bkgd = false;
+   struct output_stage_t stage = {.target = NULL};
+   struct image_t staged; // Whole decoded image when rows cannot be staged one at a time
+   struct image_t *decoded = output;
+   struct idat_stream_t idat = {.bitstream.bit_index = 0, .carry_size = 0};
+   struct png_pipeline_t pipeline;
+   bool pipelined = false;
+   bool corrected = false; // Colour transforms already applied by the pipeline or as rows were unfiltered
+   struct filtered_buffer_t filtered;
+   bool deferred = false; // Image data is collected and unfiltered at IEND
+   bool parallel_inflate = false; // Compressed data is collected and inflated in parallel at IEND
+   bool segmented = false;        // Split at the restart points of an iDOT or rsIX chunk
+   struct png_segments_t segments;
+   segments.count = 0;
+   size_t compressed_length = 0;
+   uint64_t chunk_offset = 0;
+   uint64_t next_chunk_offset = sizeof(uint64_t) + PNG_CHUNK_LENGTH_SIZE + sizeof(struct png_header_t);
+   struct chunk_crc_t chunk_check;
+   int status = -1;
+   uint32_t chunk_length;
+   while (chunk_state != EXIT_CHUNK_PROCESSING && source_read(source, &chunk_length, PNG_CHUNK_LENGTH_SIZE) != 0)
    {
-      chunk_data_size = order_png32_t(*(uint32_t *)chunk_buffer);
-      chunk_buffer = realloc(chunk_buffer, PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE);
-      fread(chunk_buffer + PNG_CHUNK_LENGTH_SIZE, PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE, 1, png_ptr);
-
-      uint8_t *chunk_data = chunk_buffer + PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE;
-      uint32_t chunk_crc = *(uint32_t *)(chunk_data + chunk_data_size);
-      crc_check = compute_crc(chunk_buffer + PNG_CHUNK_LENGTH_SIZE, chunk_data_size + PNG_CHUNK_TYPE_SIZE);
-      if (crc_check != order_png32_t(chunk_crc))
+      chunk_data_size = order_png32_t(chunk_length);
+      if (chunk_data_size > PNG_CHUNK_LENGTH_MAX)
+      {
+         log_error("Invalid chunk length");
+         break;
+      }
+      chunk_offset = next_chunk_offset;
+      next_chunk_offset += PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE;
+      uint8_t *chunk_buffer = reserve_buffer(decoder, &decoder->chunk_buffer, &decoder->chunk_buffer_size, PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE);
+      if (chunk_buffer == NULL)
+      {
+         log_error("Failed to allocate chunk buffer");
+         break;
+      }
+      if (source_read(source, chunk_buffer + PNG_CHUNK_LENGTH_SIZE, PNG_CHUNK_TYPE_SIZE + chunk_data_size + PNG_CHUNK_CRC_SIZE) != 1)
       {
-         log_error("CRC check failed for %c%c%c%c chunk", *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 1), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 2), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 3));
+         log_error("Unexpected end of file");
          break;
       }
 
+      uint8_t *chunk_data = chunk_buffer + PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE;
       uint32_t chunk_name = *(uint32_t *)(chunk_buffer + PNG_CHUNK_LENGTH_SIZE);
+      // Large IDAT chunks are inflated optimistically, the decode fails once the CRC is known to be wrong
+      bool crc_pending = chunk_name == PNG_IDAT && (decoder->flags & PNG_DECODE_ASYNC_CRC) && decoder->pool != NULL && chunk_data_size >= PNG_CRC_SLICE_MIN;
+      if (crc_pending)
+      {
+         start_chunk_crc(decoder->pool, &chunk_check, chunk_buffer, chunk_data_size);
+      }
+      else
+      {
+         uint32_t chunk_crc = *(uint32_t *)(chunk_data + chunk_data_size);
+         crc_check = compute_crc(chunk_buffer + PNG_CHUNK_LENGTH_SIZE, chunk_data_size + PNG_CHUNK_TYPE_SIZE);
+         if (crc_check != order_png32_t(chunk_crc))
+         {
+            log_error("CRC check failed for %c%c%c%c chunk", *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 1), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 2), *(chunk_buffer + PNG_CHUNK_LENGTH_SIZE + 3));
+            break;
+         }
+      }
+
       switch (chunk_name)
       {
       case PNG_PLTE:
@@ -347,7 +2418,13 @@ int load_png(const char *filename, struct image_t *output)
             chunk_state = EXIT_CHUNK_PROCESSING;
             break;
          }
-         output_settings.palette.buffer = malloc(chunk_data_size);
+         if (chunk_data_size > sizeof(decoder->palette))
+         {
+            log_error("Incorrect palette size");
+            chunk_state = EXIT_CHUNK_PROCESSING;
+            break;
+         }
+         output_settings.palette.buffer = decoder->palette;
          output_settings.palette.size = chunk_data_size / 3;
          memcpy(output_settings.palette.buffer, chunk_data, chunk_data_size);
          chunk_state = PLTE_PROCESSED;
@@ -355,6 +2432,12 @@ int load_png(const char *filename, struct image_t *output)
          break;
       case PNG_tRNS:
          log_debug("tRNS");
+         if (chunk_state >= READING_IDAT)
+         {
+            // The output image and pixel size are fixed at the first IDAT
+            log_error("tRNS chunk found after IDAT");
+            break;
+         }
          if (png_header.colour_type == Indexed_colour)
          {
             if (chunk_state != PLTE_PROCESSED)
@@ -396,25 +2479,22 @@ int load_png(const char *filename, struct image_t *output)
             log_error("Colour type does not support tRNS chunk");
             break;
          }
+         if (output_settings.palette.alpha != NULL)
+         {
+            log_error("tRNS chunk already defined");
+            break;
+         }
          uint8_t alpha_pixel_size = (png_header.bit_depth == 16) ? 2 : 1;
          output_settings.pixel.size += alpha_pixel_size;
-         output->size += (png_header.width * png_header.height * alpha_pixel_size);
-         log_debug("\tResizing output image to %d bytes", output->size);
-         output->data = realloc(output->data, output->size);
-         image.data = output->data;
 
+         output_settings.palette.alpha = decoder->alpha;
          if (png_header.colour_type == Indexed_colour)
          {
-            output_settings.palette.alpha = malloc(output_settings.palette.size);
             for (int i = chunk_data_size; i < output_settings.palette.size; i++)
             {
                output_settings.palette.alpha[i] = OPAQUE;
             }
          }
-         else
-         {
-            output_settings.palette.alpha = malloc(chunk_data_size);
-         }
 
          memcpy(output_settings.palette.alpha, chunk_data, chunk_data_size);
 
@@ -434,23 +2514,216 @@ int load_png(const char *filename, struct image_t *output)
          }
          else
          {
-            chunk_state = READING_IDAT;
+            if (chunk_state != READING_IDAT)
+            {
+               if (png_header.colour_type == Indexed_colour && output_settings.palette.buffer == NULL)
+               {
+                  log_error("No PLTE chunk present for Indexed colour type");
+                  chunk_state = EXIT_CHUNK_PROCESSING;
+                  break;
+               }
+               const enum pixel_format_t decoded_mode = output->mode;
+               const uint8_t decoded_bit_depth = output->bit_depth;
+               const enum png_output_format_t format = resolve_format(decoder->format, png_header.colour_type, png_header.bit_depth, output_settings.palette.alpha != NULL);
+               // Batch decoders take no options, so suspended decodes are never staged
+               if (decoder->suspend == NULL && format_native(format))
+               {
+                  // Written by the unfilter as stored, so there is nothing to flatten, premultiply or convert
+                  output_settings.samples = format == PNG_FORMAT_INDEX8 ? FILTER_SAMPLES_INDICES : FILTER_SAMPLES_PACKED;
+                  output_settings.pixel.size = 1;
+                  format_output(format, decoded_mode, png_header.bit_depth, &output->mode, &output->bit_depth);
+                  output->format = format;
+               }
+               else if (decoder->suspend == NULL)
+               {
+                  stage.mode = decoded_mode;
+                  stage.bit_depth = decoded_bit_depth;
+                  stage.flatten = (decoder->flags & PNG_DECODE_FLATTEN_ALPHA) && (decoded_mode == GA || decoded_mode == RGBA);
+                  const enum pixel_format_t flat_mode = stage.flatten ? (enum pixel_format_t)(decoded_mode - 1) : decoded_mode;
+                  if (stage.flatten && has_bkgd && !(decoder->flags & PNG_DECODE_FORCE_BACKGROUND))
+                  {
+                     memcpy(stage.background, bkgd, sizeof(bkgd));
+                  }
+                  else if (stage.flatten)
+                  {
+                     caller_background(decoder, (uint8_t)flat_mode, decoded_bit_depth, stage.background);
+                  }
+                  stage.settings.format = format;
+                  stage.settings.premultiply = (decoder->flags & PNG_DECODE_PREMULTIPLY) && (flat_mode == GA || flat_mode == RGBA);
+                  for (uint8_t c = 0; c < 4; ++c)
+                  {
+                     stage.settings.scale[c] = decoder->scale[c] != 0.0f ? decoder->scale[c] : 1.0f / (float)((1u << decoded_bit_depth) - 1);
+                     stage.settings.bias[c] = decoder->bias[c];
+                  }
+                  stage.convert = format_converts(stage.settings.format, flat_mode, decoded_bit_depth, stage.settings.premultiply);
+                  stage.bottom_up = output_settings.bottom_up;
+                  stage.target = (stage.flatten || stage.convert) ? output : NULL;
+                  format_output(stage.settings.format, flat_mode, decoded_bit_depth, &output->mode, &output->bit_depth);
+                  stage.settings.matrix = decoder->yuv_matrix;
+                  stage.settings.channel = decoder->channel;
+                  output->format = stage.settings.format;
+                  output->premultiplied = stage.settings.premultiply;
+               }
+               size_t output_size;
+               if (resolve_layout(layout, png_header.width, png_header.height, output->format, output->mode, output->bit_depth, &output->stride, &output_size, &output->chroma_stride) != 0)
+               {
+                  chunk_state = EXIT_CHUNK_PROCESSING;
+                  break;
+               }
+               output->plane_size = format_planar(output->format) || format_yuv(output->format) ? (size_t)output->stride * png_header.height : 0;
+               stage.settings.plane_size = output->plane_size;
+               stage.settings.chroma_plane_size = format_yuv(output->format) && output->format != PNG_FORMAT_NV12 ? (output_size - output->plane_size) / 2 : 0;
+               output->size = (uint32_t)output_size;
+               if (buffer != NULL)
+               {
+                  if (buffer_size < output_size)
+                  {
+                     log_error("Output buffer of %zu bytes too small, layout needs %zu bytes", buffer_size, output_size);
+                     chunk_state = EXIT_CHUNK_PROCESSING;
+                     break;
+                  }
+                  output->data = buffer;
+                  output->external = 1;
+               }
+               else
+               {
+                  output->data = acquire_output(decoder, output_size);
+                  if (output->data == NULL)
+                  {
+                     chunk_state = EXIT_CHUNK_PROCESSING;
+                     break;
+                  }
+                  output->decoder = decoder;
+                  ++decoder->open_images;
+               }
+               output_settings.row_stride = output->stride;
+               image.data = output->data;
+               image.index = output_settings.bottom_up ? (size_t)(png_header.height - 1) * output->stride : 0;
+               log_debug("Output image size: %d bytes, row stride %u", output->size, output->stride);
 
-            static struct stream_ptr_t bitstream = {.bit_index = 0, .byte_index = 0};
-            static uint8_t idat_buffer[PNG_CHUNK_LENGTH_SIZE + PNG_CHUNK_TYPE_SIZE] = {0};
-            static size_t idat_buffer_index = 0;
+               if (ct.active & CHRM_CHROMA && decoded_mode != RGB && decoded_mode != RGBA)
+               {
+                  log_warning("Non-RGB image, ignoring chroma data");
+                  ct.active &= ~CHRM_CHROMA;
+               }
+               // Chunk order is free before PLTE, so the colour chunks are only resolved here
+               if (ct.active & CHRM_CICP)
+               {
+                  ct.active = CHRM_DISABLED;
+               }
+               else if (ct.active & CHRM_ICC)
+               {
+                  ct.active = ct.icc->identity && decoded_bit_depth == 8 ? CHRM_DISABLED : CHRM_ICC;
+               }
+               else if ((ct.active & CHRM_SRGB) || ((ct.active & CHRM_GAMMA) && !(ct.active & CHRM_CHROMA) && gamma_close(ct.gamma->gamma, GAMMA_SRGB)))
+               {
+                  log_debug("Image is sRGB, no colour transforms needed");
+                  ct.active = CHRM_DISABLED;
+               }
+               if (format_native(output->format))
+               {
+                  if (png_header.colour_type == Indexed_colour)
+                  {
+                     export_palette(output, &output_settings, ct.active != CHRM_DISABLED ? &ct : NULL);
+                  }
+                  else if (ct.active != CHRM_DISABLED)
+                  {
+                     log_warning("Colour transforms do not apply to packed greyscale samples");
+                  }
+                  ct.active = CHRM_DISABLED;
+               }
+               parallel_inflate = decoder->pool != NULL && (decoder->flags & PNG_DECODE_PARALLEL_INFLATE);
+               segmented = decoder->pool != NULL && (decoder->flags & PNG_DECODE_SEGMENTS) && segments.count > 1;
+               if (segmented && png_header.interlace_method == PNG_INTERLACE_ADAM7)
+               {
+                  log_warning("Restart points ignored for interlaced image");
+                  segmented = false;
+               }
+               if (stage.target != NULL)
+               {
+                  // Serial decodes of non-interlaced images only need one decoded row
+                  const bool by_row = png_header.interlace_method == PNG_INTERLACE_NONE && !(decoder->pool != NULL && (parallel_inflate || segmented || (decoder->flags & (PNG_DECODE_PARALLEL_ROWS | PNG_DECODE_PIPELINE))));
+                  // Alpha is never colour corrected, so projecting it leaves the colour samples alone
+                  const bool alpha_only = stage.settings.format == PNG_FORMAT_ALPHA8 || (stage.settings.format == PNG_FORMAT_CHANNEL8 && stage.settings.channel == 3);
+                  stage.ct = ct.active != CHRM_DISABLED && !alpha_only ? &ct : NULL;
+                  staged = *output;
+                  staged.mode = decoded_mode;
+                  staged.bit_depth = decoded_bit_depth;
+                  staged.stride = png_header.width * output_settings.pixel.size;
+                  staged.height = by_row ? 1 : png_header.height;
+                  staged.size = staged.stride * staged.height;
+                  // Subsampled YUV holds each even row for the odd one after it
+                  const bool hold = by_row && (stage.settings.format == PNG_FORMAT_I420 || stage.settings.format == PNG_FORMAT_NV12);
+                  staged.data = reserve_buffer(decoder, &decoder->staged, &decoder->staged_size, (size_t)staged.stride * (staged.height + hold));
+                  if (staged.data == NULL)
+                  {
+                     log_error("Failed to allocate staging buffer");
+                     chunk_state = EXIT_CHUNK_PROCESSING;
+                     break;
+                  }
+                  stage.held = hold ? staged.data + staged.stride : NULL;
+                  stage.held_size = staged.stride;
+                  output_settings.row_stride = staged.stride;
+                  output_settings.bottom_up = 0;
+                  output_settings.row_buffer = by_row;
+                  image.data = staged.data;
+                  image.index = 0;
+                  if (by_row)
+                  {
+                     output_settings.row_complete = stage_completed_row;
+                     output_settings.row_arg = &stage;
+                     corrected = true;
+                  }
+                  else
+                  {
+                     decoded = &staged;
+                  }
+               }
+               if (decoder->suspend != NULL || (decoder->pool != NULL && (parallel_inflate || segmented || (png_header.interlace_method == PNG_INTERLACE_ADAM7 ? decoder->flags & PNG_DECODE_PARALLEL_PASSES : decoder->flags & PNG_DECODE_PARALLEL_ROWS))))
+               {
+                  deferred = start_deferred_unfilter(decoder, &output_settings, &filtered) == 0;
+               }
+               parallel_inflate = (parallel_inflate || segmented || decoder->suspend != NULL) && deferred;
+               segmented = segmented && deferred;
+               if (!deferred && (decoder->flags & PNG_DECODE_PIPELINE) && decoder->pool != NULL)
+               {
+                  pipelined = start_pipeline(decoder, &pipeline, &output_settings, &image, stage.target != NULL ? &no_colour_transforms : &ct, decoded) == 0;
+                  corrected = pipelined && pipeline.bands != NULL;
+               }
+               // Suspended decodes finish after ct has gone out of scope, so those are corrected at resume
+               if (ct.active != CHRM_DISABLED && stage.target == NULL && !pipelined && decoder->suspend == NULL && png_header.interlace_method == PNG_INTERLACE_NONE)
+               {
+                  output_settings.row_complete = correct_completed_row;
+                  output_settings.row_arg = &ct;
+                  corrected = true;
+               }
+            }
+            chunk_state = READING_IDAT;
 
             log_debug("IDAT - %d bytes", chunk_data_size);
-            memcpy(chunk_buffer, idat_buffer, sizeof(idat_buffer));
-            memcpy(idat_buffer, chunk_data + chunk_data_size - sizeof(idat_buffer), sizeof(idat_buffer));
-
-            bitstream.data = chunk_data - idat_buffer_index;
-            bitstream.size = chunk_data_size + idat_buffer_index;
-            bitstream.byte_index = 0;
-
-            zlib_status = decompress_zlib(&zlib_idat, &bitstream, &image, filter, (void *)&output_settings);
-
-            idat_buffer_index = bitstream.size - bitstream.byte_index;
+            if (parallel_inflate)
+            {
+               while (segments.located < segments.count && segments.file_offsets[segments.located] == chunk_offset)
+               {
+                  segments.entries[segments.located++].offset = compressed_length;
+               }
+               if (append_compressed(decoder, &compressed_length, chunk_data, chunk_data_size) != 0)
+               {
+                  chunk_state = EXIT_CHUNK_PROCESSING;
+               }
+            }
+            else if (pipelined)
+            {
+               zlib_status = inflate_idat(&idat, &zlib_idat, chunk_buffer, chunk_data_size, &image, pipeline_push, (void *)&pipeline);
+            }
+            else if (deferred)
+            {
+               zlib_status = inflate_idat(&idat, &zlib_idat, chunk_buffer, chunk_data_size, &image, collect_filtered, (void *)&filtered);
+            }
+            else
+            {
+               zlib_status = inflate_idat(&idat, &zlib_idat, chunk_buffer, chunk_data_size, &image, filter, (void *)&output_settings);
+            }
          }
          break;
 
@@ -475,33 +2748,43 @@ int load_png(const char *filename, struct image_t *output)
             }
             chr_coords[i] = (float)temp / 100000;
          }
-         ct.rgb_to_xyz_matrix.data[0][0] = chr_coords[2] / chr_coords[3];
-         ct.rgb_to_xyz_matrix.data[0][1] = chr_coords[4] / chr_coords[5];
-         ct.rgb_to_xyz_matrix.data[0][2] = chr_coords[6] / chr_coords[7];
-         ct.rgb_to_xyz_matrix.data[1][0] = 1;
-         ct.rgb_to_xyz_matrix.data[1][1] = 1;
-         ct.rgb_to_xyz_matrix.data[1][2] = 1;
-         ct.rgb_to_xyz_matrix.data[2][0] = (1 - chr_coords[2] - chr_coords[3]) / chr_coords[3];
-         ct.rgb_to_xyz_matrix.data[2][1] = (1 - chr_coords[4] - chr_coords[5]) / chr_coords[5];
-         ct.rgb_to_xyz_matrix.data[2][2] = (1 - chr_coords[6] - chr_coords[7]) / chr_coords[7];
+         struct matrix_3x3_t rgb_to_xyz_matrix;
+         rgb_to_xyz_matrix.data[0][0] = chr_coords[2] / chr_coords[3];
+         rgb_to_xyz_matrix.data[0][1] = chr_coords[4] / chr_coords[5];
+         rgb_to_xyz_matrix.data[0][2] = chr_coords[6] / chr_coords[7];
+         rgb_to_xyz_matrix.data[1][0] = 1;
+         rgb_to_xyz_matrix.data[1][1] = 1;
+         rgb_to_xyz_matrix.data[1][2] = 1;
+         rgb_to_xyz_matrix.data[2][0] = (1 - chr_coords[2] - chr_coords[3]) / chr_coords[3];
+         rgb_to_xyz_matrix.data[2][1] = (1 - chr_coords[4] - chr_coords[5]) / chr_coords[5];
+         rgb_to_xyz_matrix.data[2][2] = (1 - chr_coords[6] - chr_coords[7]) / chr_coords[7];
          struct vector_1x3_t reference_white = {.data = {chr_coords[0] / chr_coords[1], 1, (1 - chr_coords[0] - chr_coords[1]) / chr_coords[1]}};
-         struct matrix_3x3_t temp = inverse_3x3(&ct.rgb_to_xyz_matrix);
+         struct matrix_3x3_t temp = inverse_3x3(&rgb_to_xyz_matrix);
          struct vector_1x3_t scale_factor = transform_1x3(&temp, &reference_white);
-         ct.rgb_to_xyz_matrix.data[0][0] *= scale_factor.data[0];
-         ct.rgb_to_xyz_matrix.data[0][1] *= scale_factor.data[1];
-         ct.rgb_to_xyz_matrix.data[0][2] *= scale_factor.data[2];
-         ct.rgb_to_xyz_matrix.data[1][0] *= scale_factor.data[0];
-         ct.rgb_to_xyz_matrix.data[1][1] *= scale_factor.data[1];
-         ct.rgb_to_xyz_matrix.data[1][2] *= scale_factor.data[2];
-         ct.rgb_to_xyz_matrix.data[2][0] *= scale_factor.data[0];
-         ct.rgb_to_xyz_matrix.data[2][1] *= scale_factor.data[1];
-         ct.rgb_to_xyz_matrix.data[2][2] *= scale_factor.data[2];
-         ct.active |= CHRM_CHROMA;
-
+         rgb_to_xyz_matrix.data[0][0] *= scale_factor.data[0];
+         rgb_to_xyz_matrix.data[0][1] *= scale_factor.data[1];
+         rgb_to_xyz_matrix.data[0][2] *= scale_factor.data[2];
+         rgb_to_xyz_matrix.data[1][0] *= scale_factor.data[0];
+         rgb_to_xyz_matrix.data[1][1] *= scale_factor.data[1];
+         rgb_to_xyz_matrix.data[1][2] *= scale_factor.data[2];
+         rgb_to_xyz_matrix.data[2][0] *= scale_factor.data[0];
+         rgb_to_xyz_matrix.data[2][1] *= scale_factor.data[1];
+         rgb_to_xyz_matrix.data[2][2] *= scale_factor.data[2];
+         if (chroma_matrix_build(&ct.chroma, &rgb_to_xyz_matrix) != 0)
+         {
+            log_error("Invalid cHRM chunk");
+            break;
+         }
          log_debug("Chromaticity matrix:");
-         log_debug("\t%f %f %f", ct.rgb_to_xyz_matrix.data[0][0], ct.rgb_to_xyz_matrix.data[0][1], ct.rgb_to_xyz_matrix.data[0][2]);
-         log_debug("\t%f %f %f", ct.rgb_to_xyz_matrix.data[1][0], ct.rgb_to_xyz_matrix.data[1][1], ct.rgb_to_xyz_matrix.data[1][2]);
-         log_debug("\t%f %f %f", ct.rgb_to_xyz_matrix.data[2][0], ct.rgb_to_xyz_matrix.data[2][1], ct.rgb_to_xyz_matrix.data[2][2]);
+         log_debug("\t%f %f %f", rgb_to_xyz_matrix.data[0][0], rgb_to_xyz_matrix.data[0][1], rgb_to_xyz_matrix.data[0][2]);
+         log_debug("\t%f %f %f", rgb_to_xyz_matrix.data[1][0], rgb_to_xyz_matrix.data[1][1], rgb_to_xyz_matrix.data[1][2]);
+         log_debug("\t%f %f %f", rgb_to_xyz_matrix.data[2][0], rgb_to_xyz_matrix.data[2][1], rgb_to_xyz_matrix.data[2][2]);
+         if (ct.chroma.identity)
+         {
+            log_debug("sRGB primaries, no chroma conversion needed");
+            break;
+         }
+         ct.active |= CHRM_CHROMA;
          break;
       case PNG_gAMA:
          if (chunk_state >= PLTE_PROCESSED) // Overridden by sRGB or iCCP or cICP
@@ -516,20 +2799,78 @@ int load_png(const char *filename, struct image_t *output)
          }
          // Gamma x 100000
          uint32_t gamma = order_png32_t(*(uint32_t *)chunk_data);
-         if (gamma > CHRM_MAX)
+         if (gamma == 0 || gamma > CHRM_MAX)
          {
             log_error("Gamma value out of range");
             break;
          }
-         ct.gamma = (float)gamma / 100000;
+         ct.gamma = find_gamma_table(decoder, gamma, png_header.bit_depth);
+         if (ct.gamma == NULL)
+         {
+            log_error("Failed to allocate gamma table");
+            break;
+         }
          ct.active |= CHRM_GAMMA;
-         log_debug("Gamma: %f", ct.gamma);
+         log_debug("Gamma: %f", (float)gamma / GAMMA_SCALE);
+         break;
+      case PNG_sRGB: // Overridden by iCCP, cICP
+         if (chunk_state >= PLTE_PROCESSED)
+         {
+            log_error("sRGB chunk found at incorrect position");
+            break;
+         }
+         if (chunk_data_size != 1 || chunk_data[0] > SRGB_INTENT_MAX)
+         {
+            log_error("Invalid sRGB chunk");
+            break;
+         }
+         ct.active |= CHRM_SRGB;
+         log_debug("sRGB, rendering intent %u", chunk_data[0]);
+         break;
+      case PNG_cICP:
+         if (chunk_state >= PLTE_PROCESSED)
+         {
+            log_error("cICP chunk found at incorrect position");
+            break;
+         }
+         if (chunk_data_size != 4)
+         {
+            log_error("Invalid cICP chunk");
+            break;
+         }
+         // Other colour spaces cannot be converted, the remaining colour chunks apply instead
+         if (chunk_data[0] != CICP_PRIMARIES_BT709 || chunk_data[1] != CICP_TRANSFER_SRGB || chunk_data[2] != CICP_MATRIX_IDENTITY || chunk_data[3] != 1)
+         {
+            log_warning("cICP colour space %u/%u/%u/%u not supported, ignoring it", chunk_data[0], chunk_data[1], chunk_data[2], chunk_data[3]);
+            break;
+         }
+         ct.active |= CHRM_CICP;
+         break;
+      case PNG_iCCP:
+         if (chunk_state >= PLTE_PROCESSED)
+         {
+            log_error("iCCP chunk found at incorrect position");
+            break;
+         }
+         if ((ct.active & CHRM_ICC) || read_icc_profile(decoder, chunk_data, chunk_data_size, png_header.bit_depth == 16 ? 16 : 8, (png_header.colour_type & 0x02) ? 3 : 1, &ct.icc) != 0)
+         {
+            break;
+         }
+         ct.active |= CHRM_ICC;
+         break;
+      case PNG_bKGD:
+         if (chunk_state >= READING_IDAT)
+         {
+            log_error("bKGD chunk found after IDAT");
+            break;
+         }
+         if (read_background(chunk_data, chunk_data_size, &png_header, &output_settings, bkgd) == 0)
+         {
+            has_bkgd = true;
+            log_debug("bKGD %u %u %u", bkgd[0], bkgd[1], bkgd[2]);
+         }
          break;
       case PNG_sBIT: // if(chunk_state < PLTE_PROCESSED)
-      case PNG_cICP: // if(chunk_state < PLTE_PROCESSED)
-      case PNG_iCCP: // if(chunk_state < PLTE_PROCESSED)    Overridden by cICP
-      case PNG_sRGB: // if(chunk_state < PLTE_PROCESSED)    Overridden by iCCP, cICP
-      case PNG_bKGD: // if(chunk_state == PLTE_PROCESSED)
       case PNG_hIST: // if(chunk_state == PLTE_PROCESSED)
       case PNG_eXIf: // if(chunk_state < READING_IDAT)
       case PNG_pHYs: // if(chunk_state < READING_IDAT)
@@ -547,6 +2888,41 @@ int load_png(const char *filename, struct image_t *output)
       case PNG_IEND:
          log_debug("IEND");
          chunk_state = EXIT_CHUNK_PROCESSING;
+         if (pipelined)
+         {
+            finish_pipeline(&pipeline, zlib_status != ZLIB_COMPLETE);
+            pipelined = false;
+         }
+         struct png_finish_t finish = {
+             .settings = output_settings,
+             .ct = ct,
+             .filtered = filtered,
+             .image = image,
+             .stage = stage,
+             .staging = decoded != output,
+             .deferred = deferred,
+             .segmented = segmented,
+             .interlace_method = png_header.interlace_method,
+             .corrected = corrected};
+         if (finish.staging)
+         {
+            finish.staged = staged;
+         }
+         if (parallel_inflate && decoder->suspend != NULL)
+         {
+            struct png_suspended_t *suspend = decoder->suspend;
+            memset(decoder->compressed + compressed_length, 0, ZLIB_STREAM_PADDING);
+            suspend->finish = finish;
+            suspend->zlib = zlib_idat;
+            suspend->compressed_length = compressed_length;
+            suspend->suspended = true;
+            status = 0;
+            break;
+         }
+         if (parallel_inflate)
+         {
+            zlib_status = inflate_compressed(decoder, compressed_length, segmented ? &segments : NULL, output_settings.subimage.images[0].scanline_size, &zlib_idat, &finish.image, &finish.filtered);
+         }
 
          if (zlib_status != ZLIB_COMPLETE)
          {
@@ -559,53 +2935,23 @@ int load_png(const char *filename, struct image_t *output)
             log_error("No PLTE chunk present for Indexed colour type");
             break;
          }
-
-         if (ct.active & CHRM_CHROMA)
+         status = finish_png(decoder, &finish, output);
+         break;
+      case PNG_iDOT:
+      case PNG_rsIX:
+         if (chunk_state >= READING_IDAT)
          {
-            struct matrix_3x3_t xyz_to_sRGB_matrix = {.data = {{3.2404542, -1.5371385, -0.4985314}, {-0.9692660, 1.8760108, 0.0415560}, {0.0556434, -0.2040259, 1.0572252}}};
-            int stride = output->mode * (output->bit_depth >> 3);
-            switch (output->mode)
-            {
-            case RGB:
-            case RGBA:
-               // TODO: 16 bit support
-               for (uint32_t i = 0; i < output->size; i += stride)
-               {
-                  struct vector_1x3_t temp;
-                  temp.data[0] = (float)output->data[i];
-                  temp.data[1] = (float)output->data[i + 1];
-                  temp.data[2] = (float)output->data[i + 2];
-                  struct vector_1x3_t xyz = transform_1x3(&ct.rgb_to_xyz_matrix, &temp);
-                  struct vector_1x3_t out = transform_1x3(&xyz_to_sRGB_matrix, &xyz);
-                  output->data[i] = (uint8_t)out.data[0];
-                  output->data[i + 1] = (uint8_t)out.data[1];
-                  output->data[i + 2] = (uint8_t)out.data[2];
-               }
-               break;
-            default:
-               log_warning("Non-RGB image, ignoring chroma data");
-               break;
-            }
+            log_error("Restart index chunk %c%c%c%c found after IDAT", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+            break;
          }
-
-         if (ct.active & CHRM_GAMMA)
+         if (chunk_name == PNG_iDOT && segments.count != 0 && segments.name == PNG_rsIX)
          {
-            // TODO: 16 bit support
-            int stride = output->mode * (output->bit_depth >> 3);
-            float inverse_gamma = 1.0 / ct.gamma;
-
-            for (uint32_t i = 0; i < output->size; i += stride)
-            {
-               float temp = ((float)output->data[i]) / 255;
-               output->data[i] = (uint8_t)(powf(temp, inverse_gamma) * 255);
-               if (output->mode == RGB || output->mode == RGBA)
-               {
-                  temp = ((float)output->data[i + 1]) / 255;
-                  output->data[i + 1] = (uint8_t)(powf(temp, inverse_gamma) * 255);
-                  temp = ((float)output->data[i + 2]) / 255;
-                  output->data[i + 2] = (uint8_t)(powf(temp, inverse_gamma) * 255);
-               }
-            }
+            log_debug("iDOT ignored, rsIX already read");
+            break;
+         }
+         if ((chunk_name == PNG_iDOT ? read_idot(chunk_data, chunk_data_size, chunk_offset, png_header.height, &segments) : read_rsix(chunk_data, chunk_data_size, png_header.height, &segments)) == 0)
+         {
+            log_debug("%c%c%c%c - %u segments", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff, segments.count);
          }
          break;
       case PNG_IHDR:
@@ -613,23 +2959,257 @@ int load_png(const char *filename, struct image_t *output)
          chunk_state = EXIT_CHUNK_PROCESSING;
          break;
       default:
-         log_warning("Unrecognised chunk %c%c%c%c", (char)(*(uint32_t *)chunk_buffer & 0xFFFF), (char)((*(uint32_t *)chunk_buffer >> 8) & 0xFFFF), (char)((*(uint32_t *)chunk_buffer >> 16) & 0xFFFF), (char)(*(uint32_t *)chunk_buffer >> 24));
+         log_warning("Unrecognised chunk %c%c%c%c", chunk_name & 0xff, (chunk_name >> 8) & 0xff, (chunk_name >> 16) & 0xff, (chunk_name >> 24) & 0xff);
+         break;
+      }
+
+      // The chunk buffer is reused by the next chunk
+      if (crc_pending && finish_chunk_crc(decoder->pool, &chunk_check) != 0)
+      {
          break;
       }
    }
 
-   fclose(png_ptr);
+   if (pipelined)
+   {
+      finish_pipeline(&pipeline, true);
+   }
 
-   free(chunk_buffer);
-   free(zlib_idat.LZ77_buffer.data);
-   free(scanline_buffers);
-   free(output_settings.palette.buffer);
-   free(output_settings.palette.alpha);
+   if (status != 0)
+   {
+      drop_output(decoder, output);
+   }
 
-   return 0;
+   return status;
+}
+
+// Completes a decode suspended at IEND once its stream has been through decompress_zlib_interleaved
+static int resume_png(struct png_decoder_t *decoder, struct png_suspended_t *suspended, int lane_status, struct image_t *output)
+{
+   int zlib_status = ZLIB_COMPLETE;
+   struct png_finish_t *finish = &suspended->finish;
+   finish->filtered.index = finish->filtered.size;
+   if (lane_status != 0)
+   {
+      log_warning("Interleaved inflate failed, inflating serially");
+      finish->filtered.index = 0;
+      struct stream_ptr_t bitstream = {.data = decoder->compressed, .size = suspended->compressed_length, .byte_index = 0, .bit_index = 0};
+      zlib_status = decompress_zlib(&suspended->zlib, &bitstream, &finish->image, collect_filtered, (void *)&finish->filtered);
+   }
+
+   int status = -1;
+   if (zlib_status != ZLIB_COMPLETE)
+   {
+      log_error("Incomplete zlib stream");
+   }
+   else
+   {
+      status = finish_png(decoder, &suspended->finish, output);
+   }
+
+   if (status != 0)
+   {
+      drop_output(decoder, output);
+   }
+   return status;
 }
 
 void close_png(struct image_t *image)
 {
-   free(image->data);
-}
\ No newline at end of file
+   if (image->external)
+   {
+      image->data = NULL;
+      return;
+   }
+   if (image->decoder != NULL)
+   {
+      release_output(image->decoder, image);
+      return;
+   }
+   if (image->allocator != NULL)
+   {
+      image->allocator->free(image->data, image->allocator->user);
+   }
+   else
+   {
+      free(image->data);
+   }
+   image->data = NULL;
+}
+
+struct png_batch_t
+{
+   struct thread_pool_t *pool;
+   struct png_decoder_t **decoders; // lanes per worker, created on the worker's first item
+   const struct png_allocator_t *allocator;
+   uint64_t split_threshold;
+   uint32_t lanes;
+};
+
+// Consecutive items decoded by one task, their streams are inflated together when there is more than one
+struct png_batch_job_t
+{
+   struct png_batch_t *batch;
+   const struct png_batch_item_t *items;
+   struct png_batch_result_t *results;
+   uint32_t count;
+};
+
+static struct png_decoder_t *batch_decoder(struct png_batch_t *batch, uint32_t index)
+{
+   if (batch->decoders[index] == NULL)
+   {
+      batch->decoders[index] = png_decoder_create(batch->allocator);
+      if (batch->decoders[index] == NULL)
+      {
+         return NULL;
+      }
+      batch->decoders[index]->pool = batch->pool;
+      batch->decoders[index]->split_threshold = batch->split_threshold;
+   }
+   return batch->decoders[index];
+}
+
+static void decode_batch_item(void *arg, uint32_t worker)
+{
+   struct png_batch_job_t *job = (struct png_batch_job_t *)arg;
+   struct png_batch_t *batch = job->batch;
+   struct png_suspended_t suspended[ZLIB_LANES_MAX];
+   struct zlib_lane_t lanes[ZLIB_LANES_MAX];
+   uint32_t lane_count = 0;
+
+   for (uint32_t i = 0; i < job->count; ++i)
+   {
+      struct png_decoder_t *decoder = batch_decoder(batch, worker * batch->lanes + i);
+      struct image_t *image = &job->results[i].image;
+      suspended[i].suspended = false;
+      if (decoder == NULL)
+      {
+         image->data = NULL;
+         image->mode = INVALID;
+         job->results[i].status = -1;
+         continue;
+      }
+
+      decoder->suspend = job->count > 1 ? &suspended[i] : NULL;
+      if (job->items[i].data != NULL)
+      {
+         job->results[i].status = png_decoder_load_memory(decoder, job->items[i].data, job->items[i].size, image);
+      }
+      else
+      {
+         job->results[i].status = png_decoder_load(decoder, job->items[i].filename, image);
+      }
+      decoder->suspend = NULL;
+
+      if (suspended[i].suspended)
+      {
+         lanes[lane_count++] = (struct zlib_lane_t){
+             .data = decoder->compressed,
+             .size = suspended[i].compressed_length,
+             .output = suspended[i].finish.filtered.data,
+             .output_size = suspended[i].finish.filtered.size};
+      }
+   }
+
+   decompress_zlib_interleaved(lanes, lane_count);
+   lane_count = 0;
+   for (uint32_t i = 0; i < job->count; ++i)
+   {
+      struct image_t *image = &job->results[i].image;
+      if (suspended[i].suspended)
+      {
+         job->results[i].status = resume_png(batch->decoders[worker * batch->lanes + i], &suspended[i], lanes[lane_count++].status, image);
+      }
+
+      // Decoders do not outlive the batch, results are freed with the batch allocator
+      detach_output(image, batch->allocator);
+   }
+}
+
+int png_decode_batch(const struct png_batch_item_t *items, uint32_t count, const struct png_batch_options_t *options, struct png_batch_result_t *results)
+{
+   const struct png_batch_options_t defaults = {.thread_count = 0, .split_threshold = 0, .interleave = 0, .allocator = NULL};
+   if (options == NULL)
+   {
+      options = &defaults;
+   }
+
+   for (uint32_t i = 0; i < count; ++i)
+   {
+      results[i].status = -1;
+      results[i].image.data = NULL;
+      results[i].image.decoder = NULL;
+      results[i].image.allocator = NULL;
+      results[i].image.external = 0;
+      results[i].image.mode = INVALID;
+   }
+   if (count == 0)
+   {
+      return 0;
+   }
+
+   struct png_batch_t batch = {
+       .pool = thread_pool_create(options->thread_count),
+       .allocator = options->allocator,
+       .split_threshold = options->split_threshold ? options->split_threshold : PNG_SPLIT_THRESHOLD,
+       .lanes = options->interleave < 1 ? 1 : options->interleave > ZLIB_LANES_MAX ? ZLIB_LANES_MAX : options->interleave};
+   if (batch.pool == NULL)
+   {
+      return -1;
+   }
+
+   uint32_t worker_count = thread_pool_size(batch.pool);
+   uint32_t decoder_count = worker_count * batch.lanes;
+   batch.decoders = calloc(decoder_count, sizeof(*batch.decoders));
+   struct png_batch_job_t *jobs = malloc(count * sizeof(*jobs));
+   if (batch.decoders == NULL || jobs == NULL)
+   {
+      log_error("Failed to allocate batch");
+      free(batch.decoders);
+      free(jobs);
+      thread_pool_destroy(batch.pool);
+      return -1;
+   }
+
+   struct task_group_t group;
+   task_group_init(&group);
+   uint32_t job_count = 0;
+   for (uint32_t i = 0; i < count; i += batch.lanes)
+   {
+      // A group runs as early as its most urgent item
+      struct png_batch_job_t *job = &jobs[job_count++];
+      job->batch = &batch;
+      job->items = &items[i];
+      job->results = &results[i];
+      job->count = count - i < batch.lanes ? count - i : batch.lanes;
+      int32_t priority = items[i].priority;
+      uint64_t deadline = items[i].deadline;
+      for (uint32_t j = 1; j < job->count; ++j)
+      {
+         priority = items[i + j].priority > priority ? items[i + j].priority : priority;
+         deadline = items[i + j].deadline != 0 && (deadline == 0 || items[i + j].deadline < deadline) ? items[i + j].deadline : deadline;
+      }
+      if (thread_pool_submit(batch.pool, &group, decode_batch_item, job, priority, deadline) != 0)
+      {
+         log_error("Failed to queue batch item %u", i);
+      }
+   }
+   thread_pool_wait(batch.pool, &group);
+   thread_pool_destroy(batch.pool);
+
+   for (uint32_t i = 0; i < decoder_count; ++i)
+   {
+      png_decoder_destroy(batch.decoders[i]);
+   }
+   free(batch.decoders);
+   free(jobs);
+
+   int status = 0;
+   for (uint32_t i = 0; i < count && status == 0; ++i)
+   {
+      status = results[i].status;
+   }
+   log_debug("Batch of %u images decoded on %u workers", count, worker_count);
+   return status;
+}
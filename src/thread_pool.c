@@ -0,0 +1,456 @@
+#ifndef __MINGW32__
+#define _POSIX_C_SOURCE 200809L // sysconf
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_POOL_QUEUE_SIZE 64
+
+struct thread_task_t
+{
+   thread_task_fn run;
+   void *arg;
+   struct task_group_t *group;
+   int32_t priority;
+   uint64_t deadline;
+   uint64_t sequence;
+};
+
+// Ring buffer, the owning worker pushes and pops at the back, thieves take from the front
+struct task_deque_t
+{
+   pthread_mutex_t lock;
+   struct thread_task_t *tasks;
+   size_t capacity;
+   size_t head;
+   size_t count;
+};
+
+struct thread_pool_t
+{
+   pthread_t *threads;
+   struct task_deque_t *deques;
+   uint32_t worker_count;
+   uint32_t started;
+
+   pthread_mutex_t lock; // Guards everything below
+   pthread_cond_t wake;  // Broadcast when a task is queued, a group finishes or the pool stops
+   struct thread_task_t *queue; // Binary heap of submitted tasks
+   size_t queue_size;
+   size_t queue_capacity;
+   size_t pending; // Tasks queued anywhere, not yet taken
+   uint64_t sequence;
+   uint8_t stop;
+};
+
+struct worker_args_t
+{
+   struct thread_pool_t *pool;
+   uint32_t index;
+};
+
+static _Thread_local struct thread_pool_t *current_pool = NULL;
+static _Thread_local uint32_t current_worker = 0;
+
+static uint32_t processor_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+   long count = sysconf(_SC_NPROCESSORS_ONLN);
+   return count > 0 ? (uint32_t)count : 1;
+#else
+   return 1;
+#endif
+}
+
+static inline bool runs_before(const struct thread_task_t *a, const struct thread_task_t *b)
+{
+   if (a->priority != b->priority)
+   {
+      return a->priority > b->priority;
+   }
+   uint64_t a_deadline = a->deadline ? a->deadline : UINT64_MAX;
+   uint64_t b_deadline = b->deadline ? b->deadline : UINT64_MAX;
+   if (a_deadline != b_deadline)
+   {
+      return a_deadline < b_deadline;
+   }
+   return a->sequence < b->sequence;
+}
+
+// Caller holds pool->lock
+static int queue_push(struct thread_pool_t *pool, const struct thread_task_t *task)
+{
+   if (pool->queue_size == pool->queue_capacity)
+   {
+      size_t capacity = pool->queue_capacity ? pool->queue_capacity << 1 : THREAD_POOL_QUEUE_SIZE;
+      struct thread_task_t *queue = realloc(pool->queue, capacity * sizeof(*queue));
+      if (queue == NULL)
+      {
+         log_error("Failed to grow thread pool queue");
+         return -1;
+      }
+      pool->queue = queue;
+      pool->queue_capacity = capacity;
+   }
+
+   size_t i = pool->queue_size++;
+   while (i > 0 && runs_before(task, &pool->queue[(i - 1) >> 1]))
+   {
+      pool->queue[i] = pool->queue[(i - 1) >> 1];
+      i = (i - 1) >> 1;
+   }
+   pool->queue[i] = *task;
+   return 0;
+}
+
+// Caller holds pool->lock
+static bool queue_pop(struct thread_pool_t *pool, struct thread_task_t *task)
+{
+   if (pool->queue_size == 0)
+   {
+      return false;
+   }
+   *task = pool->queue[0];
+
+   const struct thread_task_t last = pool->queue[--pool->queue_size];
+   size_t i = 0;
+   for (;;)
+   {
+      size_t child = (i << 1) + 1;
+      if (child >= pool->queue_size)
+      {
+         break;
+      }
+      if (child + 1 < pool->queue_size && runs_before(&pool->queue[child + 1], &pool->queue[child]))
+      {
+         ++child;
+      }
+      if (!runs_before(&pool->queue[child], &last))
+      {
+         break;
+      }
+      pool->queue[i] = pool->queue[child];
+      i = child;
+   }
+   pool->queue[i] = last;
+   return true;
+}
+
+static int deque_push_back(struct task_deque_t *deque, const struct thread_task_t *task)
+{
+   pthread_mutex_lock(&deque->lock);
+   if (deque->count == deque->capacity)
+   {
+      size_t capacity = deque->capacity ? deque->capacity << 1 : THREAD_POOL_QUEUE_SIZE;
+      struct thread_task_t *tasks = malloc(capacity * sizeof(*tasks));
+      if (tasks == NULL)
+      {
+         pthread_mutex_unlock(&deque->lock);
+         log_error("Failed to grow worker deque");
+         return -1;
+      }
+      for (size_t i = 0; i < deque->count; ++i)
+      {
+         tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+      }
+      free(deque->tasks);
+      deque->tasks = tasks;
+      deque->capacity = capacity;
+      deque->head = 0;
+   }
+   deque->tasks[(deque->head + deque->count) % deque->capacity] = *task;
+   ++deque->count;
+   pthread_mutex_unlock(&deque->lock);
+   return 0;
+}
+
+static bool deque_pop_back(struct task_deque_t *deque, struct thread_task_t *task)
+{
+   bool found = false;
+   pthread_mutex_lock(&deque->lock);
+   if (deque->count > 0)
+   {
+      --deque->count;
+      *task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+      found = true;
+   }
+   pthread_mutex_unlock(&deque->lock);
+   return found;
+}
+
+static bool deque_pop_front(struct task_deque_t *deque, struct thread_task_t *task)
+{
+   bool found = false;
+   pthread_mutex_lock(&deque->lock);
+   if (deque->count > 0)
+   {
+      *task = deque->tasks[deque->head];
+      deque->head = (deque->head + 1) % deque->capacity;
+      --deque->count;
+      found = true;
+   }
+   pthread_mutex_unlock(&deque->lock);
+   return found;
+}
+
+// Own deque first for locality, then the shared queue, then steal the oldest task of another worker
+static bool take_task(struct thread_pool_t *pool, uint32_t worker, bool use_queue, struct thread_task_t *task)
+{
+   bool found = deque_pop_back(&pool->deques[worker], task);
+
+   if (!found && use_queue)
+   {
+      pthread_mutex_lock(&pool->lock);
+      found = queue_pop(pool, task);
+      if (found)
+      {
+         --pool->pending;
+      }
+      pthread_mutex_unlock(&pool->lock);
+      if (found)
+      {
+         return true;
+      }
+   }
+
+   for (uint32_t i = 1; !found && i < pool->worker_count; ++i)
+   {
+      found = deque_pop_front(&pool->deques[(worker + i) % pool->worker_count], task);
+   }
+
+   if (found)
+   {
+      pthread_mutex_lock(&pool->lock);
+      --pool->pending;
+      pthread_mutex_unlock(&pool->lock);
+   }
+   return found;
+}
+
+static void run_task(struct thread_pool_t *pool, const struct thread_task_t *task, uint32_t worker)
+{
+   task->run(task->arg, worker);
+
+   if (task->group != NULL && atomic_fetch_sub_explicit(&task->group->pending, 1, memory_order_acq_rel) == 1)
+   {
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_broadcast(&pool->wake);
+      pthread_mutex_unlock(&pool->lock);
+   }
+}
+
+static void *worker_main(void *data)
+{
+   struct worker_args_t *args = (struct worker_args_t *)data;
+   struct thread_pool_t *pool = args->pool;
+   const uint32_t worker = args->index;
+   free(args);
+
+   current_pool = pool;
+   current_worker = worker;
+
+   for (;;)
+   {
+      struct thread_task_t task;
+      if (take_task(pool, worker, true, &task))
+      {
+         run_task(pool, &task, worker);
+         continue;
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      while (pool->pending == 0 && !pool->stop)
+      {
+         pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      bool stop = pool->stop;
+      pthread_mutex_unlock(&pool->lock);
+      if (stop)
+      {
+         break;
+      }
+   }
+   return NULL;
+}
+
+struct thread_pool_t *thread_pool_create(uint32_t worker_count)
+{
+   if (worker_count == 0)
+   {
+      worker_count = processor_count();
+   }
+
+   struct thread_pool_t *pool = calloc(1, sizeof(*pool));
+   if (pool == NULL)
+   {
+      log_error("Failed to allocate thread pool");
+      return NULL;
+   }
+   pool->threads = calloc(worker_count, sizeof(*pool->threads));
+   pool->deques = calloc(worker_count, sizeof(*pool->deques));
+   if (pool->threads == NULL || pool->deques == NULL)
+   {
+      log_error("Failed to allocate thread pool workers");
+      free(pool->threads);
+      free(pool->deques);
+      free(pool);
+      return NULL;
+   }
+   pool->worker_count = worker_count;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->wake, NULL);
+   for (uint32_t i = 0; i < worker_count; ++i)
+   {
+      pthread_mutex_init(&pool->deques[i].lock, NULL);
+   }
+
+   for (uint32_t i = 0; i < worker_count; ++i)
+   {
+      struct worker_args_t *args = malloc(sizeof(*args));
+      if (args == NULL)
+      {
+         break;
+      }
+      args->pool = pool;
+      args->index = i;
+      if (pthread_create(&pool->threads[i], NULL, worker_main, args) != 0)
+      {
+         free(args);
+         break;
+      }
+      ++pool->started;
+   }
+
+   if (pool->started != worker_count)
+   {
+      log_error("Failed to start thread pool, %u of %u workers running", pool->started, worker_count);
+      thread_pool_destroy(pool);
+      return NULL;
+   }
+   log_debug("Thread pool started with %u workers", worker_count);
+   return pool;
+}
+
+void thread_pool_destroy(struct thread_pool_t *pool)
+{
+   if (pool == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->stop = 1;
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (uint32_t i = 0; i < pool->started; ++i)
+   {
+      pthread_join(pool->threads[i], NULL);
+   }
+   for (uint32_t i = 0; i < pool->worker_count; ++i)
+   {
+      pthread_mutex_destroy(&pool->deques[i].lock);
+      free(pool->deques[i].tasks);
+   }
+   pthread_cond_destroy(&pool->wake);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->queue);
+   free(pool->deques);
+   free(pool->threads);
+   free(pool);
+}
+
+uint32_t thread_pool_size(const struct thread_pool_t *pool)
+{
+   return pool->worker_count;
+}
+
+int thread_pool_submit(struct thread_pool_t *pool, struct task_group_t *group, thread_task_fn run, void *arg, int32_t priority, uint64_t deadline)
+{
+   struct thread_task_t task = {.run = run, .arg = arg, .group = group, .priority = priority, .deadline = deadline};
+   if (group != NULL)
+   {
+      atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   task.sequence = pool->sequence++;
+   int status = queue_push(pool, &task);
+   if (status == 0)
+   {
+      ++pool->pending;
+      pthread_cond_broadcast(&pool->wake);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   if (status != 0 && group != NULL)
+   {
+      atomic_fetch_sub_explicit(&group->pending, 1, memory_order_relaxed);
+   }
+   return status;
+}
+
+int thread_pool_spawn(struct thread_pool_t *pool, struct task_group_t *group, thread_task_fn run, void *arg)
+{
+   if (current_pool != pool)
+   {
+      return thread_pool_submit(pool, group, run, arg, 0, 0);
+   }
+
+   struct thread_task_t task = {.run = run, .arg = arg, .group = group};
+   if (group != NULL)
+   {
+      atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+   }
+
+   // Counted before it becomes visible so a thief can never take pending below zero
+   pthread_mutex_lock(&pool->lock);
+   ++pool->pending;
+   pthread_mutex_unlock(&pool->lock);
+
+   if (deque_push_back(&pool->deques[current_worker], &task) != 0)
+   {
+      pthread_mutex_lock(&pool->lock);
+      --pool->pending;
+      pthread_mutex_unlock(&pool->lock);
+      if (group != NULL)
+      {
+         atomic_fetch_sub_explicit(&group->pending, 1, memory_order_relaxed);
+      }
+      return -1;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+   return 0;
+}
+
+void thread_pool_wait(struct thread_pool_t *pool, struct task_group_t *group)
+{
+   // Only spawned work is picked up while helping, a queued image could hold this wait far longer than its own tasks
+   const bool helping = current_pool == pool;
+   while (atomic_load_explicit(&group->pending, memory_order_acquire) != 0)
+   {
+      struct thread_task_t task;
+      if (helping && take_task(pool, current_worker, false, &task))
+      {
+         run_task(pool, &task, current_worker);
+         continue;
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      while (atomic_load_explicit(&group->pending, memory_order_acquire) != 0 && !(helping && pool->pending > pool->queue_size))
+      {
+         pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      pthread_mutex_unlock(&pool->lock);
+   }
+}
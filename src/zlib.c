@@ -1,7 +1,10 @@
 #include "zlib.h"
 #include "logger.h"
 #include "adler32.h"
+#include "thread_pool.h"
+#include "png.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,6 +22,12 @@
 #define DISTANCE_BITS 5
 #define ZLIB_HEADER_SIZE sizeof(struct zlib_header_t)
 #define ZLIB_ADLER32_SIZE sizeof(uint32_t)
+#define ZLIB_WINDOW_MAX 0x8000
+#define ZLIB_MARKER_BASE 256 // Region symbols from here on stand for the byte (symbol - ZLIB_MARKER_BASE + 1) before the region
+#define FIXED_LIT_COUNT 288
+#define FIXED_DIST_COUNT 32
+#define DIST_CODE_COUNT 30
+#define LANE_FAST_BITS 10
 
 enum zlib_header_status_t
 {
@@ -136,7 +145,7 @@ static enum inflate_status_t read_block_header(struct stream_ptr_t *bitstream, s
 
       if ((bitstream->size - bitstream->byte_index) < (sizeof(header->LEN) + sizeof(header->NLEN)))
       {
-         log_error("Incomplete block, cannot load LEN/NLEN");
+         log_debug("Incomplete block, cannot load LEN/NLEN");
          stream_ptr_subtract(bitstream, 3 + unused_bit_len);
          return READ_INCOMPLETE; // Incomplete block, load next chunk to continue
       }
@@ -156,7 +165,7 @@ static enum inflate_status_t read_block_header(struct stream_ptr_t *bitstream, s
    {
       if ((bitstream->size - bitstream->byte_index) < 3)
       {
-         log_error("Incomplete block, cannot load HLIT/HDIST/HCLEN");
+         log_debug("Incomplete block, cannot load HLIT/HDIST/HCLEN");
          stream_ptr_subtract(bitstream, 3);
          return READ_INCOMPLETE;
       }
@@ -182,6 +191,8 @@ static enum inflate_status_t inflate_uncompressed(struct zlib_t *zlib, struct st
 {
    while (zlib->bytes_read < zlib->block_header.LEN && bitstream->byte_index < bitstream->size)
    {
+      zlib->LZ77_buffer.data[zlib->LZ77_buffer.index] = bitstream->data[bitstream->byte_index];
+      increment_ring_buffer(&zlib->LZ77_buffer);
       cb(bitstream->data[bitstream->byte_index], output, output_settings);
       adler32_update(&zlib->adler32, bitstream->data[bitstream->byte_index]);
       ++bitstream->byte_index;
@@ -349,7 +360,7 @@ static void build_huffman_lookup(const uint16_t *input, const uint16_t input_siz
 
    size_t decoder_index = 0;
    size_t lookup_index = 0;
-   while (decoder[decoder_index].bitlength && lookup_index < lookup_size && decoder_index < decoder_size)
+   while (decoder_index < decoder_size && decoder[decoder_index].bitlength && lookup_index < lookup_size)
    {
       for (size_t i = 0; i < input_size; ++i)
       {
@@ -371,7 +382,7 @@ static enum inflate_status_t inflate_dynamic(struct zlib_t *zlib, struct stream_
 
       if (bitstream->byte_index + code_length_size > bitstream->size)
       {
-         log_error("\tIncomplete block, cannot load all code length values");
+         log_debug("\tIncomplete block, cannot load all code length values");
          return READ_INCOMPLETE;
       }
 
@@ -592,9 +603,8 @@ int decompress_zlib(struct zlib_t *zlib, struct stream_ptr_t *bitstream, struct
          log_error("zlib header check failed");
          return ZLIB_BAD_HEADER;
       }
-      log_debug("\tSet LZ77 buffer to %u bytes", 0x0100 << zlib->header.CINFO);
+      log_debug("\tSet LZ77 window to %u bytes", 0x0100 << zlib->header.CINFO);
       uint16_t lz77_size = 0x0100 << zlib->header.CINFO;
-      zlib->LZ77_buffer.data = realloc(zlib->LZ77_buffer.data, lz77_size);
       zlib->LZ77_buffer.mask = lz77_size - 1;
       zlib->bytes_read = 0;
       zlib->state = READING_INFLATE_BLOCK_HEADER;
@@ -605,11 +615,17 @@ int decompress_zlib(struct zlib_t *zlib, struct stream_ptr_t *bitstream, struct
    {
       if (zlib->state == READING_INFLATE_BLOCK_HEADER)
       {
-         if (read_block_header(bitstream, &zlib->block_header) != 0)
+         enum inflate_status_t block_header_result = read_block_header(bitstream, &zlib->block_header);
+         if (block_header_result == READ_INCOMPLETE)
+         {
+            return ZLIB_INCOMPLETE;
+         }
+         if (block_header_result != READ_COMPLETE)
          {
             log_error("deflate header block read failed");
             return ZLIB_BAD_DEFLATE_HEADER;
          }
+         zlib->bytes_read = 0;
          zlib->state = READING_INFLATE_BLOCK_DATA;
       }
 
@@ -645,4 +661,857 @@ int decompress_zlib(struct zlib_t *zlib, struct stream_ptr_t *bitstream, struct
    }
 
    return ZLIB_INCOMPLETE;
-}
\ No newline at end of file
+}
+
+// Speculative inflate works on the whole stream at once, each region writes 16-bit symbols so bytes
+// copied from before its start can be recorded as markers and filled in once the preceding output is known
+// Allocator of one parallel inflate, workers growing their symbol buffers take turns with it
+struct region_memory_t
+{
+   const struct png_allocator_t *allocator; // NULL for the C library
+   pthread_mutex_t lock;
+};
+
+struct inflate_region_t
+{
+   struct region_memory_t *memory;
+   const uint8_t *data;
+   size_t size;
+   size_t begin_bit; // First bit searched for a block start
+   size_t end_bit;   // Decoding stops at the first block starting at or after this bit
+   size_t start_bit; // Block boundary the symbols were decoded from
+   size_t stop_bit;  // Block boundary decoding stopped at
+   uint16_t *symbols;
+   size_t count;
+   size_t capacity;
+   size_t limit; // Bytes the whole stream may inflate to
+   size_t offset;
+   uint8_t *output;
+   union adler32_t adler32;
+   const struct zlib_segment_t *segment; // Restart point the region was decoded from, NULL when guessed
+   uint8_t final;
+   uint8_t used;
+   int status;
+};
+
+struct region_tables_t
+{
+   struct huffman_decoder_t lit_decoder[MAX_HUFFMAN_CODE_BITS];
+   uint16_t lit_lookup[FIXED_LIT_COUNT];
+   struct huffman_decoder_t dist_decoder[MAX_HUFFMAN_CODE_BITS];
+   uint16_t dist_lookup[FIXED_DIST_COUNT];
+};
+
+static inline uint32_t peek_bits(const struct stream_ptr_t *bitstream)
+{
+   return (*(uint32_t *)(bitstream->data + bitstream->byte_index)) >> bitstream->bit_index;
+}
+
+static inline size_t stream_bit(const struct stream_ptr_t *bitstream)
+{
+   return (bitstream->byte_index << 3) + bitstream->bit_index;
+}
+
+// Accepts complete prefix codes, and when allow_single is set the lone one bit code or empty code deflate allows for distances
+static int code_lengths_valid(const uint16_t *lengths, size_t count, uint8_t allow_single)
+{
+   uint32_t length_count[MAX_HUFFMAN_CODE_BITS + 1] = {0};
+   for (size_t i = 0; i < count; ++i)
+   {
+      ++length_count[lengths[i]];
+   }
+   size_t used = count - length_count[0];
+   if (used <= 1)
+   {
+      return allow_single && (used == 0 || length_count[1] == 1);
+   }
+   int32_t left = 1;
+   for (int i = 1; i <= MAX_HUFFMAN_CODE_BITS; ++i)
+   {
+      left = (left << 1) - (int32_t)length_count[i];
+      if (left < 0)
+      {
+         return 0;
+      }
+   }
+   return left == 0;
+}
+
+// Bit patterns a code leaves unassigned fail rather than decode as some other symbol
+static inline int read_region_symbol(struct stream_ptr_t *bitstream, const struct huffman_decoder_t *decoder, const uint16_t *lookup, uint16_t *value)
+{
+   struct huffman_data_t code = huffman_read(bitstream, decoder, lookup);
+   if (decoder[code.index].bitlength == 0)
+   {
+      return -1;
+   }
+   stream_ptr_add(bitstream, decoder[code.index].bitlength);
+   *value = code.value;
+   return 0;
+}
+
+static void build_fixed_tables(struct region_tables_t *tables)
+{
+   uint16_t lengths[FIXED_LIT_COUNT];
+   for (int i = 0; i < FIXED_LIT_COUNT; ++i)
+   {
+      lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+   }
+   build_huffman_lookup(lengths, FIXED_LIT_COUNT, tables->lit_lookup, FIXED_LIT_COUNT, tables->lit_decoder, MAX_HUFFMAN_CODE_BITS);
+   for (int i = 0; i < FIXED_DIST_COUNT; ++i)
+   {
+      lengths[i] = DISTANCE_BITS;
+   }
+   build_huffman_lookup(lengths, FIXED_DIST_COUNT, tables->dist_lookup, FIXED_DIST_COUNT, tables->dist_decoder, MAX_HUFFMAN_CODE_BITS);
+}
+
+// Stricter than inflate_dynamic, code lengths no encoder would write are rejected so false block starts fail early
+static int read_dynamic_tables(struct stream_ptr_t *bitstream, struct region_tables_t *tables)
+{
+   static const uint8_t code_order[HCLEN_MAX] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+   uint32_t input = peek_bits(bitstream);
+   uint16_t hlit = (input & 0x1f) + HLIT_OFFSET;
+   uint16_t hdist = ((input >> 5) & 0x1f) + HDIST_OFFSET;
+   uint8_t hclen = ((input >> 10) & 0x0f) + HCLEN_OFFSET;
+   if (hlit > HLIT_MAX || hdist > DIST_CODE_COUNT)
+   {
+      return -1;
+   }
+   stream_ptr_add(bitstream, 14);
+
+   uint16_t code_length_codes[HCLEN_MAX] = {0};
+   for (int i = 0; i < hclen; ++i)
+   {
+      if (bitstream->byte_index >= bitstream->size)
+      {
+         return -1;
+      }
+      code_length_codes[code_order[i]] = peek_bits(bitstream) & 0x07;
+      stream_ptr_add(bitstream, HCLEN_BITS);
+   }
+   if (!code_lengths_valid(code_length_codes, HCLEN_MAX, 0))
+   {
+      return -1;
+   }
+   struct huffman_decoder_t code_length_decoder[MAX_CODE_LENGTH_BITS];
+   uint16_t code_length_lookup[CODE_LENGTH_MAX];
+   build_huffman_lookup(code_length_codes, HCLEN_MAX, code_length_lookup, CODE_LENGTH_MAX, code_length_decoder, MAX_CODE_LENGTH_BITS);
+
+   uint16_t lengths[HLIT_MAX + HDIST_MAX];
+   uint16_t count = 0;
+   while (count < hlit + hdist)
+   {
+      if (bitstream->byte_index >= bitstream->size)
+      {
+         return -1;
+      }
+      uint16_t value;
+      if (read_region_symbol(bitstream, code_length_decoder, code_length_lookup, &value) != 0)
+      {
+         return -1;
+      }
+      if (value <= 15)
+      {
+         lengths[count++] = value;
+         continue;
+      }
+
+      uint16_t length = 0;
+      uint8_t repeat;
+      input = peek_bits(bitstream);
+      if (value == 16)
+      {
+         if (count == 0)
+         {
+            return -1;
+         }
+         length = lengths[count - 1];
+         repeat = (input & 0x03) + 3;
+         stream_ptr_add(bitstream, 2);
+      }
+      else if (value == 17)
+      {
+         repeat = (input & 0x07) + 3;
+         stream_ptr_add(bitstream, 3);
+      }
+      else
+      {
+         repeat = (input & 0x7f) + 11;
+         stream_ptr_add(bitstream, 7);
+      }
+      if (count + repeat > hlit + hdist)
+      {
+         return -1;
+      }
+      while (repeat--)
+      {
+         lengths[count++] = length;
+      }
+   }
+
+   if (lengths[256] == 0 || !code_lengths_valid(lengths, hlit, 1) || !code_lengths_valid(lengths + hlit, hdist, 1))
+   {
+      return -1;
+   }
+   build_huffman_lookup(lengths, hlit, tables->lit_lookup, FIXED_LIT_COUNT, tables->lit_decoder, MAX_HUFFMAN_CODE_BITS);
+   build_huffman_lookup(lengths + hlit, hdist, tables->dist_lookup, FIXED_DIST_COUNT, tables->dist_decoder, MAX_HUFFMAN_CODE_BITS);
+   return 0;
+}
+
+static int reserve_symbols(struct inflate_region_t *region, size_t count)
+{
+   size_t needed = region->count + count;
+   if (needed > region->limit)
+   {
+      return -1;
+   }
+   if (needed > region->capacity)
+   {
+      size_t capacity = region->capacity ? region->capacity : ZLIB_WINDOW_MAX;
+      while (capacity < needed)
+      {
+         capacity <<= 1;
+      }
+      capacity = capacity < region->limit ? capacity : region->limit;
+      const struct png_allocator_t *allocator = region->memory->allocator;
+      pthread_mutex_lock(&region->memory->lock);
+      uint16_t *symbols = allocator == NULL ? realloc(region->symbols, capacity * sizeof(uint16_t)) : allocator->realloc(region->symbols, capacity * sizeof(uint16_t), allocator->user);
+      pthread_mutex_unlock(&region->memory->lock);
+      if (symbols == NULL)
+      {
+         return -1;
+      }
+      region->symbols = symbols;
+      region->capacity = capacity;
+   }
+   return 0;
+}
+
+static int inflate_region_stored(struct inflate_region_t *region, struct stream_ptr_t *bitstream)
+{
+   stream_ptr_add(bitstream, (-bitstream->bit_index) & 0x07);
+   if (bitstream->size - bitstream->byte_index < sizeof(uint32_t))
+   {
+      return -1;
+   }
+   uint16_t len = *(uint16_t *)(bitstream->data + bitstream->byte_index);
+   uint16_t nlen = *(uint16_t *)(bitstream->data + bitstream->byte_index + sizeof(len));
+   bitstream->byte_index += sizeof(len) + sizeof(nlen);
+   if ((len ^ nlen) != 0xFFFF || bitstream->size - bitstream->byte_index < len || reserve_symbols(region, len) != 0)
+   {
+      return -1;
+   }
+   for (uint16_t i = 0; i < len; ++i)
+   {
+      region->symbols[region->count++] = bitstream->data[bitstream->byte_index++];
+   }
+   return 0;
+}
+
+static int inflate_region_codes(struct inflate_region_t *region, struct stream_ptr_t *bitstream, const struct region_tables_t *tables)
+{
+   while (bitstream->byte_index < bitstream->size)
+   {
+      uint16_t value;
+      if (read_region_symbol(bitstream, tables->lit_decoder, tables->lit_lookup, &value) != 0)
+      {
+         return -1;
+      }
+      if (value < 256)
+      {
+         if (region->count == region->capacity && reserve_symbols(region, 1) != 0)
+         {
+            return -1;
+         }
+         region->symbols[region->count++] = value;
+         continue;
+      }
+      if (value == 256)
+      {
+         return 0;
+      }
+      if (value > 285)
+      {
+         return -1;
+      }
+
+      alphabet_t length = length_alphabet[value - 256];
+      length.value += peek_bits(bitstream) & ((1u << length.extra) - 1);
+      stream_ptr_add(bitstream, length.extra);
+      uint16_t distance_code;
+      if (read_region_symbol(bitstream, tables->dist_decoder, tables->dist_lookup, &distance_code) != 0 || distance_code >= DIST_CODE_COUNT)
+      {
+         return -1;
+      }
+      alphabet_t distance = distance_alphabet[distance_code];
+      distance.value += peek_bits(bitstream) & ((1u << distance.extra) - 1);
+      stream_ptr_add(bitstream, distance.extra);
+      if (reserve_symbols(region, length.value) != 0)
+      {
+         return -1;
+      }
+
+      // Copies may overlap their own output, so go forwards one symbol at a time
+      uint16_t *symbols = region->symbols;
+      size_t position = region->count;
+      for (uint16_t i = 0; i < length.value; ++i, ++position)
+      {
+         symbols[position] = (position >= distance.value) ? symbols[position - distance.value] : ZLIB_MARKER_BASE + (distance.value - position - 1);
+      }
+      region->count = position;
+   }
+   return -1;
+}
+
+// Decodes whole blocks from start_bit until the final block, or the first block starting at or after end_bit
+static int inflate_region(struct inflate_region_t *region, size_t start_bit)
+{
+   struct stream_ptr_t bitstream = {.data = region->data, .size = region->size, .byte_index = start_bit >> 3, .bit_index = start_bit & 0x07};
+   struct region_tables_t tables;
+   region->start_bit = start_bit;
+   region->count = 0;
+   region->final = 0;
+
+   while (!region->final)
+   {
+      size_t bit = stream_bit(&bitstream);
+      if (bit != start_bit && bit >= region->end_bit)
+      {
+         break;
+      }
+      if (bitstream.byte_index >= bitstream.size)
+      {
+         return -1;
+      }
+
+      uint32_t input = peek_bits(&bitstream);
+      uint8_t btype = (input >> 1) & 0x03;
+      region->final = input & 0x01;
+      stream_ptr_add(&bitstream, 3);
+
+      int result = -1;
+      if (btype == 0)
+      {
+         result = inflate_region_stored(region, &bitstream);
+      }
+      else if (btype == 1)
+      {
+         build_fixed_tables(&tables);
+         result = inflate_region_codes(region, &bitstream, &tables);
+      }
+      else if (btype == 2 && read_dynamic_tables(&bitstream, &tables) == 0)
+      {
+         result = inflate_region_codes(region, &bitstream, &tables);
+      }
+      if (result != 0)
+      {
+         return -1;
+      }
+   }
+   region->stop_bit = stream_bit(&bitstream);
+   return 0;
+}
+
+// Tries each bit that could begin a dynamic block, encoders rarely emit fixed or stored blocks in large streams
+static void speculate_region_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct inflate_region_t *region = (struct inflate_region_t *)arg;
+   region->status = -1;
+   for (size_t bit = region->begin_bit; bit < region->end_bit; ++bit)
+   {
+      uint32_t input = (*(uint32_t *)(region->data + (bit >> 3))) >> (bit & 0x07);
+      if (((input >> 1) & 0x03) != 2 || ((input >> 3) & 0x1f) > HLIT_MAX - HLIT_OFFSET || ((input >> 8) & 0x1f) >= DIST_CODE_COUNT)
+      {
+         continue;
+      }
+      if (inflate_region(region, bit) == 0)
+      {
+         region->status = 0;
+         return;
+      }
+   }
+}
+
+// Markers refer to bytes before the region, which must already be in output
+static int resolve_region(struct inflate_region_t *region, size_t from, size_t to)
+{
+   uint8_t *output = region->output + region->offset;
+   for (size_t i = from; i < to; ++i)
+   {
+      uint16_t symbol = region->symbols[i];
+      if (symbol < ZLIB_MARKER_BASE)
+      {
+         output[i] = (uint8_t)symbol;
+         continue;
+      }
+      size_t distance = symbol - ZLIB_MARKER_BASE + 1;
+      if (distance > region->offset)
+      {
+         return -1;
+      }
+      output[i] = *(output - distance);
+   }
+   return 0;
+}
+
+static void resolve_region_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct inflate_region_t *region = (struct inflate_region_t *)arg;
+   size_t head = region->count > ZLIB_WINDOW_MAX ? region->count - ZLIB_WINDOW_MAX : 0;
+   region->status = resolve_region(region, 0, head);
+   adler32_init(&region->adler32);
+   adler32_update_block(&region->adler32, region->output + region->offset, region->count);
+}
+
+// Chains regions from the start of the stream, a region whose guess missed the previous stop is decoded again from there
+static int stitch_regions(struct thread_pool_t *pool, struct inflate_region_t *regions, size_t region_count, size_t output_size)
+{
+   if (regions[0].status != 0)
+   {
+      return -1;
+   }
+
+   struct inflate_region_t *previous = &regions[0];
+   previous->used = 1;
+   size_t offset = previous->count;
+   size_t misses = 0;
+   for (size_t i = 1; i < region_count && !previous->final; ++i)
+   {
+      struct inflate_region_t *region = &regions[i];
+      if (region->status != 0 || region->start_bit != previous->stop_bit)
+      {
+         if (previous->stop_bit >= region->end_bit)
+         {
+            continue; // A block spans the whole region
+         }
+         ++misses;
+         if (inflate_region(region, previous->stop_bit) != 0)
+         {
+            return -1;
+         }
+      }
+      region->used = 1;
+      region->offset = offset;
+      offset += region->count;
+      previous = region;
+      if (region->segment != NULL && region->offset != region->segment->output_offset)
+      {
+         log_debug("Segment %zu starts at byte %zu of the inflated stream, expected %zu", i, region->offset, region->segment->output_offset);
+         return -1;
+      }
+   }
+   if (!previous->final || offset != output_size)
+   {
+      log_debug("Speculative inflate produced %zu of %zu bytes", offset, output_size);
+      return -1;
+   }
+
+   // Region windows are the last 32 KiB before them, so resolving every tail in order leaves the rest independent
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      size_t head = regions[i].count > ZLIB_WINDOW_MAX ? regions[i].count - ZLIB_WINDOW_MAX : 0;
+      if (regions[i].used && resolve_region(&regions[i], head, regions[i].count) != 0)
+      {
+         return -1;
+      }
+   }
+   struct task_group_t group;
+   task_group_init(&group);
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      if (regions[i].used && thread_pool_spawn(pool, &group, resolve_region_task, &regions[i]) != 0)
+      {
+         resolve_region_task(&regions[i], 0);
+      }
+   }
+   thread_pool_wait(pool, &group);
+
+   uint32_t adler32 = ADLER32_CHECKSUM_INIT;
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      if (regions[i].used)
+      {
+         if (regions[i].status != 0)
+         {
+            return -1;
+         }
+         if (regions[i].segment != NULL && regions[i].segment->has_adler32 && regions[i].segment->adler32 != regions[i].adler32.checksum)
+         {
+            log_warning("Adler-32 check failed for segment %zu", i);
+            return -1;
+         }
+         adler32 = adler32_combine(adler32, regions[i].adler32.checksum, regions[i].count);
+      }
+   }
+   size_t adler32_index = (previous->stop_bit + 0x07) >> 3;
+   if (regions[0].size - adler32_index < ZLIB_ADLER32_SIZE || adler32 != order_png32_t(*(uint32_t *)(regions[0].data + adler32_index)))
+   {
+      log_debug("Speculative inflate checksum mismatch");
+      return -1;
+   }
+   log_debug("Inflated %zu bytes in %zu regions, %zu decoded again", output_size, region_count, misses);
+   return 0;
+}
+
+static void inflate_segment_task(void *arg, uint32_t worker)
+{
+   (void)worker;
+   struct inflate_region_t *region = (struct inflate_region_t *)arg;
+   region->status = inflate_region(region, region->begin_bit);
+}
+
+static void release_region_memory(const struct region_memory_t *memory, void *ptr)
+{
+   if (memory->allocator == NULL)
+   {
+      free(ptr);
+   }
+   else
+   {
+      memory->allocator->free(ptr, memory->allocator->user);
+   }
+}
+
+// Region 0 starts after the zlib header and is decoded on the calling thread, task finds the start of the others
+static int inflate_regions(struct thread_pool_t *pool, struct inflate_region_t *regions, size_t region_count, thread_task_fn task, size_t output_size)
+{
+   struct task_group_t group;
+   task_group_init(&group);
+   for (size_t i = 1; i < region_count; ++i)
+   {
+      if (thread_pool_spawn(pool, &group, task, &regions[i]) != 0)
+      {
+         task(&regions[i], 0);
+      }
+   }
+   regions[0].status = inflate_region(&regions[0], regions[0].begin_bit);
+   thread_pool_wait(pool, &group);
+
+   int status = stitch_regions(pool, regions, region_count, output_size);
+   struct region_memory_t *memory = regions[0].memory;
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      release_region_memory(memory, regions[i].symbols);
+   }
+   release_region_memory(memory, regions);
+   pthread_mutex_destroy(&memory->lock);
+   return status;
+}
+
+static struct inflate_region_t *create_regions(struct region_memory_t *memory, const uint8_t *data, size_t size, size_t region_count, uint8_t *output, size_t output_size)
+{
+   const struct png_allocator_t *allocator = memory->allocator;
+   const size_t regions_size = region_count * sizeof(struct inflate_region_t);
+   struct inflate_region_t *regions = allocator == NULL ? malloc(regions_size) : allocator->alloc(regions_size, allocator->user);
+   if (regions == NULL || pthread_mutex_init(&memory->lock, NULL) != 0)
+   {
+      release_region_memory(memory, regions);
+      return NULL;
+   }
+   memset(regions, 0, regions_size);
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      regions[i].memory = memory;
+      regions[i].data = data;
+      regions[i].size = size;
+      regions[i].end_bit = size << 3;
+      regions[i].limit = output_size;
+      regions[i].output = output;
+      regions[i].status = -1;
+   }
+   return regions;
+}
+
+int decompress_zlib_parallel(struct thread_pool_t *pool, const struct png_allocator_t *allocator, const uint8_t *data, size_t size, size_t region_size, uint8_t *output, size_t output_size)
+{
+   struct stream_ptr_t bitstream = {.data = data, .size = size, .byte_index = 0, .bit_index = 0};
+   struct zlib_header_t header;
+   if (zlib_header_check(&bitstream, &header) != ZLIB_HEADER_NO_ERR)
+   {
+      return -1;
+   }
+
+   size_t region_count = size / (region_size ? region_size : ZLIB_REGION_SIZE_DEFAULT);
+   region_count = region_count < thread_pool_size(pool) ? region_count : thread_pool_size(pool);
+   region_count = region_count ? region_count : 1;
+   struct region_memory_t memory = {.allocator = allocator};
+   struct inflate_region_t *regions = create_regions(&memory, data, size, region_count, output, output_size);
+   if (regions == NULL)
+   {
+      return -1;
+   }
+
+   const size_t first_bit = ZLIB_HEADER_SIZE << 3;
+   const size_t bit_count = (size << 3) - first_bit;
+   for (size_t i = 0; i < region_count; ++i)
+   {
+      regions[i].begin_bit = first_bit + bit_count / region_count * i;
+      if (i + 1 < region_count)
+      {
+         regions[i].end_bit = first_bit + bit_count / region_count * (i + 1);
+      }
+   }
+   return inflate_regions(pool, regions, region_count, speculate_region_task, output_size);
+}
+
+int decompress_zlib_segments(struct thread_pool_t *pool, const struct png_allocator_t *allocator, const uint8_t *data, size_t size, const struct zlib_segment_t *segments, size_t segment_count, uint8_t *output, size_t output_size)
+{
+   struct stream_ptr_t bitstream = {.data = data, .size = size, .byte_index = 0, .bit_index = 0};
+   struct zlib_header_t header;
+   if (segment_count == 0 || segments[0].offset != 0 || zlib_header_check(&bitstream, &header) != ZLIB_HEADER_NO_ERR)
+   {
+      return -1;
+   }
+   for (size_t i = 1; i < segment_count; ++i)
+   {
+      if (segments[i].offset <= segments[i - 1].offset || segments[i].offset >= size)
+      {
+         log_debug("Segment %zu has an invalid stream offset", i);
+         return -1;
+      }
+   }
+
+   struct region_memory_t memory = {.allocator = allocator};
+   struct inflate_region_t *regions = create_regions(&memory, data, size, segment_count, output, output_size);
+   if (regions == NULL)
+   {
+      return -1;
+   }
+   regions[0].begin_bit = ZLIB_HEADER_SIZE << 3;
+   for (size_t i = 0; i < segment_count; ++i)
+   {
+      regions[i].segment = &segments[i];
+      if (i > 0)
+      {
+         regions[i].begin_bit = segments[i].offset << 3;
+         regions[i - 1].end_bit = regions[i].begin_bit;
+      }
+   }
+   return inflate_regions(pool, regions, segment_count, inflate_segment_task, output_size);
+}
+
+// Per stream state of an interleaved inflate, output holds the whole stream so matches copy straight from it
+struct lane_state_t
+{
+   struct stream_ptr_t bitstream;
+   struct region_tables_t tables;
+   uint16_t lit_fast[1 << LANE_FAST_BITS]; // Symbol << 4 | code length, 0 for longer codes
+   uint16_t dist_fast[1 << LANE_FAST_BITS];
+   size_t written;
+   uint8_t final;
+   uint8_t in_block;
+};
+
+// Indexed by the next LANE_FAST_BITS stream bits so most symbols take a single lookup, longer codes use huffman_read
+static void build_fast_table(const struct huffman_decoder_t *decoder, const uint16_t *lookup, uint16_t *table)
+{
+   memset(table, 0, sizeof(uint16_t) << LANE_FAST_BITS);
+   uint16_t first = 0;
+   for (int i = 0; i < MAX_HUFFMAN_CODE_BITS && decoder[i].bitlength != 0 && decoder[i].bitlength <= LANE_FAST_BITS; ++i)
+   {
+      const uint8_t bitlength = decoder[i].bitlength;
+      const uint16_t end = decoder[i].threshold - decoder[i].offset;
+      for (uint16_t index = first; index < end; ++index)
+      {
+         // Codes are stored most significant bit first
+         uint16_t code = index + decoder[i].offset;
+         uint16_t reversed = 0;
+         for (uint8_t bit = 0; bit < bitlength; ++bit)
+         {
+            reversed = (reversed << 1) | ((code >> bit) & 0x01);
+         }
+         for (uint16_t fill = reversed; fill < (1 << LANE_FAST_BITS); fill += 1 << bitlength)
+         {
+            table[fill] = (lookup[index] << 4) | bitlength;
+         }
+      }
+      first = end;
+   }
+}
+
+static inline int read_lane_symbol(struct stream_ptr_t *bitstream, const uint16_t *fast, const struct huffman_decoder_t *decoder, const uint16_t *lookup, uint16_t *value)
+{
+   uint16_t entry = fast[peek_bits(bitstream) & ((1 << LANE_FAST_BITS) - 1)];
+   if (entry == 0)
+   {
+      return read_region_symbol(bitstream, decoder, lookup, value);
+   }
+   stream_ptr_add(bitstream, entry & 0x0f);
+   *value = entry >> 4;
+   return 0;
+}
+
+// Stored blocks are copied whole, fixed and dynamic blocks load their tables and are then decoded a symbol at a time
+static int lane_start_block(struct zlib_lane_t *lane, struct lane_state_t *state, const struct region_tables_t *fixed)
+{
+   struct stream_ptr_t *bitstream = &state->bitstream;
+   if (bitstream->byte_index >= bitstream->size)
+   {
+      return -1;
+   }
+   uint32_t input = peek_bits(bitstream);
+   uint8_t btype = (input >> 1) & 0x03;
+   state->final = input & 0x01;
+   stream_ptr_add(bitstream, 3);
+
+   if (btype == 0)
+   {
+      stream_ptr_add(bitstream, (-bitstream->bit_index) & 0x07);
+      if (bitstream->size - bitstream->byte_index < sizeof(uint32_t))
+      {
+         return -1;
+      }
+      uint16_t len = *(uint16_t *)(bitstream->data + bitstream->byte_index);
+      uint16_t nlen = *(uint16_t *)(bitstream->data + bitstream->byte_index + sizeof(len));
+      bitstream->byte_index += sizeof(len) + sizeof(nlen);
+      if ((len ^ nlen) != 0xFFFF || bitstream->size - bitstream->byte_index < len || lane->output_size - state->written < len)
+      {
+         return -1;
+      }
+      memcpy(lane->output + state->written, bitstream->data + bitstream->byte_index, len);
+      bitstream->byte_index += len;
+      state->written += len;
+      return 0;
+   }
+   if (btype == 1)
+   {
+      state->tables = *fixed;
+   }
+   else if (btype != 2 || read_dynamic_tables(bitstream, &state->tables) != 0)
+   {
+      return -1;
+   }
+   build_fast_table(state->tables.lit_decoder, state->tables.lit_lookup, state->lit_fast);
+   build_fast_table(state->tables.dist_decoder, state->tables.dist_lookup, state->dist_fast);
+   state->in_block = 1;
+   return 0;
+}
+
+// Decodes one literal or match, returns 1 at the end of the block
+static inline int lane_step(struct zlib_lane_t *lane, struct lane_state_t *state)
+{
+   struct stream_ptr_t *bitstream = &state->bitstream;
+   uint16_t value;
+   if (bitstream->byte_index >= bitstream->size || read_lane_symbol(bitstream, state->lit_fast, state->tables.lit_decoder, state->tables.lit_lookup, &value) != 0)
+   {
+      return -1;
+   }
+   if (value < 256)
+   {
+      if (state->written == lane->output_size)
+      {
+         return -1;
+      }
+      lane->output[state->written++] = (uint8_t)value;
+      return 0;
+   }
+   if (value == 256)
+   {
+      return 1;
+   }
+   if (value > 285)
+   {
+      return -1;
+   }
+
+   alphabet_t length = length_alphabet[value - 256];
+   length.value += peek_bits(bitstream) & ((1u << length.extra) - 1);
+   stream_ptr_add(bitstream, length.extra);
+   uint16_t distance_code;
+   if (read_lane_symbol(bitstream, state->dist_fast, state->tables.dist_decoder, state->tables.dist_lookup, &distance_code) != 0 || distance_code >= DIST_CODE_COUNT)
+   {
+      return -1;
+   }
+   alphabet_t distance = distance_alphabet[distance_code];
+   distance.value += peek_bits(bitstream) & ((1u << distance.extra) - 1);
+   stream_ptr_add(bitstream, distance.extra);
+   if (distance.value > state->written || length.value > lane->output_size - state->written)
+   {
+      return -1;
+   }
+
+   // Copies may overlap their own output, so go forwards one byte at a time
+   uint8_t *out = lane->output + state->written;
+   const uint8_t *from = out - distance.value;
+   for (uint16_t i = 0; i < length.value; ++i)
+   {
+      out[i] = from[i];
+   }
+   state->written += length.value;
+   return 0;
+}
+
+static int lane_finish(const struct zlib_lane_t *lane, struct lane_state_t *state)
+{
+   struct stream_ptr_t *bitstream = &state->bitstream;
+   stream_ptr_add(bitstream, (-bitstream->bit_index) & 0x07);
+   if (state->written != lane->output_size || bitstream->byte_index > bitstream->size || bitstream->size - bitstream->byte_index < ZLIB_ADLER32_SIZE)
+   {
+      return -1;
+   }
+   union adler32_t adler;
+   adler32_init(&adler);
+   adler32_update_block(&adler, lane->output, lane->output_size);
+   return adler.checksum == order_png32_t(*(uint32_t *)(bitstream->data + bitstream->byte_index)) ? 0 : -1;
+}
+
+void decompress_zlib_interleaved(struct zlib_lane_t *lanes, size_t lane_count)
+{
+   struct region_tables_t fixed;
+   build_fixed_tables(&fixed);
+   struct lane_state_t states[ZLIB_LANES_MAX];
+   size_t active[ZLIB_LANES_MAX];
+   size_t active_count = 0;
+
+   for (size_t i = 0; i < lane_count && i < ZLIB_LANES_MAX; ++i)
+   {
+      struct zlib_header_t header;
+      lanes[i].status = -1;
+      states[i].bitstream = (struct stream_ptr_t){.data = lanes[i].data, .size = lanes[i].size, .byte_index = 0, .bit_index = 0};
+      states[i].written = 0;
+      states[i].final = 0;
+      states[i].in_block = 0;
+      if (zlib_header_check(&states[i].bitstream, &header) == ZLIB_HEADER_NO_ERR)
+      {
+         active[active_count++] = i;
+      }
+   }
+
+   // One step of every active lane per round, their symbol decodes have no dependencies on each other
+   while (active_count > 0)
+   {
+      for (size_t a = 0; a < active_count;)
+      {
+         struct zlib_lane_t *lane = &lanes[active[a]];
+         struct lane_state_t *state = &states[active[a]];
+         int result;
+         if (state->in_block)
+         {
+            result = lane_step(lane, state);
+            if (result == 1)
+            {
+               state->in_block = 0;
+               result = 0;
+            }
+         }
+         else
+         {
+            result = lane_start_block(lane, state, &fixed);
+         }
+
+         if (result == 0 && (state->in_block || !state->final))
+         {
+            ++a;
+            continue;
+         }
+         if (result == 0)
+         {
+            lane->status = lane_finish(lane, state);
+         }
+         active[a] = active[--active_count];
+      }
+   }
+}
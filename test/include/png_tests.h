@@ -0,0 +1,33 @@
+#ifndef _PNGTESTS_
+#define _PNGTESTS_
+
+#include "munit.h"
+#include "png.h"
+#include "logger.h"
+
+MunitResult png_probe_test(const MunitParameter params[], void *data);
+MunitResult png_validate_test(const MunitParameter params[], void *data);
+MunitResult png_decoder_test(const MunitParameter params[], void *data);
+MunitResult png_allocator_test(const MunitParameter params[], void *data);
+MunitResult png_layout_test(const MunitParameter params[], void *data);
+MunitResult png_thread_stress_test(const MunitParameter params[], void *data);
+MunitResult png_batch_test(const MunitParameter params[], void *data);
+MunitResult png_pipeline_test(const MunitParameter params[], void *data);
+MunitResult png_parallel_passes_test(const MunitParameter params[], void *data);
+MunitResult png_parallel_rows_test(const MunitParameter params[], void *data);
+MunitResult png_parallel_inflate_test(const MunitParameter params[], void *data);
+MunitResult png_segments_test(const MunitParameter params[], void *data);
+MunitResult png_async_crc_test(const MunitParameter params[], void *data);
+MunitResult png_row_bands_test(const MunitParameter params[], void *data);
+MunitResult png_gamma_test(const MunitParameter params[], void *data);
+MunitResult png_chroma_test(const MunitParameter params[], void *data);
+MunitResult png_colour_bypass_test(const MunitParameter params[], void *data);
+MunitResult png_icc_test(const MunitParameter params[], void *data);
+MunitResult png_flatten_test(const MunitParameter params[], void *data);
+MunitResult png_format_test(const MunitParameter params[], void *data);
+MunitResult png_planar_test(const MunitParameter params[], void *data);
+MunitResult png_yuv_test(const MunitParameter params[], void *data);
+MunitResult png_native_test(const MunitParameter params[], void *data);
+MunitResult png_projection_test(const MunitParameter params[], void *data);
+
+#endif
@@ -7,6 +7,6 @@ void *load_png_interlaced(const MunitParameter params[], void *user_data);
 void *load_png_no_compression(const MunitParameter params[], void *user_data);
 void *load_png_fixed_compression(const MunitParameter params[], void *user_data);
 void *load_png_dynamic_compression(const MunitParameter params[], void *user_data);
-void close_png(void *fixture);
+void free_png_data(void *fixture);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "test_utils.h"
 #include "zlib_tests.h"
 #include "filter_tests.h"
+#include "png_tests.h"
 
 static char *test_image_path[] = {"test_images/", NULL};
 static char *header_tests[] = {"1 - Unsupported compression method", "2 - Invalid compression method", "3 - Invalid LZ77 window", "4 - PNG cannot use dictionary", "5 - Bad check bits", "6 - Bad DEFLATE type", NULL};
@@ -8,16 +9,41 @@ static MunitParameterEnum test_image_config[] = {{"images", test_image_path}, {N
 static MunitParameterEnum zlib_header_params[] = {{"Bad header test", header_tests}, {NULL, NULL}};
 
 MunitTest png_tests[] = {
-    {"/zlib/uncompressed", zlib_uncompressed_test, load_png_no_compression, close_png, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
-    {"/zlib/compressed_static", zlib_compressed_static_test, load_png_fixed_compression, close_png, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
-    {"/zlib/compressed_dynamic", zlib_compressed_dynamic_test, load_png_dynamic_compression, close_png, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/zlib/uncompressed", zlib_uncompressed_test, load_png_no_compression, free_png_data, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/zlib/compressed_static", zlib_compressed_static_test, load_png_fixed_compression, free_png_data, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/zlib/compressed_dynamic", zlib_compressed_dynamic_test, load_png_dynamic_compression, free_png_data, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/zlib/parallel", zlib_parallel_test, load_png_dynamic_compression, free_png_data, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
     {"/zlib/btype_error", zlib_btype_error_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, zlib_header_params},
     {"/filter/interlacing_setup", interlacing_setup_test, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
-    {"/filter/deinterlacing", deinterlacing_test, load_png_interlaced, close_png, MUNIT_TEST_OPTION_NONE, test_image_config},
+    {"/filter/deinterlacing", deinterlacing_test, load_png_interlaced, free_png_data, MUNIT_TEST_OPTION_NONE, test_image_config},
     {"/filter/type 1", filter_1_test, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
     {"/filter/type 2", filter_2_test, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
     {"/filter/type 3", filter_3_test, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
     {"/filter/type 4", filter_4_test, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/png/probe", png_probe_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/validate", png_validate_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/decoder", png_decoder_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/allocator", png_allocator_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/layout", png_layout_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/thread_stress", png_thread_stress_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/batch", png_batch_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/pipeline", png_pipeline_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/parallel_passes", png_parallel_passes_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/parallel_rows", png_parallel_rows_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/parallel_inflate", png_parallel_inflate_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/segments", png_segments_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/async_crc", png_async_crc_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/row_bands", png_row_bands_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/gamma", png_gamma_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/chroma", png_chroma_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/colour_bypass", png_colour_bypass_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/icc", png_icc_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/flatten", png_flatten_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/format", png_format_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/planar", png_planar_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/yuv", png_yuv_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/native", png_native_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
+    {"/png/projection", png_projection_test, NULL, NULL, MUNIT_TEST_OPTION_SINGLE_ITERATION, test_image_config},
     {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
 
 static const MunitSuite test_suite = {
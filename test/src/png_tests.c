@@ -0,0 +1,2019 @@
+#include "png_tests.h"
+
+#include "adler32.h"
+#include "crc.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define VALIDATE_TEST_IMAGE "png_validate_test.png"
+
+static char *build_image_path(const char *path, const char *filename)
+{
+    size_t path_len = strlen(path);
+    char *buffer = malloc(path_len + strlen(filename) + 2);
+    memcpy(buffer, path, path_len);
+    if (path[path_len - 1] != '/')
+    {
+        buffer[path_len] = '/';
+        ++path_len;
+    }
+    memcpy(buffer + path_len, filename, strlen(filename) + 1);
+    return buffer;
+}
+
+MunitResult png_probe_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    // Image: 32px x 32px, greyscale, bit depth = 2
+    // Chunks: IHDR, gAMA, IDAT (31 bytes at offset 49), IEND
+    char *image_path = build_image_path(params[0].value, "basn0g02.png");
+    const char *chunk_names[] = {"IHDR", "gAMA", "IDAT", "IEND"};
+    const uint8_t probe_flags[] = {PNG_PROBE_DEFAULT, PNG_PROBE_SKIP_IDAT_CRC};
+
+    for (int i = 0; i < 2; ++i)
+    {
+        struct png_info_t info;
+        munit_assert_int(png_probe(image_path, &info, probe_flags[i]), ==, 0);
+
+        munit_assert_uint32(info.width, ==, 32);
+        munit_assert_uint32(info.height, ==, 32);
+        munit_assert_uint8(info.bit_depth, ==, 2);
+        munit_assert_uint8(info.colour_type, ==, 0);
+        munit_assert_uint8(info.interlace_method, ==, 0);
+        munit_assert_uint64(info.idat_size, ==, 31);
+
+        munit_assert_uint32(info.chunk_count, ==, 4);
+        for (uint32_t j = 0; j < info.chunk_count; ++j)
+        {
+            munit_assert_memory_equal(4, &info.chunks[j].name, chunk_names[j]);
+        }
+        munit_assert_long(info.chunks[0].offset, ==, 8);
+        munit_assert_uint32(info.chunks[2].length, ==, 31);
+        munit_assert_long(info.chunks[2].offset, ==, 49);
+
+        close_probe(&info);
+    }
+
+    free(image_path);
+    return MUNIT_OK;
+}
+
+static void write_test_image(const uint8_t *data, size_t size)
+{
+    FILE *file = fopen(VALIDATE_TEST_IMAGE, "wb");
+    munit_assert_not_null(file);
+    munit_assert_size(fwrite(data, size, 1, file), ==, 1);
+    fclose(file);
+}
+
+MunitResult png_validate_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    const char *valid_images[] = {"basn0g02.png", "basn3p08.png"};
+    for (int i = 0; i < 2; ++i)
+    {
+        char *image_path = build_image_path(params[0].value, valid_images[i]);
+        munit_assert_int(png_validate(image_path, PNG_VALIDATE_STRUCTURE), ==, 0);
+        munit_assert_int(png_validate(image_path, PNG_VALIDATE_INFLATE), ==, 0);
+        munit_assert_int(png_validate(image_path, PNG_VALIDATE_UNFILTER), ==, 0);
+        free(image_path);
+    }
+
+    // 1px x 1px greyscale, bit depth = 8, scanline uses filter type 5
+    uint8_t bad_filter[] = {
+        0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x00, 0x00, 0x00, 0x00, 0x3a, 0x7e, 0x9b,
+        0x55, 0x00, 0x00, 0x00, 0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x65, 0x00, 0x00, 0x00,
+        0x0c, 0x00, 0x06, 0x8e, 0x6d, 0x33, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae,
+        0x42, 0x60, 0x82};
+    write_test_image(bad_filter, sizeof(bad_filter));
+    munit_assert_int(png_validate(VALIDATE_TEST_IMAGE, PNG_VALIDATE_INFLATE), ==, 0);
+    munit_assert_int(png_validate(VALIDATE_TEST_IMAGE, PNG_VALIDATE_UNFILTER), ==, -1);
+
+    // Corrupt IDAT CRC
+    bad_filter[54] ^= 0xff;
+    write_test_image(bad_filter, sizeof(bad_filter));
+    munit_assert_int(png_validate(VALIDATE_TEST_IMAGE, PNG_VALIDATE_STRUCTURE), ==, -1);
+
+    // 1px x 2px greyscale, bit depth = 8, image data for one scanline only
+    const uint8_t short_data[] = {
+        0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x08, 0x00, 0x00, 0x00, 0x00, 0xbc, 0xea, 0xe9,
+        0xfb, 0x00, 0x00, 0x00, 0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x60, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0x01, 0x48, 0xaf, 0xa4, 0x71, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae,
+        0x42, 0x60, 0x82};
+    write_test_image(short_data, sizeof(short_data));
+    munit_assert_int(png_validate(VALIDATE_TEST_IMAGE, PNG_VALIDATE_INFLATE), ==, 0);
+    munit_assert_int(png_validate(VALIDATE_TEST_IMAGE, PNG_VALIDATE_UNFILTER), ==, -1);
+
+    remove(VALIDATE_TEST_IMAGE);
+    return MUNIT_OK;
+}
+
+MunitResult png_decoder_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Decoder output matches load_png across images of different formats
+    const char *images[] = {"basn0g02.png", "basn3p08.png", "basn0g02.png"};
+    for (int i = 0; i < 3; ++i)
+    {
+        char *image_path = build_image_path(params[0].value, images[i]);
+        struct image_t expected;
+        struct image_t actual;
+        munit_assert_int(load_png(image_path, &expected), ==, 0);
+        munit_assert_int(png_decoder_load(decoder, image_path, &actual), ==, 0);
+        munit_assert_ptr_equal(actual.decoder, decoder);
+        munit_assert_uint32(actual.size, ==, expected.size);
+        munit_assert_int(actual.mode, ==, expected.mode);
+        munit_assert_memory_equal(actual.size, actual.data, expected.data);
+        close_png(&expected);
+        close_png(&actual);
+        munit_assert_null(actual.data);
+        free(image_path);
+    }
+
+    // Output handed back by close_png is reused by the next decode
+    char *image_path = build_image_path(params[0].value, "basn0g02.png");
+    struct image_t image;
+    munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+    uint8_t *reused = image.data;
+    close_png(&image);
+    munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+    munit_assert_ptr_equal(image.data, reused);
+    close_png(&image);
+    free(image_path);
+
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+// Parallel inflate workers grow their buffers through the allocator
+struct allocation_count_t
+{
+    _Atomic int allocs;
+    _Atomic int frees;
+};
+
+static void *counting_alloc(size_t size, void *user)
+{
+    ++((struct allocation_count_t *)user)->allocs;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size, void *user)
+{
+    if (ptr == NULL)
+    {
+        ++((struct allocation_count_t *)user)->allocs;
+    }
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr, void *user)
+{
+    if (ptr != NULL)
+    {
+        ++((struct allocation_count_t *)user)->frees;
+    }
+    free(ptr);
+}
+
+MunitResult png_allocator_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    char *image_path = build_image_path(params[0].value, "basn3p08.png");
+    struct image_t expected;
+    munit_assert_int(load_png(image_path, &expected), ==, 0);
+
+    // Every allocation made for a decode goes through the allocator and is released
+    struct allocation_count_t count = {0, 0};
+    struct png_allocator_t allocator = {.alloc = counting_alloc, .realloc = counting_realloc, .free = counting_free, .user = &count};
+    struct png_decoder_t *decoder = png_decoder_create(&allocator);
+    struct image_t image;
+    munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+    munit_assert_memory_equal(expected.size, image.data, expected.data);
+    close_png(&image);
+    png_decoder_destroy(decoder);
+    munit_assert_int(count.allocs, >, 0);
+    munit_assert_int(count.allocs, ==, count.frees);
+
+    // Scratch memory of the threaded modes comes from the allocator too
+    const uint32_t threaded_flags[] = {PNG_DECODE_PARALLEL_ROWS, PNG_DECODE_PARALLEL_INFLATE, PNG_DECODE_PIPELINE, PNG_DECODE_ROW_BANDS};
+    for (size_t i = 0; i < sizeof(threaded_flags) / sizeof(threaded_flags[0]); ++i)
+    {
+        count.allocs = 0;
+        count.frees = 0;
+        decoder = png_decoder_create(&allocator);
+        const struct png_decoder_options_t options = {.flags = threaded_flags[i], .thread_count = 2, .split_threshold = 1};
+        munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+        munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+        munit_assert_memory_equal(expected.size, image.data, expected.data);
+        close_png(&image);
+        png_decoder_destroy(decoder);
+        munit_assert_int(count.allocs, ==, count.frees);
+    }
+
+    // The 16-bit gamma table of a decoder is allocated once and kept while the gamma stays the same
+    char *path_16 = build_image_path(params[0].value, "basn2c16.png");
+    struct image_t expected_16;
+    munit_assert_int(load_png(path_16, &expected_16), ==, 0);
+    count.allocs = 0;
+    count.frees = 0;
+    decoder = png_decoder_create(&allocator);
+    int first_allocs = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        munit_assert_int(png_decoder_load(decoder, path_16, &image), ==, 0);
+        munit_assert_memory_equal(expected_16.size, image.data, expected_16.data);
+        close_png(&image);
+        first_allocs = i == 0 ? count.allocs : first_allocs;
+    }
+    munit_assert_int(count.allocs, ==, first_allocs);
+    png_decoder_destroy(decoder);
+    munit_assert_int(count.allocs, ==, count.frees);
+
+    // Images outlive a destroyed decoder, which is freed with the last of them
+    decoder = png_decoder_create(&allocator);
+    struct image_t second;
+    munit_assert_int(png_decoder_load(decoder, path_16, &image), ==, 0);
+    munit_assert_int(png_decoder_load(decoder, path_16, &second), ==, 0);
+    png_decoder_destroy(decoder);
+    munit_assert_int(count.allocs, >, count.frees);
+    munit_assert_memory_equal(expected_16.size, image.data, expected_16.data);
+    close_png(&image);
+    munit_assert_memory_equal(expected_16.size, second.data, expected_16.data);
+    close_png(&second);
+    munit_assert_int(count.allocs, ==, count.frees);
+    close_png(&expected_16);
+    free(path_16);
+
+    // Arena backed decodes are released in one reset
+    struct png_arena_t *arena = png_arena_create(1 << 20, PNG_ARENA_DEFAULT);
+    munit_assert_not_null(arena);
+    allocator = png_arena_allocator(arena);
+    for (int i = 0; i < 2; ++i)
+    {
+        munit_assert_int(load_png_with_allocator(image_path, &image, &allocator), ==, 0);
+        munit_assert_uint32(image.size, ==, expected.size);
+        munit_assert_memory_equal(expected.size, image.data, expected.data);
+        munit_assert_size(png_arena_used(arena), >=, image.size);
+        close_png(&image);
+        png_arena_reset(arena);
+        munit_assert_size(png_arena_used(arena), ==, 0);
+    }
+    png_arena_destroy(arena);
+
+    close_png(&expected);
+    free(image_path);
+    return MUNIT_OK;
+}
+
+MunitResult png_layout_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    // Rows padded to 64 bytes, or to a page, stored bottom-up
+    const char *images[] = {"basn0g02.png", "basn3p08.png"};
+    const uint32_t alignments[] = {64, 4096};
+    for (int i = 0; i < 4; ++i)
+    {
+        char *image_path = build_image_path(params[0].value, images[i % 2]);
+        struct image_t expected;
+        munit_assert_int(load_png(image_path, &expected), ==, 0);
+        munit_assert_uint32(expected.stride * expected.height, ==, expected.size);
+
+        struct png_info_t info;
+        munit_assert_int(png_probe(image_path, &info, PNG_PROBE_SKIP_IDAT_CRC), ==, 0);
+
+        const uint32_t alignment = alignments[i / 2];
+        struct png_layout_t layout = {.row_stride = 0, .row_alignment = alignment, .flags = PNG_LAYOUT_BOTTOM_UP};
+        munit_assert_int(png_plan_layout(&info, &layout), ==, 0);
+        close_probe(&info);
+
+        munit_assert_int(layout.mode, ==, expected.mode);
+        munit_assert_uint32(layout.stride % alignment, ==, 0);
+        munit_assert_uint32(layout.stride, >=, expected.stride);
+        munit_assert_size(layout.size, ==, (size_t)layout.stride * layout.height);
+
+        uint8_t *buffer = malloc(layout.size);
+        memset(buffer, 0xAA, layout.size);
+        struct image_t image;
+        munit_assert_int(load_png_into(image_path, &layout, buffer, layout.size - 1, &image), ==, -1);
+        munit_assert_null(image.data);
+        munit_assert_int(load_png_into(image_path, &layout, buffer, layout.size, &image), ==, 0);
+        munit_assert_ptr_equal(image.data, buffer);
+        munit_assert_uint32(image.stride, ==, layout.stride);
+
+        for (uint32_t y = 0; y < image.height; ++y)
+        {
+            const uint8_t *row = buffer + (size_t)(image.height - 1 - y) * layout.stride;
+            munit_assert_memory_equal(expected.stride, row, expected.data + (size_t)y * expected.stride);
+            for (uint32_t x = expected.stride; x < layout.stride; ++x)
+            {
+                munit_assert_uint8(row[x], ==, 0xAA);
+            }
+        }
+
+        close_png(&image);
+        munit_assert_null(image.data);
+        free(buffer);
+        close_png(&expected);
+        free(image_path);
+    }
+
+    return MUNIT_OK;
+}
+
+#define STRESS_THREAD_COUNT 8
+#define STRESS_ITERATIONS 25
+#define STRESS_IMAGE_COUNT 2
+
+struct stress_args_t
+{
+    char *image_paths[STRESS_IMAGE_COUNT];
+    const struct image_t *expected;
+    int failures;
+};
+
+static void *decode_stress(void *data)
+{
+    struct stress_args_t *args = (struct stress_args_t *)data;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+
+    for (int i = 0; i < STRESS_ITERATIONS; ++i)
+    {
+        log_set_app_name(i & 1 ? "stress odd" : "stress even");
+        for (int j = 0; j < STRESS_IMAGE_COUNT; ++j)
+        {
+            struct image_t image;
+            int status = (i & 1) ? load_png(args->image_paths[j], &image) : png_decoder_load(decoder, args->image_paths[j], &image);
+            if (status != 0 || image.size != args->expected[j].size || memcmp(image.data, args->expected[j].data, image.size) != 0)
+            {
+                ++args->failures;
+            }
+            close_png(&image);
+
+            if (png_validate(args->image_paths[j], PNG_VALIDATE_UNFILTER) != 0)
+            {
+                ++args->failures;
+            }
+        }
+    }
+
+    png_decoder_destroy(decoder);
+    return NULL;
+}
+
+MunitResult png_thread_stress_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    const char *images[STRESS_IMAGE_COUNT] = {"basn0g02.png", "basn3p08.png"};
+    struct image_t expected[STRESS_IMAGE_COUNT];
+    struct stress_args_t args[STRESS_THREAD_COUNT];
+    pthread_t threads[STRESS_THREAD_COUNT];
+
+    for (int j = 0; j < STRESS_IMAGE_COUNT; ++j)
+    {
+        args[0].image_paths[j] = build_image_path(params[0].value, images[j]);
+        munit_assert_int(load_png(args[0].image_paths[j], &expected[j]), ==, 0);
+    }
+
+    for (int i = 0; i < STRESS_THREAD_COUNT; ++i)
+    {
+        args[i] = args[0];
+        args[i].expected = expected;
+        args[i].failures = 0;
+        munit_assert_int(pthread_create(&threads[i], NULL, decode_stress, &args[i]), ==, 0);
+    }
+
+    for (int i = 0; i < STRESS_THREAD_COUNT; ++i)
+    {
+        munit_assert_int(pthread_join(threads[i], NULL), ==, 0);
+        munit_assert_int(args[i].failures, ==, 0);
+    }
+
+    for (int j = 0; j < STRESS_IMAGE_COUNT; ++j)
+    {
+        close_png(&expected[j]);
+        free(args[0].image_paths[j]);
+    }
+    return MUNIT_OK;
+}
+
+#define BATCH_IMAGE_COUNT 5
+
+static uint8_t *read_test_file(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    munit_assert_not_null(fp);
+    fseek(fp, 0L, SEEK_END);
+    *size = (size_t)ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    uint8_t *buffer = malloc(*size);
+    munit_assert_size(fread(buffer, *size, 1, fp), ==, 1);
+    fclose(fp);
+    return buffer;
+}
+
+MunitResult png_batch_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+
+    const char *images[BATCH_IMAGE_COUNT] = {"basn0g02.png", "basn3p08.png", "basi0g01.png", "z00n2c08.png", "z09n2c08.png"};
+    char *image_paths[BATCH_IMAGE_COUNT];
+    uint8_t *file_data[BATCH_IMAGE_COUNT];
+    struct png_batch_item_t items[2 * BATCH_IMAGE_COUNT];
+    struct png_batch_result_t results[2 * BATCH_IMAGE_COUNT];
+
+    // Every image once from file and once from memory, in reverse priority order
+    for (int i = 0; i < BATCH_IMAGE_COUNT; ++i)
+    {
+        size_t size;
+        image_paths[i] = build_image_path(params[0].value, images[i]);
+        file_data[i] = read_test_file(image_paths[i], &size);
+        items[i] = (struct png_batch_item_t){.filename = image_paths[i], .data = NULL, .size = 0, .priority = i, .deadline = 0};
+        items[i + BATCH_IMAGE_COUNT] = (struct png_batch_item_t){.filename = NULL, .data = file_data[i], .size = size, .priority = 0, .deadline = BATCH_IMAGE_COUNT - i};
+    }
+
+    // A one pixel threshold splits post-processing of every image into bands, then streams are inflated three at a time
+    for (uint32_t interleave = 0; interleave <= 3; interleave += 3)
+    {
+        const struct png_batch_options_t options = {.thread_count = 3, .split_threshold = 1, .interleave = interleave, .allocator = NULL};
+        munit_assert_int(png_decode_batch(items, 2 * BATCH_IMAGE_COUNT, &options, results), ==, 0);
+
+        for (int i = 0; i < 2 * BATCH_IMAGE_COUNT; ++i)
+        {
+            struct image_t expected;
+            munit_assert_int(results[i].status, ==, 0);
+            munit_assert_int(load_png(image_paths[i % BATCH_IMAGE_COUNT], &expected), ==, 0);
+            munit_assert_uint32(results[i].image.size, ==, expected.size);
+            munit_assert_int(results[i].image.mode, ==, expected.mode);
+            munit_assert_memory_equal(expected.size, results[i].image.data, expected.data);
+            close_png(&expected);
+            close_png(&results[i].image);
+        }
+    }
+
+    // A truncated buffer fails its own item only, also when it shares an interleaved inflate
+    const struct png_batch_options_t interleaved = {.thread_count = 1, .interleave = 2};
+    items[0].filename = NULL;
+    items[0].data = file_data[0];
+    items[0].size = 40;
+    for (int i = 0; i < 2; ++i)
+    {
+        munit_assert_int(png_decode_batch(items, 2, i ? &interleaved : NULL, results), ==, -1);
+        munit_assert_int(results[0].status, ==, -1);
+        munit_assert_null(results[0].image.data);
+        munit_assert_int(results[1].status, ==, 0);
+        close_png(&results[1].image);
+    }
+
+    // Nothing to decode
+    munit_assert_int(png_decode_batch(items, 0, NULL, NULL), ==, 0);
+
+    for (int i = 0; i < BATCH_IMAGE_COUNT; ++i)
+    {
+        free(image_paths[i]);
+        free(file_data[i]);
+    }
+    return MUNIT_OK;
+}
+
+// Decodes each image twice so the second run reuses the decoder buffers, then once bottom-up into a caller buffer
+static void check_threaded_decode(const char *path, uint32_t flags)
+{
+    const char *images[] = {"basn0g02.png", "basi0g01.png", "basn3p08.png", "z09n2c08.png"};
+    const struct png_decoder_options_t options = {.flags = flags, .thread_count = 2};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i)
+    {
+        char *image_path = build_image_path(path, images[i]);
+        struct image_t expected;
+        struct image_t image;
+        munit_assert_int(load_png(image_path, &expected), ==, 0);
+
+        for (int j = 0; j < 2; ++j)
+        {
+            munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+            munit_assert_uint32(image.size, ==, expected.size);
+            munit_assert_memory_equal(expected.size, image.data, expected.data);
+            close_png(&image);
+        }
+
+        struct png_info_t info;
+        struct png_layout_t layout = {.row_stride = 0, .row_alignment = 16, .flags = PNG_LAYOUT_BOTTOM_UP};
+        munit_assert_int(png_probe(image_path, &info, PNG_PROBE_DEFAULT), ==, 0);
+        munit_assert_int(png_plan_layout(&info, &layout), ==, 0);
+        uint8_t *buffer = malloc(layout.size);
+        munit_assert_int(png_decoder_load_into(decoder, image_path, &layout, buffer, layout.size, &image), ==, 0);
+        for (uint32_t y = 0; y < expected.height; ++y)
+        {
+            munit_assert_memory_equal(expected.stride, buffer + (size_t)(expected.height - 1 - y) * layout.stride, expected.data + (size_t)y * expected.stride);
+        }
+        close_png(&image);
+        free(buffer);
+        close_probe(&info);
+
+        close_png(&expected);
+        free(image_path);
+    }
+
+    png_decoder_destroy(decoder);
+}
+
+MunitResult png_pipeline_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    check_threaded_decode(params[0].value, PNG_DECODE_PIPELINE);
+    return MUNIT_OK;
+}
+
+MunitResult png_parallel_passes_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_PASSES);
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_PASSES | PNG_DECODE_PIPELINE);
+    return MUNIT_OK;
+}
+
+MunitResult png_parallel_rows_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_ROWS);
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_ROWS | PNG_DECODE_PARALLEL_PASSES);
+    return MUNIT_OK;
+}
+
+MunitResult png_parallel_inflate_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_INFLATE);
+    check_threaded_decode(params[0].value, PNG_DECODE_PARALLEL_INFLATE | PNG_DECODE_PARALLEL_ROWS | PNG_DECODE_PARALLEL_PASSES);
+    return MUNIT_OK;
+}
+
+#define SEGMENT_WIDTH 8
+#define SEGMENT_ROWS 4
+#define SEGMENT_COUNT 3
+#define SEGMENT_SCANLINE (SEGMENT_WIDTH + 1)
+#define SEGMENT_BYTES (SEGMENT_ROWS * SEGMENT_SCANLINE)
+#define SEGMENT_PNG_MAX 1024
+
+enum segment_index_t
+{
+    SEGMENT_INDEX_RSIX,
+    SEGMENT_INDEX_IDOT,
+    SEGMENT_INDEX_RSIX_BAD_ADLER
+};
+
+static void put_u32(uint8_t *dst, uint32_t value)
+{
+    dst[0] = (uint8_t)(value >> 24);
+    dst[1] = (uint8_t)(value >> 16);
+    dst[2] = (uint8_t)(value >> 8);
+    dst[3] = (uint8_t)value;
+}
+
+static size_t put_chunk(uint8_t *png, size_t offset, const char *name, const uint8_t *body, uint32_t size)
+{
+    put_u32(png + offset, size);
+    memcpy(png + offset + 4, name, 4);
+    if (size != 0)
+    {
+        memcpy(png + offset + 8, body, size);
+    }
+    put_u32(png + offset + 8 + size, compute_crc(png + offset + 4, (int)size + 4));
+    return offset + size + 12;
+}
+
+#define STORED_BLOCK_MAX 0xffff
+
+// zlib stream of stored deflate blocks holding at most block_size bytes each, returns its size
+static size_t put_stored_zlib(uint8_t *stream, const uint8_t *data, size_t size, uint32_t block_size)
+{
+    size_t offset = 0;
+    stream[offset++] = 0x78;
+    stream[offset++] = 0x01;
+    for (size_t start = 0; start == 0 || start < size; start += block_size)
+    {
+        const uint16_t length = (uint16_t)(size - start < block_size ? size - start : block_size);
+        stream[offset++] = start + length == size ? 0x01 : 0x00;
+        stream[offset++] = (uint8_t)length;
+        stream[offset++] = (uint8_t)(length >> 8);
+        stream[offset++] = (uint8_t)~length;
+        stream[offset++] = (uint8_t)(~length >> 8);
+        memcpy(stream + offset, data + start, length);
+        offset += length;
+    }
+    union adler32_t adler;
+    adler32_init(&adler);
+    adler32_update_block(&adler, data, size);
+    put_u32(stream + offset, adler.checksum);
+    return offset + 4;
+}
+
+// Already filtered scanlines in stored deflate blocks, ancillary chunks built with put_chunk go before IDAT
+// Blocks of idat_block_size bytes get an IDAT chunk each, 0 puts blocks of STORED_BLOCK_MAX in one IDAT
+static size_t build_png(uint8_t *png, uint32_t width, uint32_t height, uint8_t bit_depth, uint8_t colour_type, const uint8_t *chunks, size_t chunks_size, const uint8_t *filtered, size_t filtered_size, uint32_t idat_block_size)
+{
+    const uint32_t block_size = idat_block_size != 0 ? idat_block_size : STORED_BLOCK_MAX;
+    const size_t block_count = filtered_size != 0 ? (filtered_size + block_size - 1) / block_size : 1;
+    uint8_t *stream = malloc(2 + block_count * 5 + filtered_size + 4);
+    munit_assert_not_null(stream);
+    const size_t stream_size = put_stored_zlib(stream, filtered, filtered_size, block_size);
+
+    const uint8_t signature[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+    uint8_t header[13] = {0};
+    put_u32(header, width);
+    put_u32(header + 4, height);
+    header[8] = bit_depth;
+    header[9] = colour_type;
+    memcpy(png, signature, sizeof(signature));
+    size_t offset = put_chunk(png, sizeof(signature), "IHDR", header, sizeof(header));
+    if (chunks_size != 0)
+    {
+        memcpy(png + offset, chunks, chunks_size);
+        offset += chunks_size;
+    }
+    // The zlib header stays with the first block and the Adler-32 with the last
+    for (size_t i = 0, start = 0; i < (idat_block_size != 0 ? block_count : 1); ++i)
+    {
+        const size_t end = idat_block_size != 0 && i + 1 < block_count ? 2 + (i + 1) * (5 + (size_t)block_size) : stream_size;
+        offset = put_chunk(png, offset, "IDAT", stream + start, (uint32_t)(end - start));
+        start = end;
+    }
+    free(stream);
+    return put_chunk(png, offset, "IEND", NULL, 0);
+}
+
+// 8x12 greyscale rows and the index chunk of one stored deflate block and one IDAT per four row segment
+static size_t build_segment_index(uint8_t *chunks, enum segment_index_t index, uint8_t *filtered)
+{
+    for (uint32_t y = 0; y < SEGMENT_ROWS * SEGMENT_COUNT; ++y)
+    {
+        filtered[y * SEGMENT_SCANLINE] = (uint8_t)(y % 3);
+        for (uint32_t x = 0; x < SEGMENT_WIDTH; ++x)
+        {
+            filtered[y * SEGMENT_SCANLINE + 1 + x] = (uint8_t)(x * 13 + y * 7);
+        }
+    }
+
+    // Stream bytes in each IDAT, the first also holds the zlib header and the last the Adler-32
+    uint32_t stream_sizes[SEGMENT_COUNT];
+    uint32_t stream_offsets[SEGMENT_COUNT];
+    uint32_t segment_adler[SEGMENT_COUNT];
+    uint32_t stream_offset = 0;
+    for (uint32_t i = 0; i < SEGMENT_COUNT; ++i)
+    {
+        union adler32_t segment_check;
+        adler32_init(&segment_check);
+        adler32_update_block(&segment_check, filtered + i * SEGMENT_BYTES, SEGMENT_BYTES);
+        segment_adler[i] = segment_check.checksum;
+        stream_sizes[i] = 5 + SEGMENT_BYTES + (i == 0 ? 2 : 0) + (i == SEGMENT_COUNT - 1 ? 4 : 0);
+        stream_offsets[i] = stream_offset;
+        stream_offset += stream_sizes[i];
+    }
+    if (index == SEGMENT_INDEX_RSIX_BAD_ADLER)
+    {
+        segment_adler[1] ^= 1;
+    }
+
+    uint8_t body[4 + SEGMENT_COUNT * 12];
+    if (index == SEGMENT_INDEX_IDOT)
+    {
+        // Entries locate the IDAT chunk starting each segment after the first, relative to the iDOT chunk
+        const uint32_t body_size = 16 + (SEGMENT_COUNT - 1) * 12;
+        uint32_t chunk_offset = body_size + 12;
+        put_u32(body, SEGMENT_COUNT);
+        put_u32(body + 4, 0);
+        put_u32(body + 8, SEGMENT_ROWS);
+        put_u32(body + 12, body_size);
+        for (uint32_t i = 1; i < SEGMENT_COUNT; ++i)
+        {
+            chunk_offset += stream_sizes[i - 1] + 12;
+            put_u32(body + 4 + i * 12, i * SEGMENT_ROWS);
+            put_u32(body + 8 + i * 12, SEGMENT_ROWS);
+            put_u32(body + 12 + i * 12, chunk_offset);
+        }
+        return put_chunk(chunks, 0, "iDOT", body, body_size);
+    }
+    put_u32(body, SEGMENT_COUNT);
+    for (uint32_t i = 0; i < SEGMENT_COUNT; ++i)
+    {
+        put_u32(body + 4 + i * 12, i * SEGMENT_ROWS);
+        put_u32(body + 8 + i * 12, stream_offsets[i]);
+        put_u32(body + 12 + i * 12, segment_adler[i]);
+    }
+    return put_chunk(chunks, 0, "rsIX", body, sizeof(body));
+}
+
+MunitResult png_segments_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    const struct png_decoder_options_t options = {.flags = PNG_DECODE_SEGMENTS, .thread_count = 2};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    const enum segment_index_t indexes[] = {SEGMENT_INDEX_RSIX, SEGMENT_INDEX_IDOT, SEGMENT_INDEX_RSIX_BAD_ADLER};
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); ++i)
+    {
+        uint8_t png[SEGMENT_PNG_MAX];
+        uint8_t filtered[SEGMENT_BYTES * SEGMENT_COUNT];
+        uint8_t chunks[12 + 4 + SEGMENT_COUNT * 12];
+        const size_t chunks_size = build_segment_index(chunks, indexes[i], filtered);
+        size_t size = build_png(png, SEGMENT_WIDTH, SEGMENT_ROWS * SEGMENT_COUNT, 8, 0, chunks, chunks_size, filtered, sizeof(filtered), SEGMENT_BYTES);
+
+        // None, Sub and Up rows only, unfiltered by hand
+        uint8_t expected[SEGMENT_WIDTH * SEGMENT_ROWS * SEGMENT_COUNT];
+        for (uint32_t y = 0; y < SEGMENT_ROWS * SEGMENT_COUNT; ++y)
+        {
+            const uint8_t *row = filtered + y * SEGMENT_SCANLINE;
+            for (uint32_t x = 0; x < SEGMENT_WIDTH; ++x)
+            {
+                uint8_t value = row[1 + x];
+                if (row[0] == 1 && x > 0)
+                {
+                    value += expected[y * SEGMENT_WIDTH + x - 1];
+                }
+                else if (row[0] == 2 && y > 0)
+                {
+                    value += expected[(y - 1) * SEGMENT_WIDTH + x];
+                }
+                expected[y * SEGMENT_WIDTH + x] = value;
+            }
+        }
+
+        struct image_t image;
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        munit_assert_uint32(image.size, ==, sizeof(expected));
+        munit_assert_memory_equal(sizeof(expected), image.data, expected);
+        close_png(&image);
+    }
+
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+#define CRC_TEST_WIDTH 512
+#define CRC_TEST_HEIGHT 512
+#define CRC_TEST_FILTERED (CRC_TEST_HEIGHT * (CRC_TEST_WIDTH + 1))
+
+// Greyscale image with unfiltered rows in stored deflate blocks, all in one IDAT chunk
+static uint8_t *build_stored_png(size_t *size, uint8_t *pixels)
+{
+    static uint8_t filtered[CRC_TEST_FILTERED];
+    for (uint32_t y = 0; y < CRC_TEST_HEIGHT; ++y)
+    {
+        filtered[y * (CRC_TEST_WIDTH + 1)] = 0;
+        for (uint32_t x = 0; x < CRC_TEST_WIDTH; ++x)
+        {
+            pixels[y * CRC_TEST_WIDTH + x] = (uint8_t)(x * 3 + y * 5);
+            filtered[y * (CRC_TEST_WIDTH + 1) + 1 + x] = pixels[y * CRC_TEST_WIDTH + x];
+        }
+    }
+    uint8_t *png = malloc(CRC_TEST_FILTERED + (CRC_TEST_FILTERED / STORED_BLOCK_MAX + 1) * 5 + 128);
+    munit_assert_not_null(png);
+    *size = build_png(png, CRC_TEST_WIDTH, CRC_TEST_HEIGHT, 8, 0, NULL, 0, filtered, CRC_TEST_FILTERED, 0);
+    return png;
+}
+
+MunitResult png_async_crc_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    const struct png_decoder_options_t options = {.flags = PNG_DECODE_ASYNC_CRC, .thread_count = 2};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    size_t size;
+    uint8_t *expected = malloc(CRC_TEST_WIDTH * CRC_TEST_HEIGHT);
+    munit_assert_not_null(expected);
+    uint8_t *png = build_stored_png(&size, expected);
+
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    munit_assert_uint32(image.size, ==, CRC_TEST_WIDTH * CRC_TEST_HEIGHT);
+    munit_assert_memory_equal(image.size, image.data, expected);
+    close_png(&image);
+
+    // The stream still inflates, only the IDAT CRC is wrong
+    png[size - 13] ^= 0x01;
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), !=, 0);
+    munit_assert_null(image.data);
+
+    free(png);
+    free(expected);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+MunitResult png_row_bands_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    const char *images[] = {"basn2c08.png", "basn6a08.png", "basn0g08.png"};
+    const struct png_decoder_options_t options = {.flags = PNG_DECODE_ROW_BANDS, .thread_count = 2, .split_threshold = 1};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i)
+    {
+        char *image_path = build_image_path(params[0].value, images[i]);
+        struct image_t expected;
+        struct image_t image;
+        munit_assert_int(load_png(image_path, &expected), ==, 0);
+        munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+        munit_assert_uint32(image.size, ==, expected.size);
+        munit_assert_memory_equal(expected.size, image.data, expected.data);
+        close_png(&image);
+        close_png(&expected);
+        free(image_path);
+    }
+
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+MunitResult png_gamma_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    // Gamma 1 / 4.4, re-encoded for an sRGB display samples are close to squared
+    const uint32_t gamma = 22727;
+    const double exponent = 45455.0 / gamma;
+    uint8_t gama[4];
+    put_u32(gama, gamma);
+    uint8_t chunks[16];
+    const size_t chunks_size = put_chunk(chunks, 0, "gAMA", gama, sizeof(gama));
+    uint8_t png[SEGMENT_PNG_MAX * 2];
+    struct image_t image;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // 16-bit greyscale alpha, one row of four pixels
+    const uint16_t samples[4] = {0x0000, 0x4000, 0x8000, 0xffff};
+    uint8_t filtered[1 + 4 * 4] = {0};
+    for (int i = 0; i < 4; ++i)
+    {
+        filtered[1 + i * 4] = (uint8_t)(samples[i] >> 8);
+        filtered[2 + i * 4] = (uint8_t)samples[i];
+        filtered[3 + i * 4] = 0x12;
+        filtered[4 + i * 4] = 0x34;
+    }
+    size_t size = build_png(png, 4, 1, 16, 4, chunks, chunks_size, filtered, sizeof(filtered), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    munit_assert_int(image.bit_depth, ==, 16);
+    for (int i = 0; i < 4; ++i)
+    {
+        const uint16_t expected = (uint16_t)(pow(samples[i] / 65535.0, exponent) * 65535.0 + 0.5);
+        munit_assert_uint16((uint16_t)((image.data[i * 4] << 8) | image.data[i * 4 + 1]), ==, expected);
+        munit_assert_uint8(image.data[i * 4 + 2], ==, 0x12);
+        munit_assert_uint8(image.data[i * 4 + 3], ==, 0x34);
+    }
+    close_png(&image);
+
+    // 8-bit RGBA, alpha is left linear
+    const uint8_t rgba[8] = {0, 64, 128, 200, 255, 16, 32, 7};
+    uint8_t filtered_8[1 + sizeof(rgba)] = {0};
+    memcpy(filtered_8 + 1, rgba, sizeof(rgba));
+    size = build_png(png, 2, 1, 8, 6, chunks, chunks_size, filtered_8, sizeof(filtered_8), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    for (int i = 0; i < 8; ++i)
+    {
+        const uint8_t expected = (i % 4 == 3) ? rgba[i] : (uint8_t)(pow(rgba[i] / 255.0, exponent) * 255.0 + 0.5);
+        munit_assert_uint8(image.data[i], ==, expected);
+    }
+    close_png(&image);
+
+    // Every gamma lands in the same sRGB encoded output, so close gammas give close samples and linear data is encoded
+    const uint32_t gammas[4] = {45455, 47700, 47800, 100000};
+    const uint8_t rgb[1 + 3] = {0, 64, 128, 192};
+    uint8_t outputs[4][3];
+    for (int i = 0; i < 4; ++i)
+    {
+        put_u32(gama, gammas[i]);
+        const size_t gamma_size = put_chunk(chunks, 0, "gAMA", gama, sizeof(gama));
+        size = build_png(png, 1, 1, 8, 2, chunks, gamma_size, rgb, sizeof(rgb), 0);
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        memcpy(outputs[i], image.data, 3);
+        close_png(&image);
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        munit_assert_uint8(outputs[0][c], ==, rgb[1 + c]);
+        munit_assert_int(abs(outputs[1][c] - outputs[2][c]), <=, 2);
+        const uint8_t linear = (uint8_t)(pow(rgb[1 + c] / 255.0, 0.45455) * 255.0 + 0.5);
+        munit_assert_int(abs(outputs[3][c] - linear), <=, 1);
+    }
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+MunitResult png_chroma_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    // Adobe RGB primaries with the sRGB white point, greys keep their value and pure green is out of the sRGB gamut
+    const uint32_t coordinates[8] = {31270, 32900, 64000, 33000, 21000, 71000, 15000, 6000};
+    uint8_t chrm[32];
+    for (int i = 0; i < 8; ++i)
+    {
+        put_u32(chrm + i * 4, coordinates[i]);
+    }
+    uint8_t chunks[48];
+    const size_t chunks_size = put_chunk(chunks, 0, "cHRM", chrm, sizeof(chrm));
+    uint8_t png[SEGMENT_PNG_MAX * 2];
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Wide enough for one block of the vector path plus a scalar tail, odd pixels are grey
+    enum { width = 21 };
+    uint8_t rgba[1 + width * 4] = {0};
+    uint8_t rgb[1 + width * 3] = {0};
+    for (uint32_t x = 0; x < width; ++x)
+    {
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            rgba[1 + x * 4 + c] = rgb[1 + x * 3 + c] = (x & 1) ? (uint8_t)(x * 12) : (uint8_t)(x * 37 + c * 91);
+        }
+        rgba[1 + x * 4 + 3] = (uint8_t)(255 - x);
+    }
+    rgba[1] = rgba[3] = rgb[1] = rgb[3] = 0;
+    rgba[2] = rgb[2] = 255;
+
+    struct image_t image_rgba, image_rgb;
+    size_t size = build_png(png, width, 1, 8, 6, chunks, chunks_size, rgba, sizeof(rgba), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image_rgba), ==, 0);
+    size = build_png(png, width, 1, 8, 2, chunks, chunks_size, rgb, sizeof(rgb), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image_rgb), ==, 0);
+    for (uint32_t x = 0; x < width; ++x)
+    {
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            munit_assert_uint8(image_rgba.data[x * 4 + c], ==, image_rgb.data[x * 3 + c]);
+            if (x & 1)
+            {
+                munit_assert_int(abs(image_rgb.data[x * 3 + c] - rgb[1 + x * 3 + c]), <=, 1);
+            }
+        }
+        munit_assert_uint8(image_rgba.data[x * 4 + 3], ==, rgba[1 + x * 4 + 3]);
+    }
+    // Saturated rather than wrapped
+    munit_assert_uint8(image_rgb.data[0], ==, 0);
+    munit_assert_uint8(image_rgb.data[1], ==, 255);
+    munit_assert_uint8(image_rgb.data[2], ==, 0);
+    close_png(&image_rgba);
+    close_png(&image_rgb);
+
+    // 16-bit greys keep their precision
+    uint8_t rgb_16[1 + 4 * 6] = {0};
+    for (int x = 0; x < 4; ++x)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            rgb_16[1 + x * 6 + c * 2] = (uint8_t)(x * 67);
+            rgb_16[2 + x * 6 + c * 2] = (uint8_t)(x * 29);
+        }
+    }
+    size = build_png(png, 4, 1, 16, 2, chunks, chunks_size, rgb_16, sizeof(rgb_16), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image_rgb), ==, 0);
+    for (int i = 0; i < 4 * 3; ++i)
+    {
+        const int expected = (rgb_16[1 + i * 2] << 8) | rgb_16[2 + i * 2];
+        const int decoded = (image_rgb.data[i * 2] << 8) | image_rgb.data[i * 2 + 1];
+        munit_assert_int(abs(decoded - expected), <=, 32);
+    }
+    close_png(&image_rgb);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+MunitResult png_colour_bypass_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    uint8_t gama[4];
+    put_u32(gama, 50000);
+    const uint8_t srgb[1] = {0};
+    const uint8_t cicp[4] = {1, 13, 0, 1};
+    uint8_t gama_srgb[4];
+    put_u32(gama_srgb, 45455);
+    const uint32_t coordinates[8] = {31270, 32900, 64000, 33000, 30000, 60000, 15000, 6000};
+    uint8_t chrm_srgb[32];
+    for (int i = 0; i < 8; ++i)
+    {
+        put_u32(chrm_srgb + i * 4, coordinates[i]);
+    }
+
+    // Each of these leaves the samples as they are, even with a gAMA chunk that would otherwise apply
+    uint8_t chunks[4][96];
+    size_t chunks_sizes[4];
+    chunks_sizes[0] = put_chunk(chunks[0], put_chunk(chunks[0], 0, "gAMA", gama, sizeof(gama)), "sRGB", srgb, sizeof(srgb));
+    chunks_sizes[1] = put_chunk(chunks[1], put_chunk(chunks[1], 0, "cICP", cicp, sizeof(cicp)), "gAMA", gama, sizeof(gama));
+    chunks_sizes[2] = put_chunk(chunks[2], put_chunk(chunks[2], 0, "gAMA", gama_srgb, sizeof(gama_srgb)), "cHRM", chrm_srgb, sizeof(chrm_srgb));
+    chunks_sizes[3] = put_chunk(chunks[3], 0, "gAMA", gama_srgb, sizeof(gama_srgb));
+
+    uint8_t filtered[1 + 3 * 3] = {0, 10, 100, 200, 30, 60, 90, 255, 128, 1};
+    uint8_t png[SEGMENT_PNG_MAX];
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    for (int i = 0; i < 4; ++i)
+    {
+        struct image_t image;
+        size_t size = build_png(png, 3, 1, 8, 2, chunks[i], chunks_sizes[i], filtered, sizeof(filtered), 0);
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        munit_assert_memory_equal(sizeof(filtered) - 1, image.data, filtered + 1);
+        close_png(&image);
+    }
+
+    // An unsupported cICP, BT.2020 with PQ, is ignored and the gAMA chunk applies as if it were alone
+    const uint8_t cicp_pq[4] = {9, 16, 0, 1};
+    uint8_t pq_chunks[64];
+    const size_t pq_size = put_chunk(pq_chunks, put_chunk(pq_chunks, 0, "cICP", cicp_pq, sizeof(cicp_pq)), "gAMA", gama, sizeof(gama));
+    struct image_t expected;
+    size_t size = build_png(png, 3, 1, 8, 2, pq_chunks + 16, pq_size - 16, filtered, sizeof(filtered), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &expected), ==, 0);
+    munit_assert_int(memcmp(expected.data, filtered + 1, sizeof(filtered) - 1), !=, 0);
+    struct image_t image;
+    size = build_png(png, 3, 1, 8, 2, pq_chunks, pq_size, filtered, sizeof(filtered), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    munit_assert_memory_equal(sizeof(filtered) - 1, image.data, expected.data);
+    close_png(&image);
+    close_png(&expected);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+// Matrix/TRC profile with one parametric curve shared by every channel, colorants are null for GRAY
+static uint32_t build_icc_profile(uint8_t *profile, const int32_t (*colorants)[3], uint32_t gamma)
+{
+    const uint32_t tag_count = colorants == NULL ? 1 : 6;
+    const uint32_t curve_offset = 128 + 4 + tag_count * 12 + (tag_count - 1) * 20;
+    const uint32_t size = curve_offset + 16;
+    memset(profile, 0, size);
+    put_u32(profile, size);
+    memcpy(profile + 12, "mntr", 4);
+    memcpy(profile + 16, colorants == NULL ? "GRAY" : "RGB ", 4);
+    memcpy(profile + 20, "XYZ ", 4);
+    memcpy(profile + 36, "acsp", 4);
+    put_u32(profile + 128, tag_count);
+
+    const char *colorant_tags[3] = {"rXYZ", "gXYZ", "bXYZ"};
+    const char *curve_tags[3] = {"rTRC", "gTRC", "bTRC"};
+    uint8_t *entry = profile + 132;
+    for (uint32_t c = 0; colorants != NULL && c < 3; ++c, entry += 12)
+    {
+        const uint32_t offset = 128 + 4 + tag_count * 12 + c * 20;
+        memcpy(entry, colorant_tags[c], 4);
+        put_u32(entry + 4, offset);
+        put_u32(entry + 8, 20);
+        memcpy(profile + offset, "XYZ ", 4);
+        for (int i = 0; i < 3; ++i)
+        {
+            put_u32(profile + offset + 8 + i * 4, (uint32_t)colorants[c][i]);
+        }
+    }
+    for (uint32_t c = 0; c < (colorants == NULL ? 1u : 3u); ++c, entry += 12)
+    {
+        memcpy(entry, colorants == NULL ? "kTRC" : curve_tags[c], 4);
+        put_u32(entry + 4, curve_offset);
+        put_u32(entry + 8, 16);
+    }
+    memcpy(profile + curve_offset, "para", 4);
+    put_u32(profile + curve_offset + 12, gamma);
+    return size;
+}
+
+static size_t put_iccp(uint8_t *chunks, size_t offset, const uint8_t *profile, uint32_t profile_size)
+{
+    uint8_t body[512];
+    memcpy(body, "test", 5);
+    body[5] = 0;
+    const uint32_t stream_size = (uint32_t)put_stored_zlib(body + 6, profile, profile_size, STORED_BLOCK_MAX);
+    return put_chunk(chunks, offset, "iCCP", body, stream_size + 6);
+}
+
+static uint8_t encode_srgb_8(double linear)
+{
+    return (uint8_t)((linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055) * 255.0 + 0.5);
+}
+
+MunitResult png_icc_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    // sRGB colorants adapted to D50 with linear curves, so samples only gain the sRGB encoding
+    const int32_t colorants[3][3] = {{28579, 14582, 913}, {25236, 46981, 6364}, {9377, 3973, 46804}};
+    uint8_t profile[512];
+    uint8_t chunks[2][640];
+    size_t chunks_sizes[2];
+    chunks_sizes[0] = put_iccp(chunks[0], 0, profile, build_icc_profile(profile, colorants, 0x10000));
+    chunks_sizes[1] = put_iccp(chunks[1], 0, profile, build_icc_profile(profile, NULL, 0x10000));
+    uint8_t gama[4];
+    put_u32(gama, 22727);
+    chunks_sizes[1] = put_chunk(chunks[1], chunks_sizes[1], "gAMA", gama, sizeof(gama));
+
+    uint8_t filtered[1 + 4 * 3] = {0, 0, 0, 0, 16, 16, 16, 128, 128, 128, 255, 255, 255};
+    uint8_t png[SEGMENT_PNG_MAX];
+    struct image_t image;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Twice, the second decode takes the transform from the cache
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size_t size = build_png(png, 4, 1, 8, 2, chunks[0], chunks_sizes[0], filtered, sizeof(filtered), 0);
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        for (int i = 0; i < 12; ++i)
+        {
+            munit_assert_int(abs(image.data[i] - encode_srgb_8(filtered[1 + i] / 255.0)), <=, 1);
+        }
+        close_png(&image);
+    }
+
+    // A GRAY profile does not fit an RGB image, it is ignored and the gAMA chunk applies
+    size_t size = build_png(png, 4, 1, 8, 2, chunks[1], chunks_sizes[1], filtered, sizeof(filtered), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    for (int i = 0; i < 12; ++i)
+    {
+        munit_assert_uint8(image.data[i], ==, (uint8_t)(pow(filtered[1 + i] / 255.0, 45455.0 / 22727) * 255.0 + 0.5));
+    }
+    close_png(&image);
+
+    // A truncated profile fails both times, the second time from the cache, and the gAMA chunk applies
+    uint8_t broken[640];
+    size_t broken_size = put_iccp(broken, 0, profile, 100);
+    broken_size = put_chunk(broken, broken_size, "gAMA", gama, sizeof(gama));
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size = build_png(png, 4, 1, 8, 2, broken, broken_size, filtered, sizeof(filtered), 0);
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        for (int i = 0; i < 12; ++i)
+        {
+            munit_assert_uint8(image.data[i], ==, (uint8_t)(pow(filtered[1 + i] / 255.0, 45455.0 / 22727) * 255.0 + 0.5));
+        }
+        close_png(&image);
+    }
+
+    // 16-bit greyscale through the GRAY profile
+    const uint16_t samples[4] = {0x0000, 0x0100, 0x4000, 0xffff};
+    uint8_t filtered_16[1 + 4 * 2] = {0};
+    for (int i = 0; i < 4; ++i)
+    {
+        filtered_16[1 + i * 2] = (uint8_t)(samples[i] >> 8);
+        filtered_16[2 + i * 2] = (uint8_t)samples[i];
+    }
+    size = build_png(png, 4, 1, 16, 0, chunks[1], chunks_sizes[1], filtered_16, sizeof(filtered_16), 0);
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    for (int i = 0; i < 4; ++i)
+    {
+        const double linear = samples[i] / 65535.0;
+        const double expected = (linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055) * 65535.0;
+        munit_assert_double((image.data[i * 2] << 8) | image.data[i * 2 + 1], >=, expected - 2);
+        munit_assert_double((image.data[i * 2] << 8) | image.data[i * 2 + 1], <=, expected + 2);
+    }
+    close_png(&image);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+// Pseudo-random samples for format and alpha tests, callers pick widths covering whole vector blocks and a scalar tail
+struct random_png_t
+{
+    uint8_t png[SEGMENT_PNG_MAX * 2];
+    size_t size;
+    uint8_t pixels[SEGMENT_PNG_MAX]; // Unfiltered samples to check decodes against
+    uint32_t stride;
+    uint32_t channels;
+};
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c)
+{
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Rows take the Up, Average and Paeth filters in turn, so decodes that stage rows in place still see their neighbours
+// Images with alpha start with a fully opaque and a fully transparent pixel
+static void build_random_png(struct random_png_t *random, uint32_t width, uint32_t height, uint8_t bit_depth, uint8_t colour_type, const uint8_t *chunks, size_t chunks_size)
+{
+    const uint32_t channels[7] = {1, 0, 3, 0, 2, 0, 4};
+    const uint32_t sample_size = bit_depth / 8;
+    const uint32_t pixel_size = channels[colour_type] * sample_size;
+    random->channels = channels[colour_type];
+    random->stride = width * pixel_size;
+    uint8_t filtered[SEGMENT_PNG_MAX];
+    munit_assert_uint32((random->stride + 1) * height, <=, sizeof(filtered));
+    uint32_t seed = width * 7919u + height * 31u + bit_depth * 17u + colour_type;
+    for (uint32_t i = 0; i < random->stride * height; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        random->pixels[i] = (uint8_t)(seed >> 16);
+    }
+    if (colour_type == 4 || colour_type == 6)
+    {
+        memset(random->pixels + pixel_size - sample_size, 0xff, sample_size);
+        memset(random->pixels + pixel_size * 2 - sample_size, 0x00, sample_size);
+    }
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        const uint8_t *row = random->pixels + y * random->stride;
+        const uint8_t *previous = row - random->stride;
+        uint8_t *scanline = filtered + y * (random->stride + 1);
+        scanline[0] = (uint8_t)(2 + y % 3);
+        for (uint32_t x = 0; x < random->stride; ++x)
+        {
+            const uint8_t a = x >= pixel_size ? row[x - pixel_size] : 0;
+            const uint8_t b = y > 0 ? previous[x] : 0;
+            const uint8_t c = y > 0 && x >= pixel_size ? previous[x - pixel_size] : 0;
+            const uint8_t prediction = scanline[0] == 2 ? b : scanline[0] == 3 ? (uint8_t)((a + b) / 2) : paeth_predictor(a, b, c);
+            scanline[1 + x] = (uint8_t)(row[x] - prediction);
+        }
+    }
+    random->size = build_png(random->png, width, height, bit_depth, colour_type, chunks, chunks_size, filtered, (random->stride + 1) * height, 0);
+}
+
+// Threaded decodes convert the whole image after it is unfiltered, in row bands as small as one row
+static void set_threaded(struct png_decoder_options_t *options)
+{
+    options->flags |= PNG_DECODE_PARALLEL_ROWS | PNG_DECODE_ROW_BANDS;
+    options->thread_count = 2;
+    options->split_threshold = 1;
+}
+
+// Decodes three rows of pixels with alpha and compares them with an exact blend onto background
+static void check_flatten(struct png_decoder_t *decoder, uint32_t width, uint8_t bit_depth, uint8_t colour_type, const uint8_t *chunks, size_t chunks_size, const uint16_t *background)
+{
+    const uint32_t channels = colour_type == 6 ? 3 : 1;
+    const uint32_t sample_size = bit_depth / 8;
+    struct random_png_t random;
+    build_random_png(&random, width, 3, bit_depth, colour_type, chunks, chunks_size);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, random.png, random.size, &image), ==, 0);
+    munit_assert_int(image.mode, ==, channels == 3 ? RGB : G);
+    munit_assert_uint32(image.stride, ==, width * channels * sample_size);
+    for (uint32_t y = 0; y < 3; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            const uint8_t *pixel = random.pixels + y * random.stride + x * (channels + 1) * sample_size;
+            const uint8_t *out = image.data + y * image.stride + x * channels * sample_size;
+            const uint64_t max = bit_depth == 16 ? 0xffff : 0xff;
+            const uint64_t alpha = bit_depth == 16 ? (uint64_t)((pixel[channels * 2] << 8) | pixel[channels * 2 + 1]) : pixel[channels];
+            for (uint32_t c = 0; c < channels; ++c)
+            {
+                const uint64_t sample = bit_depth == 16 ? (uint64_t)((pixel[c * 2] << 8) | pixel[c * 2 + 1]) : pixel[c];
+                const uint64_t sum = sample * alpha + background[c] * (max - alpha);
+                const uint64_t expected = bit_depth == 16 ? (sum + 0x7fff) / 0xffff : (2 * sum + 0xff) / 0x1fe;
+                const uint64_t decoded = bit_depth == 16 ? (uint64_t)((out[c * 2] << 8) | out[c * 2 + 1]) : out[c];
+                munit_assert_uint64(decoded, ==, expected);
+            }
+        }
+    }
+    close_png(&image);
+}
+
+MunitResult png_flatten_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    struct png_decoder_options_t options = {.flags = PNG_DECODE_FLATTEN_ALPHA, .background = {0x1234, 0x8080, 0xffff}};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    // Caller colour at the output bit depth, greyscale takes its luma
+    const uint16_t rgb_8[3] = {0x12, 0x80, 0xff};
+    const uint16_t grey_8[1] = {0x72};
+    const uint16_t rgb_16[3] = {0x1234, 0x8080, 0xffff};
+    const uint16_t grey_16[1] = {0x7242};
+    check_flatten(decoder, 23, 8, 6, NULL, 0, rgb_8);
+    check_flatten(decoder, 19, 8, 4, NULL, 0, grey_8);
+    check_flatten(decoder, 7, 16, 6, NULL, 0, rgb_16);
+    check_flatten(decoder, 9, 16, 4, NULL, 0, grey_16);
+
+    // bKGD wins unless the caller colour is forced
+    const uint8_t bkgd[6] = {0x00, 0x40, 0x00, 0x00, 0x00, 0xc8};
+    const uint16_t bkgd_8[3] = {0x40, 0x00, 0xc8};
+    uint8_t chunks[32];
+    const size_t chunks_size = put_chunk(chunks, 0, "bKGD", bkgd, sizeof(bkgd));
+    check_flatten(decoder, 23, 8, 6, chunks, chunks_size, bkgd_8);
+    options.flags |= PNG_DECODE_FORCE_BACKGROUND;
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    check_flatten(decoder, 23, 8, 6, chunks, chunks_size, rgb_8);
+
+    options.flags = PNG_DECODE_FLATTEN_ALPHA;
+    set_threaded(&options);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    check_flatten(decoder, 23, 8, 6, chunks, chunks_size, bkgd_8);
+    check_flatten(decoder, 9, 16, 4, NULL, 0, grey_16);
+
+    // tRNS alpha is flattened too
+    const uint8_t trns[6] = {0x00, 0x10, 0x00, 0x20, 0x00, 0x30};
+    uint8_t trns_chunks[32];
+    const size_t trns_size = put_chunk(trns_chunks, 0, "tRNS", trns, sizeof(trns));
+    uint8_t filtered[1 + 2 * 3] = {0, 0x10, 0x20, 0x30, 0x11, 0x22, 0x33};
+    uint8_t png[SEGMENT_PNG_MAX];
+    size_t size = build_png(png, 2, 1, 8, 2, trns_chunks, trns_size, filtered, sizeof(filtered), 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+    munit_assert_int(image.mode, ==, RGB);
+    const uint8_t expected[6] = {0x12, 0x80, 0xff, 0x11, 0x22, 0x33};
+    munit_assert_memory_equal(sizeof(expected), image.data, expected);
+    close_png(&image);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+static void check_format(struct png_decoder_t *decoder, uint32_t width, uint8_t bit_depth, uint8_t colour_type, enum png_output_format_t format, bool premultiply)
+{
+    struct random_png_t random;
+    build_random_png(&random, width, 3, bit_depth, colour_type, NULL, 0);
+    const uint32_t n = random.channels;
+    const bool alpha = colour_type == 4 || colour_type == 6;
+    const uint32_t colours = alpha ? n - 1 : n;
+    const uint32_t sample_size = bit_depth / 8;
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, random.png, random.size, &image), ==, 0);
+    munit_assert_int(image.format, ==, format);
+    munit_assert_int(image.premultiplied, ==, premultiply && alpha);
+
+    const bool source = format == PNG_FORMAT_SOURCE || format == PNG_FORMAT_SOURCE_8 || format == PNG_FORMAT_NATIVE_16;
+    const uint32_t output_size = source ? n * (format == PNG_FORMAT_SOURCE_8 ? 1 : sample_size) : 4;
+    const uint8_t output_depth = source && format != PNG_FORMAT_SOURCE_8 ? bit_depth : 8;
+    munit_assert_uint8(image.bit_depth, ==, output_depth);
+    munit_assert_uint32(image.stride, ==, width * output_size);
+    for (uint32_t y = 0; y < 3; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            const uint8_t *pixel = random.pixels + y * random.stride + x * n * sample_size;
+            const uint8_t *out = image.data + y * image.stride + x * output_size;
+            const uint64_t max = bit_depth == 16 ? 0xffff : 0xff;
+            uint64_t samples[4];
+            for (uint32_t c = 0; c < n; ++c)
+            {
+                samples[c] = bit_depth == 16 ? (uint64_t)((pixel[c * 2] << 8) | pixel[c * 2 + 1]) : pixel[c];
+            }
+            for (uint32_t c = 0; premultiply && alpha && c < colours; ++c)
+            {
+                samples[c] = (2 * samples[c] * samples[colours] + max) / (2 * max);
+            }
+            for (uint32_t c = 0; bit_depth == 16 && output_depth == 8 && c < n; ++c)
+            {
+                samples[c] = (2 * samples[c] + 257) / 514;
+            }
+
+            if (source)
+            {
+                for (uint32_t c = 0; c < n; ++c)
+                {
+                    uint64_t decoded = out[c];
+                    if (output_depth == 16 && format == PNG_FORMAT_NATIVE_16)
+                    {
+                        uint16_t native;
+                        memcpy(&native, out + c * 2, sizeof(native));
+                        decoded = native;
+                    }
+                    else if (output_depth == 16)
+                    {
+                        decoded = (uint64_t)((out[c * 2] << 8) | out[c * 2 + 1]);
+                    }
+                    munit_assert_uint64(decoded, ==, samples[c]);
+                }
+                continue;
+            }
+
+            const bool bgr = format == PNG_FORMAT_BGRA8 || format == PNG_FORMAT_BGRX8;
+            const bool padded = format == PNG_FORMAT_RGBX8 || format == PNG_FORMAT_BGRX8;
+            const uint64_t red = samples[0];
+            const uint64_t green = samples[colours == 3 ? 1 : 0];
+            const uint64_t blue = samples[colours == 3 ? 2 : 0];
+            munit_assert_uint8(out[0], ==, bgr ? blue : red);
+            munit_assert_uint8(out[1], ==, green);
+            munit_assert_uint8(out[2], ==, bgr ? red : blue);
+            munit_assert_uint8(out[3], ==, alpha && !padded ? samples[colours] : 0xff);
+        }
+    }
+    close_png(&image);
+}
+
+MunitResult png_format_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    struct png_decoder_options_t options = {.format = PNG_FORMAT_RGBA8};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+
+    check_format(decoder, 21, 8, 0, PNG_FORMAT_RGBA8, false);
+    check_format(decoder, 21, 8, 2, PNG_FORMAT_RGBA8, false);
+    check_format(decoder, 21, 8, 4, PNG_FORMAT_RGBA8, false);
+    check_format(decoder, 21, 16, 6, PNG_FORMAT_RGBA8, false);
+
+    const enum png_output_format_t formats[] = {PNG_FORMAT_BGRA8, PNG_FORMAT_RGBX8, PNG_FORMAT_BGRX8, PNG_FORMAT_SOURCE_8, PNG_FORMAT_NATIVE_16};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    {
+        options.format = formats[i];
+        options.flags = PNG_DECODE_DEFAULT;
+        munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+        check_format(decoder, 21, 8, 6, formats[i], false);
+        check_format(decoder, 19, 16, 2, formats[i], false);
+        check_format(decoder, 13, 16, 6, formats[i], false);
+        options.flags = PNG_DECODE_PREMULTIPLY;
+        munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+        check_format(decoder, 21, 8, 6, formats[i], true);
+        check_format(decoder, 13, 16, 4, formats[i], true);
+    }
+
+    // Premultiplied source samples keep their bit depth
+    options.format = PNG_FORMAT_SOURCE;
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    check_format(decoder, 13, 16, 6, PNG_FORMAT_SOURCE, true);
+
+    options.format = PNG_FORMAT_BGRA8;
+    options.flags = PNG_DECODE_PREMULTIPLY;
+    set_threaded(&options);
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    check_format(decoder, 21, 8, 6, PNG_FORMAT_BGRA8, true);
+    check_format(decoder, 13, 16, 2, PNG_FORMAT_BGRA8, true);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+static double half_value(uint16_t half)
+{
+    const int exponent = (half >> 10) & 0x1f;
+    const double magnitude = exponent == 0 ? ldexp(half & 0x3ff, -24) : ldexp((half & 0x3ff) | 0x400, exponent - 25);
+    return (half & 0x8000) ? -magnitude : magnitude;
+}
+
+// Planar samples of a decoded image against the interleaved source samples
+static void check_planes(const struct image_t *image, const uint8_t *source, uint32_t source_stride, uint8_t bit_depth, uint32_t channels, bool premultiply, const float *scale, const float *bias)
+{
+    const uint32_t sample_size = bit_depth / 8;
+    const double max = bit_depth == 16 ? 0xffff : 0xff;
+    for (uint32_t y = 0; y < image->height; ++y)
+    {
+        for (uint32_t x = 0; x < image->width; ++x)
+        {
+            const uint8_t *pixel = source + y * source_stride + x * channels * sample_size;
+            const double alpha = bit_depth == 16 ? ((pixel[(channels - 1) * 2] << 8) | pixel[(channels - 1) * 2 + 1]) : pixel[channels - 1];
+            for (uint32_t c = 0; c < channels; ++c)
+            {
+                double sample = bit_depth == 16 ? ((pixel[c * 2] << 8) | pixel[c * 2 + 1]) : pixel[c];
+                if (premultiply && c < channels - 1)
+                {
+                    sample = floor(sample * alpha / max + 0.5);
+                }
+                const double expected = sample * (scale[c] != 0.0f ? scale[c] : 1.0 / max) + bias[c];
+                const uint8_t *out = image->data + c * image->plane_size + (size_t)y * image->stride;
+                double decoded;
+                double tolerance;
+                if (image->format == PNG_FORMAT_PLANAR_F32)
+                {
+                    float value;
+                    memcpy(&value, out + x * 4, sizeof(value));
+                    decoded = value;
+                    tolerance = fabs(expected) * 1e-6 + 1e-6;
+                }
+                else
+                {
+                    uint16_t half;
+                    memcpy(&half, out + x * 2, sizeof(half));
+                    decoded = half_value(half);
+                    tolerance = fabs(expected) * ldexp(1.0, -11) + ldexp(1.0, -24);
+                }
+                munit_assert_double(fabs(decoded - expected), <=, tolerance);
+            }
+        }
+    }
+}
+
+static void check_planar(struct png_decoder_t *decoder, uint32_t width, uint8_t bit_depth, uint8_t colour_type, const struct png_decoder_options_t *options)
+{
+    struct random_png_t random;
+    build_random_png(&random, width, 3, bit_depth, colour_type, NULL, 0);
+    const uint32_t n = random.channels;
+    munit_assert_int(png_decoder_set_options(decoder, options), ==, 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, random.png, random.size, &image), ==, 0);
+    const uint8_t output_depth = options->format == PNG_FORMAT_PLANAR_F32 ? 32 : 16;
+    munit_assert_int(image.format, ==, options->format);
+    munit_assert_uint8(image.bit_depth, ==, output_depth);
+    munit_assert_uint32(image.stride, ==, width * output_depth / 8);
+    munit_assert_size(image.plane_size, ==, (size_t)image.stride * 3);
+    munit_assert_uint32(image.size, ==, image.plane_size * n);
+    const bool premultiply = (options->flags & PNG_DECODE_PREMULTIPLY) && (n == 2 || n == 4);
+    check_planes(&image, random.pixels, random.stride, bit_depth, n, premultiply, options->scale, options->bias);
+    close_png(&image);
+}
+
+MunitResult png_planar_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    struct png_decoder_options_t options = {.format = PNG_FORMAT_PLANAR_F32};
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Default scale maps samples to [0, 1]
+    check_planar(decoder, 23, 8, 2, &options);
+    check_planar(decoder, 23, 8, 0, &options);
+    check_planar(decoder, 11, 16, 6, &options);
+
+    // ImageNet style mean and standard deviation
+    const float mean[3] = {0.485f, 0.456f, 0.406f};
+    const float std[3] = {0.229f, 0.224f, 0.225f};
+    for (int c = 0; c < 3; ++c)
+    {
+        options.scale[c] = 1.0f / (255.0f * std[c]);
+        options.bias[c] = -mean[c] / std[c];
+    }
+    check_planar(decoder, 23, 8, 2, &options);
+    options.format = PNG_FORMAT_PLANAR_F16;
+    check_planar(decoder, 23, 8, 2, &options);
+    options.scale[0] = 0.0f;
+    options.bias[0] = 0.0f;
+    check_planar(decoder, 13, 16, 4, &options);
+    options.flags = PNG_DECODE_PREMULTIPLY;
+    check_planar(decoder, 13, 8, 6, &options);
+
+    options.format = PNG_FORMAT_PLANAR_F32;
+    options.flags = PNG_DECODE_DEFAULT;
+    set_threaded(&options);
+    check_planar(decoder, 23, 8, 2, &options);
+
+    // Decoded straight into the second slot of a tensor batch
+    char *image_path = build_image_path(params[0].value, "basn2c08.png");
+    struct image_t expected;
+    munit_assert_int(load_png(image_path, &expected), ==, 0);
+    struct png_info_t info;
+    munit_assert_int(png_probe(image_path, &info, PNG_PROBE_SKIP_IDAT_CRC), ==, 0);
+    struct png_layout_t layout = {.format = PNG_FORMAT_PLANAR_F32};
+    munit_assert_int(png_plan_layout(&info, &layout), ==, 0);
+    close_probe(&info);
+    munit_assert_uint8(layout.bit_depth, ==, 32);
+    munit_assert_size(layout.size, ==, (size_t)expected.width * expected.height * 3 * sizeof(float));
+
+    options.flags = PNG_DECODE_DEFAULT;
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    float *tensor = malloc(layout.size * 2);
+    munit_assert_not_null(tensor);
+    struct image_t image;
+    uint8_t *slot = (uint8_t *)tensor + layout.size;
+    munit_assert_int(png_decoder_load_into(decoder, image_path, &layout, slot, layout.size, &image), ==, 0);
+    munit_assert_ptr_equal(image.data, slot);
+    munit_assert_size(image.plane_size, ==, layout.size / 3);
+    check_planes(&image, expected.data, expected.stride, 8, 3, false, options.scale, options.bias);
+    close_png(&image);
+    free(tensor);
+    close_png(&expected);
+    free(image_path);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+// 8-bit red, green and blue of one decoded pixel, 16-bit samples rounded and colours multiplied by alpha when asked
+static void reference_rgb(const uint8_t *pixel, uint32_t channels, uint8_t bit_depth, bool premultiply, uint32_t *rgb)
+{
+    const uint32_t colours = (channels == 2 || channels == 4) ? channels - 1 : channels;
+    const uint64_t max = bit_depth == 16 ? 0xffff : 0xff;
+    uint64_t samples[4];
+    for (uint32_t c = 0; c < channels; ++c)
+    {
+        samples[c] = bit_depth == 16 ? (uint64_t)((pixel[c * 2] << 8) | pixel[c * 2 + 1]) : pixel[c];
+    }
+    for (uint32_t c = 0; premultiply && c < colours; ++c)
+    {
+        samples[c] = (2 * samples[c] * samples[colours] + max) / (2 * max);
+    }
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        const uint64_t sample = samples[colours == 3 ? c : 0];
+        rgb[c] = (uint32_t)(bit_depth == 16 ? (2 * sample + 257) / 514 : sample);
+    }
+}
+
+static uint8_t reference_yuv(const uint32_t *rgb, uint32_t component, enum png_yuv_matrix_t matrix)
+{
+    const int32_t weights[2][3][3] = {{{66, 129, 25}, {-38, -74, 112}, {112, -94, -18}}, {{47, 157, 16}, {-26, -86, 112}, {112, -102, -10}}};
+    const int32_t *w = weights[matrix][component];
+    return (uint8_t)(((component == 0 ? 16 : 128) * 256 + 128 + w[0] * (int32_t)rgb[0] + w[1] * (int32_t)rgb[1] + w[2] * (int32_t)rgb[2]) >> 8);
+}
+
+static void check_yuv(struct png_decoder_t *decoder, uint32_t width, uint32_t height, uint8_t bit_depth, uint8_t colour_type, const struct png_decoder_options_t *options)
+{
+    struct random_png_t random;
+    build_random_png(&random, width, height, bit_depth, colour_type, NULL, 0);
+    const uint32_t n = random.channels;
+    munit_assert_int(png_decoder_set_options(decoder, options), ==, 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, random.png, random.size, &image), ==, 0);
+    munit_assert_int(image.format, ==, options->format);
+    munit_assert_uint8(image.bit_depth, ==, 8);
+    munit_assert_uint32(image.stride, ==, width);
+    munit_assert_size(image.plane_size, ==, (size_t)width * height);
+
+    const bool subsampled = options->format != PNG_FORMAT_I444;
+    const uint32_t chroma_width = subsampled ? (width + 1) / 2 : width;
+    const uint32_t chroma_height = subsampled ? (height + 1) / 2 : height;
+    munit_assert_uint32(image.chroma_stride, ==, options->format == PNG_FORMAT_I420 ? (width + 1) / 2 : options->format == PNG_FORMAT_NV12 ? (width + 1) & ~1u : width);
+    munit_assert_uint32(image.size, ==, image.plane_size + (size_t)image.chroma_stride * chroma_height * (options->format == PNG_FORMAT_NV12 ? 1 : 2));
+    const bool premultiply = (options->flags & PNG_DECODE_PREMULTIPLY) && (n == 2 || n == 4);
+    const uint32_t pixel_size = n * (bit_depth / 8);
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            uint32_t rgb[3];
+            reference_rgb(random.pixels + y * random.stride + x * pixel_size, n, bit_depth, premultiply, rgb);
+            munit_assert_uint8(image.data[y * image.stride + x], ==, reference_yuv(rgb, 0, options->yuv_matrix));
+        }
+    }
+
+    const uint8_t *u_plane = image.data + image.plane_size;
+    const uint8_t *v_plane = u_plane + (size_t)image.chroma_stride * chroma_height;
+    for (uint32_t y = 0; y < chroma_height; ++y)
+    {
+        for (uint32_t x = 0; x < chroma_width; ++x)
+        {
+            // Means of 2x2 pixels, the last row and column repeat at odd sizes
+            uint32_t mean[3] = {0, 0, 0};
+            const uint32_t rows[2] = {subsampled ? y * 2 : y, subsampled && y * 2 + 1 < height ? y * 2 + 1 : (subsampled ? y * 2 : y)};
+            const uint32_t columns[2] = {subsampled ? x * 2 : x, subsampled && x * 2 + 1 < width ? x * 2 + 1 : (subsampled ? x * 2 : x)};
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                uint32_t rgb[3];
+                reference_rgb(random.pixels + rows[i / 2] * random.stride + columns[i % 2] * pixel_size, n, bit_depth, premultiply, rgb);
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    mean[c] += rgb[c];
+                }
+            }
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                mean[c] = (mean[c] + 2) / 4;
+            }
+            const bool interleaved = options->format == PNG_FORMAT_NV12;
+            const uint8_t u = interleaved ? u_plane[y * image.chroma_stride + x * 2] : u_plane[y * image.chroma_stride + x];
+            const uint8_t v = interleaved ? u_plane[y * image.chroma_stride + x * 2 + 1] : v_plane[y * image.chroma_stride + x];
+            munit_assert_uint8(u, ==, reference_yuv(mean, 1, options->yuv_matrix));
+            munit_assert_uint8(v, ==, reference_yuv(mean, 2, options->yuv_matrix));
+        }
+    }
+    close_png(&image);
+}
+
+MunitResult png_yuv_test(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // White and black reach the limited range ends, greys have neutral chroma
+    const uint32_t white[3] = {255, 255, 255};
+    const uint32_t black[3] = {0, 0, 0};
+    for (int matrix = PNG_YUV_BT601; matrix <= PNG_YUV_BT709; ++matrix)
+    {
+        munit_assert_uint8(reference_yuv(white, 0, matrix), ==, 235);
+        munit_assert_uint8(reference_yuv(black, 0, matrix), ==, 16);
+        munit_assert_uint8(reference_yuv(white, 1, matrix), ==, 128);
+        munit_assert_uint8(reference_yuv(white, 2, matrix), ==, 128);
+    }
+
+    // Odd sizes, whole 16 pixel blocks and scalar tails
+    const enum png_output_format_t formats[] = {PNG_FORMAT_I444, PNG_FORMAT_I420, PNG_FORMAT_NV12};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    {
+        struct png_decoder_options_t options = {.format = formats[i]};
+        check_yuv(decoder, 37, 5, 8, 2, &options);
+        check_yuv(decoder, 32, 4, 8, 6, &options);
+        options.yuv_matrix = PNG_YUV_BT709;
+        check_yuv(decoder, 19, 3, 16, 6, &options);
+        check_yuv(decoder, 17, 7, 8, 0, &options);
+        options.flags = PNG_DECODE_PREMULTIPLY;
+        check_yuv(decoder, 21, 5, 8, 4, &options);
+
+        // Row bands split at odd rows keep their pairs together
+        options.flags = PNG_DECODE_DEFAULT;
+        set_threaded(&options);
+        check_yuv(decoder, 33, 5, 8, 2, &options);
+        check_yuv(decoder, 2, 136, 8, 2, &options);
+    }
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+// Sample x of a row packed most significant bits first
+static uint32_t packed_sample(const uint8_t *row, uint32_t x, uint8_t bit_depth)
+{
+    const uint32_t bit = x * bit_depth;
+    return (row[bit >> 3] >> (8 - bit_depth - (bit & 0x07))) & ((1u << bit_depth) - 1);
+}
+
+// Indices looked up in the returned palette, or grey samples scaled to 8 bits, match a default decode
+static void check_native(struct png_decoder_t *decoder, const char *image_path, enum png_output_format_t format, uint32_t flags, uint8_t expected_bit_depth)
+{
+    struct image_t expected;
+    munit_assert_int(load_png(image_path, &expected), ==, 0);
+    munit_assert_uint8(expected.bit_depth, ==, 8);
+    const struct png_decoder_options_t options = {.flags = flags, .thread_count = 2, .format = format};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+    munit_assert_int(image.format, ==, format);
+    munit_assert_int(image.mode, ==, G);
+    munit_assert_uint8(image.bit_depth, ==, expected_bit_depth);
+    munit_assert_uint32(image.stride, ==, (image.width * expected_bit_depth + 7) / 8);
+    munit_assert_uint32(image.size, ==, image.stride * image.height);
+
+    const uint32_t channels = expected.mode;
+    for (uint32_t y = 0; y < image.height; ++y)
+    {
+        for (uint32_t x = 0; x < image.width; ++x)
+        {
+            const uint32_t sample = packed_sample(image.data + y * image.stride, x, image.bit_depth);
+            const uint8_t *pixel = expected.data + y * expected.stride + x * channels;
+            if (image.palette_size == 0)
+            {
+                munit_assert_uint8(pixel[0], ==, sample * 255 / ((1u << image.bit_depth) - 1));
+                continue;
+            }
+            munit_assert_uint32(sample, <, image.palette_size);
+            for (uint32_t c = 0; c < channels; ++c)
+            {
+                munit_assert_uint8(image.palette[sample][c], ==, pixel[c]);
+            }
+            if (channels == 3)
+            {
+                munit_assert_uint8(image.palette[sample][3], ==, 0xff);
+            }
+        }
+    }
+    close_png(&image);
+    close_png(&expected);
+}
+
+MunitResult png_native_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Palette indices at every indexed bit depth, with and without tRNS, interlaced and threaded
+    const char *indexed[] = {"basn3p01.png", "basn3p02.png", "basn3p04.png", "basn3p08.png", "basn3p08-trns.png", "basn3p04-31i.png"};
+    const uint8_t indexed_depths[] = {1, 2, 4, 8, 8, 4};
+    for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); ++i)
+    {
+        char *image_path = build_image_path(params[0].value, indexed[i]);
+        check_native(decoder, image_path, PNG_FORMAT_INDEX8, PNG_DECODE_DEFAULT, 8);
+        check_native(decoder, image_path, PNG_FORMAT_PACKED, PNG_DECODE_DEFAULT, indexed_depths[i]);
+        check_native(decoder, image_path, PNG_FORMAT_INDEX8, PNG_DECODE_PARALLEL_PASSES | PNG_DECODE_PARALLEL_ROWS, 8);
+        check_native(decoder, image_path, PNG_FORMAT_PACKED, PNG_DECODE_PARALLEL_PASSES | PNG_DECODE_PARALLEL_ROWS, indexed_depths[i]);
+        free(image_path);
+    }
+
+    // Interlaced passes write bits of shared bytes, so they are unfiltered in turn
+    const char *grey[] = {"basn0g01.png", "basi0g01.png"};
+    for (size_t i = 0; i < sizeof(grey) / sizeof(grey[0]); ++i)
+    {
+        char *image_path = build_image_path(params[0].value, grey[i]);
+        check_native(decoder, image_path, PNG_FORMAT_PACKED, PNG_DECODE_DEFAULT, 1);
+        check_native(decoder, image_path, PNG_FORMAT_PACKED, PNG_DECODE_PARALLEL_PASSES, 1);
+        free(image_path);
+    }
+
+    // Rows keep their partial last byte, without gAMA the 2 and 4 bit samples scale exactly
+    struct png_decoder_options_t options = {.format = PNG_FORMAT_PACKED};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    for (uint8_t bit_depth = 2; bit_depth <= 4; bit_depth += 2)
+    {
+        const uint32_t width = 13;
+        const uint32_t scanline = 1 + (width * bit_depth + 7) / 8;
+        uint8_t filtered[3 * 8];
+        uint32_t seed = bit_depth;
+        for (uint32_t i = 0; i < scanline * 3; ++i)
+        {
+            seed = seed * 1103515245u + 12345u;
+            filtered[i] = (i % scanline == 0) ? 0 : (uint8_t)(seed >> 16);
+        }
+        uint8_t png[SEGMENT_PNG_MAX];
+        size_t size = build_png(png, width, 3, bit_depth, 0, NULL, 0, filtered, scanline * 3, 0);
+        struct image_t image;
+        munit_assert_int(png_decoder_load_memory(decoder, png, size, &image), ==, 0);
+        munit_assert_int(image.format, ==, PNG_FORMAT_PACKED);
+        munit_assert_uint8(image.bit_depth, ==, bit_depth);
+        munit_assert_uint32(image.stride, ==, scanline - 1);
+        for (uint32_t y = 0; y < 3; ++y)
+        {
+            const uint8_t *source = filtered + y * scanline + 1;
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                munit_assert_uint32(packed_sample(image.data + y * image.stride, x, bit_depth), ==, packed_sample(source, x, bit_depth));
+            }
+        }
+        close_png(&image);
+    }
+
+    // Other images fall back to their own channels and bit depth
+    char *image_path = build_image_path(params[0].value, "basn2c08.png");
+    options.format = PNG_FORMAT_INDEX8;
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load(decoder, image_path, &image), ==, 0);
+    munit_assert_int(image.format, ==, PNG_FORMAT_SOURCE);
+    munit_assert_int(image.mode, ==, RGB);
+    munit_assert_uint16(image.palette_size, ==, 0);
+    close_png(&image);
+    free(image_path);
+
+    // Packed rows planned for a bottom up caller buffer with aligned strides
+    image_path = build_image_path(params[0].value, "basn3p01.png");
+    struct png_info_t info;
+    munit_assert_int(png_probe(image_path, &info, PNG_PROBE_SKIP_IDAT_CRC), ==, 0);
+    struct png_layout_t layout = {.row_alignment = 8, .flags = PNG_LAYOUT_BOTTOM_UP, .format = PNG_FORMAT_PACKED};
+    munit_assert_int(png_plan_layout(&info, &layout), ==, 0);
+    close_probe(&info);
+    munit_assert_uint8(layout.bit_depth, ==, 1);
+    munit_assert_int(layout.mode, ==, G);
+    munit_assert_uint32(layout.stride, ==, 8);
+    munit_assert_size(layout.size, ==, (size_t)8 * layout.height);
+    options.format = PNG_FORMAT_PACKED;
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    uint8_t *buffer = malloc(layout.size);
+    munit_assert_not_null(buffer);
+    munit_assert_int(png_decoder_load_into(decoder, image_path, &layout, buffer, layout.size, &image), ==, 0);
+    struct image_t expected;
+    munit_assert_int(png_decoder_load(decoder, image_path, &expected), ==, 0);
+    for (uint32_t y = 0; y < expected.height; ++y)
+    {
+        munit_assert_memory_equal(expected.stride, buffer + (size_t)(layout.height - 1 - y) * layout.stride, expected.data + y * expected.stride);
+    }
+    munit_assert_uint16(image.palette_size, ==, 2);
+    close_png(&expected);
+    close_png(&image);
+    free(buffer);
+    free(image_path);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
+
+static void check_projection(struct png_decoder_t *decoder, uint32_t width, uint32_t height, uint8_t bit_depth, uint8_t colour_type, const struct png_decoder_options_t *options)
+{
+    struct random_png_t random;
+    build_random_png(&random, width, height, bit_depth, colour_type, NULL, 0);
+    const uint32_t n = random.channels;
+    const uint32_t pixel_size = n * (bit_depth / 8);
+    munit_assert_int(png_decoder_set_options(decoder, options), ==, 0);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_memory(decoder, random.png, random.size, &image), ==, 0);
+    munit_assert_int(image.format, ==, options->format);
+    munit_assert_int(image.mode, ==, G);
+    munit_assert_uint8(image.bit_depth, ==, 8);
+    munit_assert_uint32(image.stride, ==, width);
+    munit_assert_uint32(image.size, ==, width * height);
+
+    const bool alpha = n == 2 || n == 4;
+    const bool premultiply = (options->flags & PNG_DECODE_PREMULTIPLY) && alpha;
+    const uint32_t channel = options->format == PNG_FORMAT_ALPHA8 ? 3 : options->channel;
+    const uint32_t weights[2][3] = {{77, 150, 29}, {54, 183, 19}};
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            const uint8_t *pixel = random.pixels + y * random.stride + x * pixel_size;
+            uint32_t rgb[3];
+            reference_rgb(pixel, n, bit_depth, premultiply, rgb);
+            uint32_t expected;
+            if (options->format == PNG_FORMAT_LUMA8)
+            {
+                const uint32_t *w = weights[options->yuv_matrix];
+                expected = (w[0] * rgb[0] + w[1] * rgb[1] + w[2] * rgb[2] + 128) >> 8;
+            }
+            else if (channel < 3)
+            {
+                expected = rgb[channel];
+            }
+            else if (!alpha)
+            {
+                expected = 0xff;
+            }
+            else
+            {
+                const uint32_t a = bit_depth == 16 ? (uint32_t)((pixel[(n - 1) * 2] << 8) | pixel[(n - 1) * 2 + 1]) : pixel[n - 1];
+                expected = bit_depth == 16 ? (2 * a + 257) / 514 : a;
+            }
+            munit_assert_uint8(image.data[y * image.stride + x], ==, expected);
+        }
+    }
+    close_png(&image);
+}
+
+MunitResult png_projection_test(const MunitParameter params[], void *data)
+{
+    (void)data;
+    struct png_decoder_t *decoder = png_decoder_create(NULL);
+    munit_assert_not_null(decoder);
+
+    // Each channel of RGBA, GA and RGB images
+    for (uint8_t channel = 0; channel < 4; ++channel)
+    {
+        struct png_decoder_options_t options = {.format = PNG_FORMAT_CHANNEL8, .channel = channel};
+        check_projection(decoder, 37, 3, 8, 6, &options);
+        check_projection(decoder, 37, 3, 8, 4, &options);
+        check_projection(decoder, 21, 3, 8, 2, &options);
+        check_projection(decoder, 19, 3, 16, 6, &options);
+        options.flags = PNG_DECODE_PREMULTIPLY;
+        check_projection(decoder, 37, 3, 8, 6, &options);
+        check_projection(decoder, 19, 3, 16, 4, &options);
+    }
+
+    struct png_decoder_options_t options = {.format = PNG_FORMAT_ALPHA8};
+    check_projection(decoder, 37, 3, 8, 6, &options);
+    check_projection(decoder, 19, 3, 16, 4, &options);
+    check_projection(decoder, 21, 3, 8, 2, &options);
+
+    // Luma of greyscale images is the grey sample itself
+    options.format = PNG_FORMAT_LUMA8;
+    for (int matrix = PNG_YUV_BT601; matrix <= PNG_YUV_BT709; ++matrix)
+    {
+        options.yuv_matrix = matrix;
+        options.flags = PNG_DECODE_DEFAULT;
+        check_projection(decoder, 37, 3, 8, 6, &options);
+        check_projection(decoder, 21, 3, 8, 2, &options);
+        check_projection(decoder, 19, 3, 16, 2, &options);
+        check_projection(decoder, 23, 3, 8, 0, &options);
+        check_projection(decoder, 23, 3, 16, 4, &options);
+        options.flags = PNG_DECODE_PREMULTIPLY;
+        check_projection(decoder, 37, 3, 8, 6, &options);
+        check_projection(decoder, 23, 3, 8, 4, &options);
+    }
+
+    options.flags = PNG_DECODE_DEFAULT;
+    set_threaded(&options);
+    check_projection(decoder, 33, 7, 8, 6, &options);
+    options.format = PNG_FORMAT_ALPHA8;
+    check_projection(decoder, 33, 7, 8, 6, &options);
+
+    // Unknown channels, formats and matrices are rejected
+    options = (struct png_decoder_options_t){.channel = 4};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, -1);
+    options = (struct png_decoder_options_t){.format = (enum png_output_format_t)(PNG_FORMAT_CHANNEL8 + 1)};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, -1);
+    options = (struct png_decoder_options_t){.yuv_matrix = (enum png_yuv_matrix_t)(PNG_YUV_BT709 + 1)};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, -1);
+
+    // One byte per pixel planned for a caller buffer
+    char *image_path = build_image_path(params[0].value, "basn6a08.png");
+    struct png_info_t info;
+    munit_assert_int(png_probe(image_path, &info, PNG_PROBE_SKIP_IDAT_CRC), ==, 0);
+    struct png_layout_t layout = {.format = PNG_FORMAT_ALPHA8};
+    munit_assert_int(png_plan_layout(&info, &layout), ==, 0);
+    close_probe(&info);
+    munit_assert_int(layout.mode, ==, G);
+    munit_assert_uint8(layout.bit_depth, ==, 8);
+    munit_assert_size(layout.size, ==, (size_t)layout.width * layout.height);
+    struct image_t expected;
+    munit_assert_int(load_png(image_path, &expected), ==, 0);
+    munit_assert_int(expected.mode, ==, RGBA);
+    options = (struct png_decoder_options_t){.format = PNG_FORMAT_ALPHA8};
+    munit_assert_int(png_decoder_set_options(decoder, &options), ==, 0);
+    uint8_t *buffer = malloc(layout.size);
+    munit_assert_not_null(buffer);
+    struct image_t image;
+    munit_assert_int(png_decoder_load_into(decoder, image_path, &layout, buffer, layout.size, &image), ==, 0);
+    for (uint32_t i = 0; i < layout.width * layout.height; ++i)
+    {
+        munit_assert_uint8(buffer[i], ==, expected.data[i * 4 + 3]);
+    }
+    close_png(&image);
+    free(buffer);
+    close_png(&expected);
+    free(image_path);
+    png_decoder_destroy(decoder);
+    return MUNIT_OK;
+}
@@ -89,7 +89,7 @@ void *load_png_interlaced(const MunitParameter params[], void *user_data)
     return data;
 }
 
-void close_png(void *fixture)
+void free_png_data(void *fixture)
 {
     free(fixture);
 }
\ No newline at end of file
@@ -11,7 +11,7 @@ MunitResult zlib_uncompressed_test(const MunitParameter params[], void *uncompre
 {
     (void)params;
 
-    struct zlib_t zlib;
+    struct zlib_t zlib = {0};
     struct stream_ptr_t bitstream;
     struct data_buffer_t output;
     int zlib_callback_settings;
@@ -25,13 +25,14 @@ MunitResult zlib_uncompressed_test(const MunitParameter params[], void *uncompre
     zlib.state = READING_ZLIB_HEADER;
     zlib.bytes_read = 0;
     adler32_init(&zlib.adler32);
+    zlib.LZ77_buffer.data = malloc(ZLIB_BUFFER_MAX_SIZE);
 
     output.data = calloc(0x0C20, sizeof(uint8_t));
     output.index = 0;
 
     int result = decompress_zlib(&zlib, &bitstream, &output, zlib_callback_stub, &zlib_callback_settings);
 
-    munit_assert_int(result, ==, READ_COMPLETE);
+    munit_assert_int(result, ==, ZLIB_COMPLETE);
 
     munit_assert_uint8(zlib.header.CINFO, ==, 7);
     munit_assert_uint8(zlib.header.CM, ==, 8);
@@ -52,6 +53,7 @@ MunitResult zlib_uncompressed_test(const MunitParameter params[], void *uncompre
         munit_assert_uint8(output.data[test_index], ==, bitstream.data[test_index + 7]);
     }
 
+    free(zlib.LZ77_buffer.data);
     free(output.data);
 
     return MUNIT_OK;
@@ -61,7 +63,7 @@ MunitResult zlib_compressed_static_test(const MunitParameter params[], void *unc
 {
     (void)params;
 
-    struct zlib_t zlib;
+    struct zlib_t zlib = {0};
     struct stream_ptr_t bitstream;
     struct data_buffer_t output;
     int zlib_callback_settings;
@@ -75,13 +77,14 @@ MunitResult zlib_compressed_static_test(const MunitParameter params[], void *unc
     zlib.state = READING_ZLIB_HEADER;
     zlib.bytes_read = 0;
     adler32_init(&zlib.adler32);
+    zlib.LZ77_buffer.data = malloc(ZLIB_BUFFER_MAX_SIZE);
 
     output.data = calloc(288, sizeof(uint8_t));
     output.index = 0;
 
     int result = decompress_zlib(&zlib, &bitstream, &output, zlib_callback_stub, &zlib_callback_settings);
 
-    munit_assert_int(result, ==, READ_COMPLETE);
+    munit_assert_int(result, ==, ZLIB_COMPLETE);
 
     munit_assert_uint8(zlib.header.CINFO, ==, 7);
     munit_assert_uint8(zlib.header.CM, ==, 8);
@@ -95,6 +98,7 @@ MunitResult zlib_compressed_static_test(const MunitParameter params[], void *unc
     munit_assert_size(bitstream.byte_index, ==, 26);
     munit_assert_size(output.index, ==, 288);
 
+    free(zlib.LZ77_buffer.data);
     free(output.data);
 
     return MUNIT_OK;
@@ -104,7 +108,7 @@ MunitResult zlib_compressed_dynamic_test(const MunitParameter params[], void *un
 {
     (void)params;
 
-    struct zlib_t zlib;
+    struct zlib_t zlib = {0};
     struct stream_ptr_t bitstream;
     struct data_buffer_t output;
     int zlib_callback_settings;
@@ -118,14 +122,14 @@ MunitResult zlib_compressed_dynamic_test(const MunitParameter params[], void *un
     zlib.state = READING_ZLIB_HEADER;
     zlib.bytes_read = 0;
     adler32_init(&zlib.adler32);
-    zlib.LZ77_buffer.data = malloc(1024);
+    zlib.LZ77_buffer.data = malloc(ZLIB_BUFFER_MAX_SIZE);
 
     output.data = calloc(3104, sizeof(uint8_t));
     output.index = 0;
 
     int result = decompress_zlib(&zlib, &bitstream, &output, zlib_callback_stub, &zlib_callback_settings);
 
-    munit_assert_int(result, ==, READ_COMPLETE);
+    munit_assert_int(result, ==, ZLIB_COMPLETE);
 
     munit_assert_uint8(zlib.header.CINFO, ==, 7);
     munit_assert_uint8(zlib.header.CM, ==, 8);
@@ -148,6 +152,49 @@ MunitResult zlib_compressed_dynamic_test(const MunitParameter params[], void *un
     return MUNIT_OK;
 }
 
+MunitResult zlib_parallel_test(const MunitParameter params[], void *uncompressed_png_data)
+{
+    (void)params;
+
+    const size_t stream_size = 0x00DF - 0x0029;
+    const size_t output_size = 3104;
+    uint8_t *stream = calloc(stream_size + ZLIB_STREAM_PADDING, sizeof(uint8_t));
+    memcpy(stream, (const uint8_t *)uncompressed_png_data + 0x29, stream_size);
+
+    struct zlib_t zlib = {0};
+    struct stream_ptr_t bitstream = {.data = stream, .size = stream_size, .byte_index = 0, .bit_index = 0};
+    struct data_buffer_t expected = {.data = calloc(output_size, sizeof(uint8_t)), .index = 0};
+    int zlib_callback_settings;
+    zlib.state = READING_ZLIB_HEADER;
+    adler32_init(&zlib.adler32);
+    zlib.LZ77_buffer.data = malloc(ZLIB_BUFFER_MAX_SIZE);
+    munit_assert_int(decompress_zlib(&zlib, &bitstream, &expected, zlib_callback_stub, &zlib_callback_settings), ==, ZLIB_COMPLETE);
+
+    // Tiny regions start most guesses inside blocks, which must be caught and decoded again
+    struct thread_pool_t *pool = thread_pool_create(4);
+    munit_assert_not_null(pool);
+    uint8_t *output = malloc(output_size);
+    const size_t region_sizes[] = {4, 16, 64, ZLIB_REGION_SIZE_DEFAULT};
+    for (size_t i = 0; i < sizeof(region_sizes) / sizeof(region_sizes[0]); ++i)
+    {
+        memset(output, 0, output_size);
+        munit_assert_int(decompress_zlib_parallel(pool, NULL, stream, stream_size, region_sizes[i], output, output_size), ==, 0);
+        munit_assert_memory_equal(output_size, output, expected.data);
+    }
+
+    munit_assert_int(decompress_zlib_parallel(pool, NULL, stream, stream_size, 16, output, output_size - 1), ==, -1);
+    stream[bitstream.byte_index + 3] ^= 0x01; // Adler-32
+    munit_assert_int(decompress_zlib_parallel(pool, NULL, stream, stream_size, 16, output, output_size), ==, -1);
+
+    thread_pool_destroy(pool);
+    free(zlib.LZ77_buffer.data);
+    free(expected.data);
+    free(output);
+    free(stream);
+
+    return MUNIT_OK;
+}
+
 MunitResult zlib_btype_error_test(const MunitParameter params[], void *png_data)
 {
     (void)png_data;
@@ -190,7 +237,7 @@ MunitResult zlib_btype_error_test(const MunitParameter params[], void *png_data)
     }
 
     struct stream_ptr_t bitstream;
-    struct zlib_t zlib;
+    struct zlib_t zlib = {0};
     struct data_buffer_t output;
     int zlib_callback_settings;
 